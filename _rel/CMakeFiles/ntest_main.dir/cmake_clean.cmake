@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/ntest_main.dir/src/main.cpp.o"
+  "CMakeFiles/ntest_main.dir/src/main.cpp.o.d"
+  "libntest_main.a"
+  "libntest_main.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/ntest_main.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
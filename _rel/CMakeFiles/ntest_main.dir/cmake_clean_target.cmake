@@ -0,0 +1,3 @@
+file(REMOVE_RECURSE
+  "libntest_main.a"
+)
@@ -0,0 +1,13 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/ntest_selftest.dir/tests/core_tests.cpp.o"
+  "CMakeFiles/ntest_selftest.dir/tests/core_tests.cpp.o.d"
+  "CMakeFiles/ntest_selftest.dir/tests/self_tests.cpp.o"
+  "CMakeFiles/ntest_selftest.dir/tests/self_tests.cpp.o.d"
+  "ntest_selftest"
+  "ntest_selftest.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/ntest_selftest.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
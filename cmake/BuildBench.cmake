@@ -0,0 +1,102 @@
+# Times the build of a generated suite, once per header:
+#   cmake -DNTEST_ROOT=<repo> -DWORK_DIR=<dir> [-DFILES=100] [-DTESTS=100]
+#         [-DCXX=<compiler>] -P cmake/BuildBench.cmake
+# Each of FILES sources holds TESTS tests. The times are printed and
+# appended to WORK_DIR/build_times.csv so that runs can be compared.
+cmake_minimum_required(VERSION 3.23)  # TIMESTAMP %f
+
+if(NOT NTEST_ROOT OR NOT WORK_DIR)
+    message(FATAL_ERROR "NTEST_ROOT and WORK_DIR are required")
+endif()
+if(NOT FILES)
+    set(FILES 100)
+endif()
+if(NOT TESTS)
+    set(TESTS 100)
+endif()
+cmake_host_system_information(RESULT JOBS QUERY NUMBER_OF_LOGICAL_CORES)
+
+# One TIMESTAMP call, so the seconds and the fraction are of one instant.
+function(now_ms out)
+    string(TIMESTAMP now "%s;%f" UTC)
+    list(GET now 0 s)
+    list(GET now 1 us)
+    math(EXPR ms "${s} * 1000 + ${us} / 1000")
+    set(${out} ${ms} PARENT_SCOPE)
+endfunction()
+
+# One source per file, each with TESTS tests and a few assertions apiece.
+function(generate_suite dir header)
+    file(REMOVE_RECURSE ${dir})
+    set(sources "")
+    math(EXPR last_file "${FILES} - 1")
+    math(EXPR last_test "${TESTS} - 1")
+    foreach(f RANGE ${last_file})
+        set(code "#include <${header}>\n")
+        foreach(t RANGE ${last_test})
+            string(APPEND code
+                "\nTEST(Generated_${f}_${t}) {\n"
+                "    int x = ${t};\n"
+                "    REQUIRE(x == ${t});\n"
+                "    REQUIRE_EQ(x + 1, ${t} + 1);\n"
+                "    EXPECT_EQ(x * 2, ${t} * 2);\n"
+                "}\n")
+        endforeach()
+        file(WRITE ${dir}/src/suite_${f}.cpp "${code}")
+        list(APPEND sources src/suite_${f}.cpp)
+    endforeach()
+    list(JOIN sources "\n    " source_list)
+    file(WRITE ${dir}/CMakeLists.txt
+        "cmake_minimum_required(VERSION 3.10)\n"
+        "project(NTestBuildBench LANGUAGES CXX)\n"
+        "set(CMAKE_CXX_STANDARD 17)\n"
+        "add_executable(suite\n    ${source_list}\n"
+        "    ${NTEST_ROOT}/src/main.cpp)\n"
+        "target_include_directories(suite PRIVATE ${NTEST_ROOT}/include)\n")
+endfunction()
+
+math(EXPR total "${FILES} * ${TESTS}")
+string(TIMESTAMP date "%Y-%m-%dT%H:%M:%S")
+foreach(header NTestCore.h NTest.h)
+    string(REPLACE "." "_" name ${header})
+    set(dir ${WORK_DIR}/${name})
+    generate_suite(${dir} ${header})
+    set(configure ${CMAKE_COMMAND} -S ${dir} -B ${dir}/build
+                  -DCMAKE_BUILD_TYPE=Debug)
+    if(CXX)
+        list(APPEND configure -DCMAKE_CXX_COMPILER=${CXX})
+    endif()
+    execute_process(COMMAND ${configure} OUTPUT_QUIET
+                    RESULT_VARIABLE failed)
+    if(failed)
+        message(FATAL_ERROR "configuring the ${header} suite failed")
+    endif()
+
+    now_ms(start)
+    execute_process(COMMAND ${CMAKE_COMMAND} --build ${dir}/build
+                            --parallel ${JOBS}
+                    OUTPUT_QUIET RESULT_VARIABLE failed)
+    now_ms(end)
+    if(failed)
+        message(FATAL_ERROR "building the ${header} suite failed")
+    endif()
+    execute_process(COMMAND ${dir}/build/suite OUTPUT_QUIET
+                    RESULT_VARIABLE failed)
+    if(failed)
+        message(FATAL_ERROR "the ${header} suite did not pass")
+    endif()
+
+    math(EXPR ms "${end} - ${start}")
+    math(EXPR whole "${ms} / 1000")
+    math(EXPR frac "${ms} % 1000")
+    string(LENGTH "${frac}" digits)
+    math(EXPR missing "3 - ${digits}")
+    if(missing GREATER 0)
+        string(REPEAT "0" ${missing} pad)
+        string(PREPEND frac "${pad}")
+    endif()
+    message(STATUS "${header}: ${total} tests in ${FILES} files built in "
+                   "${whole}.${frac} s with ${JOBS} jobs")
+    file(APPEND ${WORK_DIR}/build_times.csv
+         "${date},${header},${FILES},${TESTS},${JOBS},${ms}\n")
+endforeach()
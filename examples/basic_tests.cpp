@@ -10,4 +10,12 @@ TEST(TruthIsTrue) {
     ASSERT_TRUE(true);
 }
 
-int main() { return NTest::run_all(); }
+BENCHMARK(StringConcat) {
+    for (auto _ : state) {
+        std::string s = "Hello, ";
+        s += "world";
+        NTest::DoNotOptimize(s);
+    }
+}
+
+int main(int argc, char** argv) { return NTest::run_all(argc, argv); }
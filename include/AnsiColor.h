@@ -6,53 +6,75 @@
 
 #include <unistd.h>
 
+#include <cstdio>
 #include <cstdlib>
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <string_view>
 
 namespace NTest::Color {
-    inline static bool terminal_supports_colors() {
+    struct TerminalCaps {
+        bool colors;
+        bool colors_256;
+        bool true_color;
+        bool italic;
+    };
+
+    inline TerminalCaps detect_terminal_caps() {
+        TerminalCaps caps{};
         const char* term_type = std::getenv("TERM");
+        const char* color_term = std::getenv("COLORTERM");
+        const bool tty = isatty(fileno(stdout)) != 0;
 
         // Check if we're on a Unix-like system with a terminal and color
         // support
         if (term_type != nullptr) {
             // Check if the terminal supports color (e.g., "xterm",
             // "xterm-256color", etc.)
-            return std::string(term_type) != "dumb" && isatty(fileno(stdout));
-        }
-
+            const std::string term(term_type);
+            caps.colors = term != "dumb" && tty;
+            caps.colors_256 = caps.colors;
+            // Some terminals use different values for italic support
+            caps.italic = term.find("xterm") != std::string::npos ||
+                          term.find("screen") != std::string::npos;
+        } else {
 #ifdef _WIN32
-        // For Windows, check if virtual terminal processing is enabled
-        DWORD dwMode = 0;
-        if (GetConsoleMode(GetStdHandle(STD_OUTPUT_HANDLE), &dwMode)) {
-            return (dwMode & ENABLE_VIRTUAL_TERMINAL_PROCESSING);
-        }
-        return false;
+            // For Windows, check if virtual terminal processing is enabled
+            DWORD dwMode = 0;
+            caps.colors =
+                GetConsoleMode(GetStdHandle(STD_OUTPUT_HANDLE), &dwMode) &&
+                (dwMode & ENABLE_VIRTUAL_TERMINAL_PROCESSING);
 #else
-        return true;  // Assume color support for other systems
+            caps.colors = true;  // Assume color support for other systems
 #endif
+        }
+
+        // Check for true color support
+        caps.true_color =
+            color_term != nullptr && std::string(color_term) == "truecolor";
+        return caps;
+    }
+
+    // Detected once per process; the environment and stdout are not
+    // expected to change while tests run.
+    inline const TerminalCaps& terminal_caps() {
+        static const TerminalCaps caps = detect_terminal_caps();
+        return caps;
+    }
+
+    inline static bool terminal_supports_colors() {
+        return terminal_caps().colors;
     }
 
     // Determine if we support 256 colors
     inline static bool terminal_supports_256_colors() {
-        const char* term_type = std::getenv("TERM");
-        // Check for 256 color support
-        if (term_type != nullptr) {
-            return std::string(term_type) != "dumb" && isatty(fileno(stdout));
-        }
-
-        return false;
+        return terminal_caps().colors_256;
     }
 
     // Detect if the terminal supports true colors (24-bit)
     inline static bool terminal_supports_true_color() {
-        const char* term_type = std::getenv("TERM");
-        const char* color_term = std::getenv("COLORTERM");
-
-        // Check for true color support
-        return color_term != nullptr && std::string(color_term) == "truecolor";
+        return terminal_caps().true_color;
     }
 
     // Determine if terminal supports styling
@@ -61,13 +83,7 @@ namespace NTest::Color {
     }
 
     inline static bool terminal_supports_italic() {
-        const char* term_type = std::getenv("TERM");
-        // Check if the terminal supports italic (not all terminals do)
-        // This is a simple check, some terminals use different values for
-        // italic support
-        return term_type &&
-               (std::string(term_type).find("xterm") != std::string::npos ||
-                std::string(term_type).find("screen") != std::string::npos);
+        return terminal_caps().italic;
     }
 
     inline static int rgb_to_256_color(int r, int g, int b) {
@@ -123,33 +139,58 @@ namespace NTest::Color {
         }
     }
 
-    // Color application based on the terminal's capabilities
-    inline static std::string apply_color(int r, int g, int b,
-                                          const std::string& text) {
-        std::stringstream buffer;
+    // Appends `text` wrapped in the escape codes for (r, g, b) to `out`.
+    // Nothing is allocated beyond the growth of `out`, so a reused buffer
+    // makes colored output allocation-free.
+    inline static void append_color(std::string& out, int r, int g, int b,
+                                    std::string_view text) {
+        char code[32];
+        int n = 0;
         if (terminal_supports_true_color()) {
-            buffer << "\033[38;2;" << r << ';' << g << ';' << b << "m" << text
-                   << "\033[0m";  // Applying true color (example orange)
+            n = std::snprintf(code, sizeof code, "\033[38;2;%d;%d;%dm", r, g,
+                              b);
         } else if (terminal_supports_256_colors()) {
-            int color_code = rgb_to_256_color(r, g, b);
-            buffer << "\033[38;5;" << color_code << "m" << text << "\033[0m";
+            n = std::snprintf(code, sizeof code, "\033[38;5;%dm",
+                              rgb_to_256_color(r, g, b));
         } else if (terminal_supports_colors()) {
-            int color_code = rgb_to_ansi_color(r, g, b);
-            buffer << "\033[38;5;" << color_code << "m" << text << "\033[0m";
+            n = std::snprintf(code, sizeof code, "\033[38;5;%dm",
+                              rgb_to_ansi_color(r, g, b));
+        } else {
+            out.append(text);  // No color, plain text
+            return;
+        }
+        out.append(code, static_cast<std::size_t>(n));
+        out.append(text);
+        out.append("\033[0m");
+    }
+
+    inline static void append_style(std::string& out, std::string_view code,
+                                    std::string_view text) {
+        if (terminal_supports_styles()) {
+            out.append(code);
+            out.append(text);
+            out.append("\033[0m");
         } else {
-            return text;  // No color, return plain text
+            out.append(text);
         }
-        return buffer.str();
+    }
+
+    // Color application based on the terminal's capabilities
+    inline static std::string apply_color(int r, int g, int b,
+                                          const std::string& text) {
+        std::string out;
+        out.reserve(text.size() + 24);
+        append_color(out, r, g, b, text);
+        return out;
     }
 
     // Apply styles dynamically
     inline static std::string apply_style(const std::string& style_code,
                                           const std::string& text) {
-        if (terminal_supports_styles()) {
-            return style_code + text +
-                   "\033[0m";  // Apply style if terminal supports it
-        }
-        return text;  // Return plain text if no styles are supported
+        std::string out;
+        out.reserve(style_code.size() + text.size() + 4);
+        append_style(out, style_code, text);
+        return out;
     }
     // 256 color mode
     inline static std::string color256(int code, const std::string& s) {
@@ -174,6 +215,23 @@ namespace NTest::Color {
                ";" + std::to_string(b) + "m" + s + "\033[0m";  // background
     }
 
+    // Basic color modes, appending into a caller-owned buffer
+    inline static void append_red(std::string& out, std::string_view s) {
+        append_color(out, 255, 0, 0, s);
+    }
+    inline static void append_green(std::string& out, std::string_view s) {
+        append_color(out, 0, 255, 0, s);
+    }
+    inline static void append_yellow(std::string& out, std::string_view s) {
+        append_color(out, 255, 255, 0, s);
+    }
+    inline static void append_cyan(std::string& out, std::string_view s) {
+        append_color(out, 0, 255, 255, s);
+    }
+    inline static void append_bold(std::string& out, std::string_view s) {
+        append_style(out, "\033[1m", s);
+    }
+
     // Basic color modes
     inline static std::string red(const std::string& s) {
         return apply_color(255, 0, 0, s);
@@ -9,16 +9,96 @@
 #ifndef NTEST_UNIT_H
 #define NTEST_UNIT_H
 
-#define NTEST_VERSION "0.2"
+#include <NTestCore.h>
+
+// With the whole framework in view, the assertions of NTestCore.h report
+// through the inline FAIL and expect_failed below.
+#undef NTEST_FAIL_
+#undef NTEST_EXPECT_FAILED_
+#define NTEST_FAIL_ NTest::FAIL
+#define NTEST_EXPECT_FAILED_ NTest::detail::expect_failed
 
 #include <AnsiColor.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <csetjmp>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <fstream>
 #include <functional>
+#include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <regex>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#define NTEST_HAS_FORK 1
+#define NTEST_HAS_MMAP 1
+#else
+#define NTEST_HAS_FORK 0
+#define NTEST_HAS_MMAP 0
+#endif
+
+#if NTEST_HAS_FORK && (defined(__GLIBC__) || defined(__APPLE__))
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <sys/time.h>
+#define NTEST_HAS_PROFILER 1
+#else
+#define NTEST_HAS_PROFILER 0
+#endif
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#define NTEST_HAS_PERF 1
+#else
+#define NTEST_HAS_PERF 0
+#endif
+
+// Vector kernels for the bulk assertions; define NTEST_NO_SIMD to use the
+// scalar loops instead.
+#if !defined(NTEST_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64))
+#include <emmintrin.h>
+#define NTEST_HAS_SSE2 1
+#else
+#define NTEST_HAS_SSE2 0
+#endif
+
 #define NTEST_COLOR(x) NTest::Color::x
 
 namespace NTest {
@@ -26,18 +106,20 @@ namespace NTest {
     // =========================
     // Test registration
     // =========================
+    // TestCase and the registration list are in NTestCore.h.
 
-    struct TestCase {
-        const char* name;
-        std::function<void()> func;
-        bool expect_fail = false;
-
-        TestCase(const char* /* name */, std::function<void()> /* func */);
-    };
-
-    // Function-local static ensures one registry per program
+    // All registered tests in registration order. The vector is built on
+    // first use after main starts and picks up tests registered since the
+    // previous call.
     inline std::vector<TestCase*>& REGISTRY() {
         static std::vector<TestCase*> tests;
+        static TestCase* synced = nullptr;  // last node copied into `tests`
+        TestCase* node = synced != nullptr ? synced->next
+                                           : detail::registry_list.head;
+        for (; node != nullptr; node = node->next) {
+            tests.push_back(node);
+            synced = node;
+        }
         return tests;
     }
 
@@ -46,24 +128,277 @@ namespace NTest {
     // =======================
     inline std::vector<TestCase*>& get_registered_tests() { return REGISTRY(); }
 
-    inline TestCase::TestCase(const char* nname, std::function<void()> fxn)
-        : name(nname), func(std::move(fxn)) {
-        REGISTRY().push_back(this);
-    }
-
     // =========================
     // Assertion failure
     // =========================
 
-    [[noreturn]] inline void FAIL(const char* expr, const char* file, int line,
-                                  const char* msg = nullptr) {
-        std::ostringstream oss;
-        oss << "Assertion failed: " << expr << " (" << file << ":" << line
-            << ")";
-        if (msg != nullptr) {
-            oss << " - " << msg;
+    // One failed assertion. `expr` and `file` point at string literals;
+    // the optional message is copied because it may be a temporary.
+    struct Failure {
+        const char* expr = "";
+        const char* file = "";
+        int line = 0;
+        std::string msg;
+        bool fatal = true;
+    };
+
+    // Formatting is deferred until a failure is reported.
+    inline std::string format_failure(const Failure& f) {
+        std::string text = std::string("Assertion failed: ") + f.expr + " (" +
+                           f.file + ":" + std::to_string(f.line) + ")";
+        if (!f.msg.empty())
+            text += " - " + f.msg;
+        return text;
+    }
+
+    // Thrown by fatal assertions when exceptions are enabled. Cheap to
+    // raise: nothing is formatted unless what() is called.
+    class AssertionFailure : public std::exception {
+    public:
+        explicit AssertionFailure(Failure failure)
+            : failure_(std::move(failure)) {}
+
+        const Failure& failure() const noexcept { return failure_; }
+
+        const char* what() const noexcept override {
+            if (what_.empty())
+                what_ = format_failure(failure_);
+            return what_.c_str();
+        }
+
+    private:
+        Failure failure_;
+        mutable std::string what_;
+    };
+
+    // Per-call timing of a TEST_STRESS run over all its threads; see
+    // check_stress.
+    struct StressStats {
+        unsigned threads = 0;
+        std::uint64_t iterations = 0;  // calls completed
+        std::chrono::nanoseconds wall{0};
+        std::chrono::nanoseconds min{0};
+        std::chrono::nanoseconds p50{0};
+        std::chrono::nanoseconds p90{0};
+        std::chrono::nanoseconds p99{0};
+        std::chrono::nanoseconds max{0};
+    };
+
+    namespace detail {
+        // What the threads a test started (see NTest::Thread) report back:
+        // failures, exceptions and captured output. Workers push without
+        // locking; the test's own thread drains.
+        class ThreadFailures {
+        public:
+            struct Entry {
+                unsigned thread = 0;
+                bool has_failure = false;
+                Failure failure;
+                std::string error;  // an exception ended the thread
+                std::string output;
+                Entry* next = nullptr;
+            };
+
+            ThreadFailures() = default;
+            ThreadFailures(const ThreadFailures&) = delete;
+            ThreadFailures& operator=(const ThreadFailures&) = delete;
+            ~ThreadFailures() { drain(); }
+
+            void push(std::unique_ptr<Entry> entry) {
+                Entry* e = entry.release();
+                e->next = head_.load(std::memory_order_relaxed);
+                while (!head_.compare_exchange_weak(
+                    e->next, e, std::memory_order_release,
+                    std::memory_order_relaxed)) {
+                }
+            }
+
+            // Everything pushed so far, oldest first.
+            std::vector<std::unique_ptr<Entry>> drain() {
+                std::vector<std::unique_ptr<Entry>> entries;
+                Entry* e = head_.exchange(nullptr, std::memory_order_acquire);
+                for (; e != nullptr; e = e->next)
+                    entries.emplace_back(e);
+                std::reverse(entries.begin(), entries.end());
+                return entries;
+            }
+
+            void cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+            bool cancelled() const {
+                return cancelled_.load(std::memory_order_relaxed);
+            }
+            unsigned next_thread() { return ++threads_; }
+
+        private:
+            std::atomic<Entry*> head_{nullptr};
+            std::atomic<bool> cancelled_{false};
+            std::atomic<unsigned> threads_{0};
+        };
+
+        // Result state of the test running on this thread.
+        struct TestContext {
+            std::vector<Failure> failures;
+            std::string error;  // exception text or runner-detected problem
+            std::optional<StressStats> stress;  // set by check_stress
+            // Shared with the test's NTest::Threads. `thread` is 0 on the
+            // test's own thread and numbers the workers from 1.
+            std::shared_ptr<ThreadFailures> threads;
+            unsigned thread = 0;
+#if !NTEST_EXCEPTIONS
+            std::jmp_buf abort_point;
+#endif
+        };
+
+        inline TestContext*& current_context() {
+            thread_local TestContext* ctx = nullptr;
+            return ctx;
+        }
+
+        // Per-thread capture target. When set, writes to std::cout from this
+        // thread are routed here instead of the terminal.
+        inline std::string*& capture_target() {
+            thread_local std::string* target = nullptr;
+            return target;
+        }
+
+        class ContextScope {
+        public:
+            explicit ContextScope(TestContext& ctx)
+                : previous_(current_context()) {
+                current_context() = &ctx;
+            }
+            ~ContextScope() { current_context() = previous_; }
+            ContextScope(const ContextScope&) = delete;
+            ContextScope& operator=(const ContextScope&) = delete;
+
+        private:
+            TestContext* previous_;
+        };
+
+        // Raises a runner-level error: throws it, or prints it and aborts
+        // when exceptions are disabled.
+        template <typename E>
+        [[noreturn]] inline void raise(const E& error) {
+#if NTEST_EXCEPTIONS
+            throw error;
+#else
+            std::cerr << "NTest: " << error.what() << std::endl;
+            std::abort();
+#endif
+        }
+
+        // Stops the current test with a non-assertion error.
+        [[noreturn]] NTEST_COLD inline void abort_current(
+            const std::string& message) {
+#if NTEST_EXCEPTIONS
+            throw std::runtime_error(message);
+#else
+            if (TestContext* ctx = current_context()) {
+                ctx->error = message;
+                std::longjmp(ctx->abort_point, 1);
+            }
+            std::cerr << "NTest: " << message << std::endl;
+            std::abort();
+#endif
+        }
+
+        // Runs fn() under `ctx`, returning false if it was stopped by a
+        // fatal assertion or an exception (recorded in `ctx`).
+        template <typename Fn>
+        bool invoke_guarded(TestContext& ctx, Fn&& fn) {
+            ContextScope scope(ctx);
+#if NTEST_EXCEPTIONS
+            try {
+                fn();
+                return true;
+            } catch (const AssertionFailure& f) {
+                ctx.failures.push_back(f.failure());
+            } catch (const std::exception& e) {
+                // An empty error would read as "stopped by an assertion".
+                ctx.error = *e.what() != '\0' ? e.what() : "unknown exception";
+            } catch (...) {
+                ctx.error = "Non-std exception thrown";
+            }
+            return false;
+#else
+            if (setjmp(ctx.abort_point) == 0) {
+                fn();
+                return true;
+            }
+            return false;
+#endif
+        }
+
+        // Builds a TEST_F fixture, runs its body and destroys it. Without
+        // exceptions a fatal failure in the body jumps back here first, so
+        // the fixture is destroyed before the abort goes on to the runner.
+        template <typename Fixture>
+        void run_fixture() {
+#if NTEST_EXCEPTIONS
+            Fixture().body();
+#else
+            TestContext* const ctx = current_context();
+            if (ctx == nullptr) {
+                Fixture().body();
+                return;
+            }
+            std::jmp_buf outer;
+            std::memcpy(&outer, &ctx->abort_point, sizeof outer);
+            bool stopped = false;
+            {
+                Fixture fixture;
+                if (setjmp(ctx->abort_point) == 0)
+                    fixture.body();
+                else
+                    stopped = true;
+            }
+            std::memcpy(&ctx->abort_point, &outer, sizeof outer);
+            if (stopped)
+                std::longjmp(ctx->abort_point, 1);
+#endif
+        }
+
+        // Non-fatal failure: recorded in the running test, or printed
+        // straight away outside of one.
+        NTEST_COLD inline void expect_failed(const char* expr,
+                                             const char* file, int line,
+                                             const char* msg = nullptr) {
+            Failure f{expr, file, line, msg != nullptr ? msg : "", false};
+            if (TestContext* ctx = current_context()) {
+                if (ctx->thread != 0) {
+                    auto entry = std::make_unique<ThreadFailures::Entry>();
+                    entry->thread = ctx->thread;
+                    entry->has_failure = true;
+                    entry->failure = std::move(f);
+                    ctx->threads->push(std::move(entry));
+                    return;
+                }
+                ctx->failures.push_back(std::move(f));
+                return;
+            }
+            std::cout << NTEST_COLOR(yellow)("[EXPECT FAIL] ")
+                      << format_failure(f) << "\n";
+        }
+    }  // namespace detail
+
+    // Fatal failure: stops the current test. Throws AssertionFailure, or
+    // records the failure and unwinds to the runner with longjmp when
+    // exceptions are disabled (destructors of the test's locals do not run
+    // in that mode).
+    [[noreturn]] NTEST_COLD inline void FAIL(const char* expr,
+                                             const char* file, int line,
+                                             const char* msg = nullptr) {
+        Failure f{expr, file, line, msg != nullptr ? msg : "", true};
+#if NTEST_EXCEPTIONS
+        throw AssertionFailure(std::move(f));
+#else
+        if (detail::TestContext* ctx = detail::current_context()) {
+            ctx->failures.push_back(std::move(f));
+            std::longjmp(ctx->abort_point, 1);
         }
-        throw std::runtime_error(oss.str());
+        std::cerr << format_failure(f) << std::endl;
+        std::abort();
+#endif
     }
 
     inline void EXPECT_FAIL(const std::exception& exc) {
@@ -76,170 +411,6511 @@ namespace NTest {
     }
 
     // =========================
-    // Runner
+    // Allocation tracking
     // =========================
 
-    // Assertion semantics:
-    // - REQUIRE / ASSERT abort the current test by throwing
-    // - EXPECT logs a failure and continues execution
-    // - All exceptions are caught by the runner
-    inline int run_all() {
-        std::cout << NTEST_COLOR(bold)(NTEST_COLOR(cyan)("NTest Framework\n"))
-                  << NTEST_COLOR(cyan)("Running Tests....\n");
+    // Heap usage attributed to one scope on one thread.
+    struct AllocationStats {
+        std::uint64_t count = 0;  // operator new calls
+        std::uint64_t bytes = 0;  // bytes requested
+        std::int64_t peak = 0;    // peak live bytes above the starting point
+        std::int64_t leaked = 0;  // live bytes at the end minus the start
+    };
 
-        int passed = 0;
-        int failed = 0;
+    namespace detail {
+        // Trivial so that the thread_local needs no dynamic initialization
+        // and can be touched from inside operator new.
+        struct AllocCounters {
+            std::uint64_t count;
+            std::uint64_t bytes;
+            std::int64_t live;
+            std::int64_t peak;
+        };
 
-        for (auto* test : REGISTRY()) {
-            try {
-                test->func();
-                if (test->expect_fail) {
-                    std::cout << "[UNEXPECTED PASS] " << test->name << "\n";
-                    ++failed;
-                } else {
-                    std::cout << NTEST_COLOR(green)(std::string("[PASS] ") +
-                                                    test->name)
-                              << "\n";
-                    ++passed;
+        inline thread_local AllocCounters alloc_counters{};
+
+        // Set by the hooks emitted under NTEST_TRACK_ALLOCATIONS.
+        inline bool alloc_hooks_installed = false;
+
+        inline void record_alloc(std::size_t size) {
+            AllocCounters& c = alloc_counters;
+            ++c.count;
+            c.bytes += size;
+            c.live += static_cast<std::int64_t>(size);
+            if (c.live > c.peak)
+                c.peak = c.live;
+        }
+
+        inline void record_free(std::size_t size) {
+            alloc_counters.live -= static_cast<std::int64_t>(size);
+        }
+
+        // Takes the calling thread's heap activity while alive back off its
+        // counters, for work done on behalf of no test in particular.
+        class UnchargedScope {
+        public:
+            UnchargedScope() : start_(alloc_counters) {}
+            ~UnchargedScope() { alloc_counters = start_; }
+            UnchargedScope(const UnchargedScope&) = delete;
+            UnchargedScope& operator=(const UnchargedScope&) = delete;
+
+        private:
+            const AllocCounters start_;
+        };
+
+        inline void append_bytes(std::string& out, std::int64_t bytes) {
+            char buf[32];
+            const double b = static_cast<double>(bytes);
+            int n;
+            if (bytes < 1024 && bytes > -1024)
+                n = std::snprintf(buf, sizeof buf, "%lld B",
+                                  static_cast<long long>(bytes));
+            else if (b < 1024.0 * 1024 && b > -1024.0 * 1024)
+                n = std::snprintf(buf, sizeof buf, "%.1f KiB", b / 1024);
+            else
+                n = std::snprintf(buf, sizeof buf, "%.1f MiB",
+                                  b / (1024.0 * 1024));
+            out.append(buf, static_cast<std::size_t>(n));
+        }
+
+        inline std::string format_bytes(std::int64_t bytes) {
+            std::string text;
+            append_bytes(text, bytes);
+            return text;
+        }
+    }  // namespace detail
+
+    // True when the operator new/delete hooks are linked in, i.e. one
+    // translation unit defined NTEST_TRACK_ALLOCATIONS before including
+    // this header.
+    inline bool allocation_tracking_enabled() {
+        return detail::alloc_hooks_installed;
+    }
+
+    // Measures the calling thread's heap activity from construction until
+    // stats() is called. Scopes nest.
+    class AllocationScope {
+    public:
+        AllocationScope()
+            : start_(detail::alloc_counters),
+              saved_peak_(detail::alloc_counters.peak) {
+            detail::alloc_counters.peak = detail::alloc_counters.live;
+        }
+        ~AllocationScope() {
+            auto& c = detail::alloc_counters;
+            c.peak = std::max(c.peak, saved_peak_);
+        }
+        AllocationScope(const AllocationScope&) = delete;
+        AllocationScope& operator=(const AllocationScope&) = delete;
+
+        AllocationStats stats() const {
+            const auto& c = detail::alloc_counters;
+            AllocationStats out;
+            out.count = c.count - start_.count;
+            out.bytes = c.bytes - start_.bytes;
+            out.peak = c.peak - start_.live;
+            out.leaked = c.live - start_.live;
+            return out;
+        }
+
+    private:
+        detail::AllocCounters start_;
+        std::int64_t saved_peak_;
+    };
+
+    namespace detail {
+        [[noreturn]] inline void fail_untracked(const char* expr,
+                                                const char* file, int line) {
+            FAIL(expr, file, line,
+                 "allocation tracking is disabled; define "
+                 "NTEST_TRACK_ALLOCATIONS in one translation unit");
+        }
+
+        inline void check_max_allocs(const AllocationStats& stats,
+                                     std::uint64_t limit, const char* expr,
+                                     const char* file, int line) {
+            if (stats.count <= limit)
+                return;
+            const std::string msg =
+                std::to_string(stats.count) + " allocations (" +
+                format_bytes(static_cast<std::int64_t>(stats.bytes)) +
+                "), limit " + std::to_string(limit);
+            FAIL(expr, file, line, msg.c_str());
+        }
+
+        // std::thread allocates its start state here and frees it on the
+        // new thread. The free is credited to the caller, so the state
+        // still counts as an allocation but not as a leak.
+        template <typename Fn>
+        std::thread start_thread(Fn&& fn) {
+            const std::int64_t live = alloc_counters.live;
+            std::thread thread(std::forward<Fn>(fn));
+            alloc_counters.live = live;
+            return thread;
+        }
+
+        // Runs fn(t) for t in [0, threads), fn(0) on the calling thread.
+        template <typename Fn>
+        void run_on_threads(unsigned threads, Fn&& fn) {
+            std::vector<std::thread> pool;
+            pool.reserve(threads > 1 ? threads - 1 : 0);
+            for (unsigned t = 1; t < threads; ++t)
+                pool.push_back(start_thread([&fn, t] { fn(t); }));
+            fn(0u);
+            for (auto& t : pool)
+                t.join();
+        }
+    }  // namespace detail
+
+    // =========================
+    // Performance counters
+    // =========================
+
+    // Event totals for one test or benchmark, counted on the thread that
+    // ran it, in user space only. Hardware events need a PMU the process
+    // may use; containers and VMs often lack one, and then only the
+    // software events are counted.
+    struct PerfStats {
+        enum Event : unsigned {
+            Cycles,
+            Instructions,
+            CacheMisses,
+            BranchMisses,
+            ContextSwitches,
+            TaskClock,  // nanoseconds on the CPU
+            PageFaults,
+            kEvents
+        };
+
+        std::uint64_t value[kEvents] = {};
+        unsigned valid = 0;  // bit e is set if value[e] was counted
+
+        bool has(Event e) const { return (valid >> e & 1u) != 0; }
+        std::uint64_t operator[](Event e) const { return value[e]; }
+
+        double ipc() const {
+            if (!has(Cycles) || !has(Instructions) || value[Cycles] == 0)
+                return 0;
+            return static_cast<double>(value[Instructions]) /
+                   static_cast<double>(value[Cycles]);
+        }
+    };
+
+    namespace detail {
+        inline constexpr const char* perf_event_names[PerfStats::kEvents] = {
+            "cycles",        "instructions",     "cache_misses",
+            "branch_misses", "context_switches", "task_clock_ns",
+            "page_faults"};
+
+        // Set for the duration of a run that asked for counters.
+        inline bool& perf_enabled() {
+            static bool enabled = false;
+            return enabled;
+        }
+
+        // Which events this process can open, probed once. `problem`
+        // explains any that are missing.
+        struct PerfSupport {
+            unsigned events = 0;
+            std::string problem;
+
+            bool hardware() const { return (events & 0xfu) != 0; }
+            bool has(PerfStats::Event e) const {
+                return (events >> e & 1u) != 0;
+            }
+        };
+
+#if NTEST_HAS_PERF
+        inline perf_event_attr perf_attr(PerfStats::Event e) {
+            static constexpr std::pair<std::uint32_t, std::uint64_t>
+                kinds[PerfStats::kEvents] = {
+                    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+                    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+                    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+                    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+                    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+                    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+                    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS}};
+            perf_event_attr attr{};
+            attr.size = sizeof attr;
+            attr.type = kinds[e].first;
+            attr.config = kinds[e].second;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;  // allowed at perf_event_paranoid 2
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP |
+                               PERF_FORMAT_TOTAL_TIME_ENABLED |
+                               PERF_FORMAT_TOTAL_TIME_RUNNING;
+            return attr;
+        }
+
+        // Switches are made in kernel context, so a counter limited to
+        // user space never sees one; count them with getrusage instead.
+        inline std::uint64_t thread_context_switches() {
+            rusage usage{};
+            if (getrusage(RUSAGE_THREAD, &usage) != 0)
+                return 0;
+            return static_cast<std::uint64_t>(usage.ru_nvcsw) +
+                   static_cast<std::uint64_t>(usage.ru_nivcsw);
+        }
+
+        inline int perf_open(PerfStats::Event e, int group) {
+            perf_event_attr attr = perf_attr(e);
+            if (group >= 0)
+                attr.disabled = 0;  // gated by the group leader
+            return static_cast<int>(::syscall(SYS_perf_event_open, &attr, 0,
+                                              -1, group, PERF_FLAG_FD_CLOEXEC));
+        }
+#endif
+
+        inline const PerfSupport& perf_support() {
+            static const PerfSupport support = [] {
+                PerfSupport s;
+#if NTEST_HAS_PERF
+                for (unsigned e = 0; e < PerfStats::kEvents; ++e) {
+                    if (e == PerfStats::ContextSwitches) {
+                        rusage usage{};
+                        if (getrusage(RUSAGE_THREAD, &usage) == 0)
+                            s.events |= 1u << e;
+                        continue;
+                    }
+                    const int fd = perf_open(PerfStats::Event(e), -1);
+                    if (fd >= 0) {
+                        s.events |= 1u << e;
+                        ::close(fd);
+                    } else if (s.problem.empty()) {
+                        s.problem = std::string(perf_event_names[e]) + ": " +
+                                    std::strerror(errno);
+                    }
                 }
-            } catch (const std::exception& e) {
-                if (test->expect_fail) {
-                    EXPECT_FAIL(std::string(test->name));
-                    ++passed;
-                } else {
-                    std::cout
-                        << NTEST_COLOR(red)(std::string("[FAIL] ") + test->name)
-                        << " - " << NTEST_COLOR(yellow)(e.what()) << "\n";
-                    ++failed;
+#else
+                s.problem = "perf_event_open needs Linux";
+#endif
+                return s;
+            }();
+            return support;
+        }
+
+        // One counter group on the calling thread. Counting accumulates
+        // while started; reset() clears it.
+        class PerfCounters {
+        public:
+            PerfCounters() {
+#if NTEST_HAS_PERF
+                const unsigned events = perf_support().events;
+                switches_ = (events >> PerfStats::ContextSwitches & 1u) != 0;
+                for (unsigned e = 0; e < PerfStats::kEvents; ++e) {
+                    if ((events >> e & 1u) == 0 ||
+                        e == PerfStats::ContextSwitches)
+                        continue;
+                    const int fd = perf_open(PerfStats::Event(e), leader_);
+                    if (fd < 0)
+                        continue;
+                    if (leader_ < 0)
+                        leader_ = fd;
+                    fds_[count_] = fd;
+                    slot_event_[count_++] = e;
                 }
-            } catch (...) {
-                if (test->expect_fail) {
-                    EXPECT_FAIL(std::string(test->name));
+#endif
+            }
 
-                    ++passed;
-                } else {
-                    std::cout
-                        << NTEST_COLOR(red)(std::string("[FAIL] ") + test->name)
-                        << " - "
-                        << NTEST_COLOR(yellow)("Non-std exception thrown")
-                        << "\n";
-                    ++failed;
+            ~PerfCounters() {
+#if NTEST_HAS_PERF
+                for (unsigned i = 0; i < count_; ++i)
+                    ::close(fds_[i]);
+#endif
+            }
+
+            PerfCounters(const PerfCounters&) = delete;
+            PerfCounters& operator=(const PerfCounters&) = delete;
+
+            bool active() const { return count_ > 0 || switches_; }
+
+#if NTEST_HAS_PERF
+            void start() {
+                control(PERF_EVENT_IOC_ENABLE, 0);
+                if (switches_ && !running_)
+                    switch_mark_ = thread_context_switches();
+                running_ = true;
+            }
+            void stop() {
+                control(PERF_EVENT_IOC_DISABLE, 0);
+                if (switches_ && running_)
+                    switch_total_ += thread_context_switches() - switch_mark_;
+                running_ = false;
+            }
+            void reset() {
+                control(PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+                switch_total_ = 0;
+                if (running_)
+                    switch_mark_ = thread_context_switches();
+            }
+
+            // Process that opened the group; a forked child must reopen.
+            pid_t owner() const { return owner_; }
+#else
+            void start() {}
+            void stop() {}
+            void reset() {}
+#endif
+
+            // Totals so far, scaled up if the kernel had to multiplex the
+            // group with other users of the PMU.
+            PerfStats read() const {
+                PerfStats stats;
+#if NTEST_HAS_PERF
+                if (switches_) {
+                    std::uint64_t n = switch_total_;
+                    if (running_)
+                        n += thread_context_switches() - switch_mark_;
+                    stats.value[PerfStats::ContextSwitches] = n;
+                    stats.valid |= 1u << PerfStats::ContextSwitches;
                 }
+                std::uint64_t buf[3 + PerfStats::kEvents] = {};
+                if (count_ == 0 || ::read(leader_, buf, sizeof buf) <= 0)
+                    return stats;
+                const std::uint64_t enabled = buf[1];
+                const std::uint64_t running = buf[2];
+                if (running == 0)
+                    return stats;
+                const double scale = static_cast<double>(enabled) /
+                                     static_cast<double>(running);
+                for (unsigned i = 0; i < buf[0] && i < count_; ++i) {
+                    const unsigned e = slot_event_[i];
+                    stats.value[e] = static_cast<std::uint64_t>(
+                        static_cast<double>(buf[3 + i]) * scale);
+                    stats.valid |= 1u << e;
+                }
+#endif
+                return stats;
+            }
+
+        private:
+#if NTEST_HAS_PERF
+            // The members are opened enabled and gated by the leader, so
+            // only the leader is switched on and off. Disabling the whole
+            // group turns the members off for good: enabling it again
+            // restarts just the leader.
+            void control(unsigned long request, unsigned long flags) {
+                if (count_ > 0)
+                    ::ioctl(leader_, request, flags);
+            }
+
+            pid_t owner_ = ::getpid();
+            int leader_ = -1;
+            int fds_[PerfStats::kEvents] = {};
+            unsigned slot_event_[PerfStats::kEvents] = {};
+            std::uint64_t switch_mark_ = 0;   // at the last start()
+            std::uint64_t switch_total_ = 0;  // over finished intervals
+            bool running_ = false;
+#endif
+            unsigned count_ = 0;
+            bool switches_ = false;  // ContextSwitches from getrusage
+        };
+
+        // Counters are bound to the thread that opens them, so each
+        // thread keeps its own group open for reuse.
+        inline PerfCounters& thread_perf_counters() {
+            thread_local std::optional<PerfCounters> counters;
+#if NTEST_HAS_PERF
+            if (counters && counters->owner() != ::getpid())
+                counters.reset();
+#endif
+            if (!counters)
+                counters.emplace();
+            return *counters;
+        }
+
+        class PerfScope {
+        public:
+            explicit PerfScope(bool enabled) : previous_(perf_enabled()) {
+                perf_enabled() = enabled;
             }
+            ~PerfScope() { perf_enabled() = previous_; }
+            PerfScope(const PerfScope&) = delete;
+            PerfScope& operator=(const PerfScope&) = delete;
+
+        private:
+            bool previous_;
+        };
+    }  // namespace detail
+
+    // =========================
+    // Sampling profiler
+    // =========================
+
+    // --profile samples the stacks of running test bodies on SIGPROF and
+    // writes each test's samples as folded stacks ("root;caller;callee 12"
+    // per line), the input format of flamegraph.pl, inferno and speedscope.
+    struct ProfileOptions {
+        std::string dir;  // <dir>/<test>.folded; empty disables profiling
+        std::chrono::milliseconds threshold{0};  // skip faster tests
+        unsigned hz = 1000;  // samples per second of CPU time
+    };
+
+    namespace detail {
+        inline ProfileOptions& profile_settings() {
+            static ProfileOptions settings;
+            return settings;
         }
 
-        std::cout << passed << " passed, " << failed << " failed.\n";
+        // Raw stacks of one test body, filled by the signal handler of the
+        // thread running it. Each sample is [depth, leaf, ..., outermost].
+        struct ProfileBuffer {
+            static constexpr std::size_t kSlots = std::size_t{1} << 18;
+            static constexpr int kMaxDepth = 96;
 
-        if (failed > 0) {
-            std::cout << NTEST_COLOR(bold)(
-                NTEST_COLOR(red)("\nTest failed.\n"));
-        } else {
-            std::cout << NTEST_COLOR(bold)(
-                NTEST_COLOR(green)("\nAll tests passed :)\n"));
+            std::unique_ptr<void*[]> slots{new void*[kSlots]};
+            std::size_t used = 0;
+            std::size_t samples = 0;
+            std::size_t dropped = 0;  // buffer full
+        };
+
+        // The buffer the calling thread's samples go to, if its test body
+        // is being profiled.
+        inline ProfileBuffer*& active_profile() {
+            thread_local ProfileBuffer* buffer = nullptr;
+            return buffer;
+        }
+
+#if NTEST_HAS_PROFILER
+        // Frames of the handler itself and of the signal trampoline.
+        constexpr int kSignalFrames = 2;
+
+        inline void profile_signal(int) {
+            ProfileBuffer* buffer = active_profile();
+            if (buffer == nullptr)
+                return;
+            const int saved_errno = errno;
+            void* frames[ProfileBuffer::kMaxDepth + kSignalFrames];
+            const int n = backtrace(frames, ProfileBuffer::kMaxDepth +
+                                                kSignalFrames);
+            const int depth = n - kSignalFrames;
+            if (depth > 0 && buffer->used + static_cast<std::size_t>(depth) <
+                                 ProfileBuffer::kSlots) {
+                void** out = buffer->slots.get() + buffer->used;
+                out[0] = reinterpret_cast<void*>(
+                    static_cast<std::uintptr_t>(depth));
+                std::copy(frames + kSignalFrames, frames + n, out + 1);
+                buffer->used += static_cast<std::size_t>(depth) + 1;
+                ++buffer->samples;
+            } else {
+                ++buffer->dropped;
+            }
+            errno = saved_errno;
+        }
+
+        // Process that armed ITIMER_PROF; 0 while it is off.
+        inline pid_t& profile_timer_owner() {
+            static pid_t owner = 0;
+            return owner;
+        }
+
+        // ITIMER_PROF belongs to the process and is not inherited across
+        // fork(), so each --isolate worker arms its own on first use.
+        inline void arm_profile_timer() {
+            if (profile_timer_owner() == getpid())
+                return;
+            profile_timer_owner() = getpid();
+            void* prime[1];
+            backtrace(prime, 1);  // loads the unwinder outside the handler
+            const long period_us =
+                1000000L / std::max(1u, profile_settings().hz);
+            itimerval timer{};
+            timer.it_interval.tv_sec = static_cast<time_t>(period_us / 1000000);
+            timer.it_interval.tv_usec =
+                static_cast<suseconds_t>(period_us % 1000000);
+            timer.it_value = timer.it_interval;
+            setitimer(ITIMER_PROF, &timer, nullptr);
+        }
+
+        // dladdr() only knows exported symbols; internal-linkage functions,
+        // TEST bodies included, come out as binary+offset.
+        inline std::string symbolize(void* address, bool leaf) {
+            static std::mutex mutex;
+            static std::map<void*, std::string> cache;
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = cache.find(address);
+            if (it != cache.end())
+                return it->second;
+
+            // A return address points past the call; look up the call.
+            const auto pc = reinterpret_cast<std::uintptr_t>(address) -
+                            (leaf ? 0 : 1);
+            std::string name;
+            Dl_info info{};
+            char buf[64];
+            if (dladdr(reinterpret_cast<void*>(pc), &info) != 0 &&
+                info.dli_sname != nullptr) {
+                int status = 0;
+                char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr,
+                                                      nullptr, &status);
+                name = status == 0 ? demangled : info.dli_sname;
+                std::free(demangled);
+            } else if (info.dli_fname != nullptr) {
+                const char* base = std::strrchr(info.dli_fname, '/');
+                name = base != nullptr ? base + 1 : info.dli_fname;
+                std::snprintf(buf, sizeof buf, "+0x%llx",
+                              static_cast<unsigned long long>(
+                                  pc - reinterpret_cast<std::uintptr_t>(
+                                           info.dli_fbase)));
+                name += buf;
+            } else {
+                std::snprintf(buf, sizeof buf, "0x%llx",
+                              static_cast<unsigned long long>(pc));
+                name = buf;
+            }
+            std::replace(name.begin(), name.end(), ';', ':');
+            return cache.emplace(address, std::move(name)).first->second;
+        }
+#endif
+
+        inline std::string profile_path(const ProfileOptions& opts,
+                                        std::string_view test) {
+            std::string path = opts.dir + "/";
+            for (const char c : test)
+                path += std::isalnum(static_cast<unsigned char>(c)) ||
+                                c == '_' || c == '-' || c == '.'
+                            ? c
+                            : '_';
+            return path + ".folded";
         }
 
-        return failed;
+        // Profiles the calling thread between start() and stop(), then
+        // folds the samples below the frame that called start().
+        class ProfileSession {
+        public:
+            void start() {
+#if NTEST_HAS_PROFILER
+                arm_profile_timer();
+                base_depth_ = backtrace(base_, kBaseDepth);
+                buffer().used = buffer().samples = buffer().dropped = 0;
+                std::atomic_signal_fence(std::memory_order_seq_cst);
+                active_profile() = &buffer();
+                std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+            }
+
+            void stop() {
+                std::atomic_signal_fence(std::memory_order_seq_cst);
+                active_profile() = nullptr;
+                std::atomic_signal_fence(std::memory_order_seq_cst);
+            }
+
+            std::size_t samples() const { return buffer().samples; }
+
+            // Writes the folded stacks, each rooted at `root`, to `path`.
+            // Returns false if the file cannot be written.
+            bool write(const std::string& path, std::string_view root) const {
+                std::map<std::string, std::size_t> folded;
+#if NTEST_HAS_PROFILER
+                const ProfileBuffer& b = buffer();
+                std::string line;
+                for (std::size_t at = 0; at < b.used;) {
+                    const auto depth = static_cast<std::size_t>(
+                        reinterpret_cast<std::uintptr_t>(b.slots[at]));
+                    void* const* frames = b.slots.get() + at + 1;
+                    at += depth + 1;
+                    // Drop the runner's frames, which the sample shares
+                    // with the stack start() was called on, and the frame
+                    // of the function that called start().
+                    std::size_t keep = depth;
+                    for (int k = base_depth_ - 1; k >= 0 && keep > 0 &&
+                                                  frames[keep - 1] == base_[k];
+                         --k)
+                        --keep;
+                    if (keep < depth && keep > 0)
+                        --keep;
+                    line.assign(root);
+                    for (std::size_t f = keep; f-- > 0;) {
+                        line += ';';
+                        line += symbolize(frames[f], f == 0);
+                    }
+                    ++folded[line];
+                }
+#endif
+                std::ofstream out(path);
+                for (const auto& [stack, count] : folded)
+                    out << stack << ' ' << count << '\n';
+                return static_cast<bool>(out);
+            }
+
+        private:
+            static constexpr int kBaseDepth = 128;
+
+            static ProfileBuffer& buffer() {
+                thread_local ProfileBuffer buffer;
+                return buffer;
+            }
+
+            void* base_[kBaseDepth];
+            int base_depth_ = 0;
+        };
+
+        // Installs the SIGPROF handler for the duration of a run that
+        // asked for profiles.
+        class ProfileScope {
+        public:
+            explicit ProfileScope(const ProfileOptions& options)
+                : previous_(profile_settings()) {
+                profile_settings() = options;
+#if NTEST_HAS_PROFILER
+                if (!options.dir.empty()) {
+                    if (mkdir(options.dir.c_str(), 0777) != 0 &&
+                        errno != EEXIST) {
+                        problem_ = "cannot create profile directory '" +
+                                   options.dir + "': " + std::strerror(errno);
+                    } else {
+                        struct sigaction action {};
+                        action.sa_handler = profile_signal;
+                        action.sa_flags = SA_RESTART;
+                        sigemptyset(&action.sa_mask);
+                        installed_ = sigaction(SIGPROF, &action, &saved_) == 0;
+                        if (!installed_)
+                            problem_ = std::string("cannot handle SIGPROF: ") +
+                                       std::strerror(errno);
+                    }
+                    // Without a handler, arming the timer would kill us.
+                    if (!installed_)
+                        profile_settings().dir.clear();
+                }
+#endif
+            }
+            ~ProfileScope() {
+#if NTEST_HAS_PROFILER
+                if (installed_) {
+                    const itimerval off{};
+                    setitimer(ITIMER_PROF, &off, nullptr);
+                    profile_timer_owner() = 0;
+                    sigaction(SIGPROF, &saved_, nullptr);
+                }
+#endif
+                profile_settings() = previous_;
+            }
+            ProfileScope(const ProfileScope&) = delete;
+            ProfileScope& operator=(const ProfileScope&) = delete;
+
+            // Why profiling was turned off, or empty.
+            const std::string& problem() const { return problem_; }
+
+        private:
+            ProfileOptions previous_;
+            std::string problem_;
+#if NTEST_HAS_PROFILER
+            struct sigaction saved_ {};
+            bool installed_ = false;
+#endif
+        };
+    }  // namespace detail
+
+    // =========================
+    // Fixtures
+    // =========================
+
+    namespace detail {
+        // The single instance of one TEST_SHARED fixture type. Before a run
+        // the runner counts the selected tests that declare it; the first
+        // of them to ask builds it and it is destroyed when the last one
+        // ends. Construction happens under the lock, so concurrent first
+        // users wait for one build instead of racing.
+        class SharedFixture {
+        public:
+            // One more test of the coming run uses this fixture.
+            void expect_user() {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ++users_;
+            }
+
+            // A declared user ended; tears down after the last one.
+            void release() {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (users_ > 0)
+                    --users_;
+                if (users_ == 0)
+                    destroy();
+            }
+
+            // Tears down regardless of outstanding users.
+            void reset() {
+                std::lock_guard<std::mutex> lock(mutex_);
+                users_ = 0;
+                destroy();
+            }
+
+        protected:
+            constexpr SharedFixture() = default;
+            ~SharedFixture() = default;
+
+            // Called with the lock held.
+            virtual void destroy() = 0;
+
+            std::mutex mutex_;
+            unsigned users_ = 0;
+        };
+
+        template <typename T>
+        class SharedSlot final : public SharedFixture {
+        public:
+            constexpr SharedSlot() = default;
+
+            T& get() {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (!instance_) {
+                    // Setup is not charged to whichever test builds it.
+                    UnchargedScope uncharged;
+                    instance_ = std::make_unique<T>();
+                }
+                return *instance_;
+            }
+
+        private:
+            void destroy() override {
+                UnchargedScope uncharged;
+                instance_.reset();
+            }
+
+            std::unique_ptr<T> instance_;
+        };
+
+        template <typename T>
+        inline SharedSlot<T> shared_slot;
+    }  // namespace detail
+
+    // The shared instance of T, built on first use. Tests declared with
+    // TEST_SHARED(T, ...) decide its lifetime; reached only from elsewhere
+    // (e.g. a TEST_F fixture's constructor) it lives until the program
+    // exits. Tests running in parallel use it at the same time, so treat
+    // it as read-only or synchronize access.
+    template <typename T>
+    T& shared() {
+        return detail::shared_slot<T>.get();
     }
 
-}  // namespace NTest
+    // =========================
+    // Benchmarks
+    // =========================
 
-// =========================
-// Macros
-// =========================
+    // Drives the measured loop of a BENCHMARK body:
+    //
+    //   BENCHMARK(VectorPushBack) {
+    //       for (auto _ : state) {
+    //           std::vector<int> v;
+    //           v.push_back(1);
+    //           NTest::DoNotOptimize(v);
+    //       }
+    //   }
+    //
+    // The runner picks the iteration count; only the loop itself is timed.
+    // BENCHMARK_RANGE bodies read their input size from state.range().
 
-#define TEST(name)                                     \
-    static void name();                                \
-    static NTest::TestCase _ntest_##name(#name, name); \
-    static void name()
+    // Growth models a BENCHMARK_RANGE is fitted to, slowest first.
+    enum class Complexity { O_1, O_LOG_N, O_N, O_N_LOG_N, O_N_SQUARED };
 
-#define TEST_EXPECT_FAIL(name)                                               \
-    static void name();                                                      \
-    static NTest::TestCase _ntest_##name(#name, name);                       \
-    static int _ntest_expect_##name = (_ntest_##name.expect_fail = true, 0); \
-    static void name()
+    inline const char* complexity_name(Complexity c) {
+        static const char* const names[] = {"O(1)", "O(log n)", "O(n)",
+                                            "O(n log n)", "O(n^2)"};
+        return names[static_cast<int>(c)];
+    }
 
-// ----- Fatal assertions -----
+    namespace detail {
+        // Recorded by REQUIRE_COMPLEXITY_AT_MOST, checked after the fit.
+        struct ComplexityBound {
+            Complexity limit = Complexity::O_N_SQUARED;
+            const char* expr = "";
+            const char* file = "";
+            int line = 0;
+        };
+    }  // namespace detail
 
-#define REQUIRE(cond)                               \
-    do {                                            \
-        if (!(cond))                                \
-            NTest::FAIL(#cond, __FILE__, __LINE__); \
-    } while (0)
+    class BenchmarkState {
+    public:
+        using clock = std::chrono::steady_clock;
 
-#define REQUIRE_MSG(cond, msg)                           \
-    do {                                                 \
-        if (!(cond))                                     \
-            NTest::FAIL(#cond, __FILE__, __LINE__, msg); \
-    } while (0)
+        // Value bound to `_`. The user-provided destructor keeps compilers
+        // from flagging the otherwise unused loop variable.
+        struct Iteration {
+            ~Iteration() {}
+        };
 
-#define REQUIRE_EQ(a, b)                                   \
-    do {                                                   \
-        const auto& _a = (a);                              \
-        const auto& _b = (b);                              \
-        if (!(_a == _b))                                   \
-            NTest::FAIL(#a " == " #b, __FILE__, __LINE__); \
-    } while (0)
+        class Iterator {
+        public:
+            Iterator(BenchmarkState* state, std::size_t remaining)
+                : state_(state), remaining_(remaining) {}
 
-#define REQUIRE_NE(a, b)                                   \
-    do {                                                   \
-        if (!((a) != (b)))                                 \
-            NTest::FAIL(#a " != " #b, __FILE__, __LINE__); \
-    } while (0)
+            Iteration operator*() const { return {}; }
+            Iterator& operator++() {
+                --remaining_;
+                return *this;
+            }
+            bool operator!=(const Iterator&) {
+                if (remaining_ != 0)
+                    return true;
+                state_->finish();
+                return false;
+            }
 
-// ----- Non-fatal assertions -----
+        private:
+            BenchmarkState* state_;
+            std::size_t remaining_;
+        };
 
-#define EXPECT(cond)                        \
-    do {                                    \
-        try {                               \
-            REQUIRE(cond);                  \
-        } catch (const std::exception& e) { \
-            NTest::EXPECT_FAIL(e);          \
-        }                                   \
-    } while (0)
+        // `perf`, if given, counts exactly while the loop is timed.
+        explicit BenchmarkState(std::size_t iterations,
+                                detail::PerfCounters* perf = nullptr,
+                                std::int64_t range = 0)
+            : iterations_(iterations), perf_(perf), range_(range) {}
 
-#define EXPECT_EQ(a, b)                     \
-    do {                                    \
-        try {                               \
-            REQUIRE_EQ(a, b);               \
-        } catch (const std::exception& e) { \
-            NTest::EXPECT_FAIL(e);          \
-        }                                   \
-    } while (0)
+        Iterator begin() {
+            started_ = true;
+            if (perf_ != nullptr)
+                perf_->start();
+            start_ = clock::now();
+            return {this, iterations_};
+        }
+        Iterator end() { return {this, 0}; }
 
-// ----- Exception assertions -----
-
-#define REQUIRE_THROW(expr)                                                \
-    do {                                                                   \
-        bool _threw = false;                                               \
-        try {                                                              \
-            expr;                                                          \
-        } catch (...) {                                                    \
-            _threw = true;                                                 \
-        }                                                                  \
-        if (!_threw)                                                       \
-            NTest::FAIL("expected exception: " #expr, __FILE__, __LINE__); \
-    } while (0)
+        // Excludes per-iteration setup from the measurement.
+        void pause_timing() {
+            elapsed_ += clock::now() - start_;
+            if (perf_ != nullptr)
+                perf_->stop();
+            paused_ = true;
+        }
+        void resume_timing() {
+            paused_ = false;
+            if (perf_ != nullptr)
+                perf_->start();
+            start_ = clock::now();
+        }
 
-#define REQUIRE_NO_THROW(expr)                                               \
-    do {                                                                     \
-        try {                                                                \
-            expr;                                                            \
-        } catch (...) {                                                      \
-            NTest::FAIL("unexpected exception: " #expr, __FILE__, __LINE__); \
-        }                                                                    \
-    } while (0)
+        // Input size of this BENCHMARK_RANGE run; 0 for BENCHMARK.
+        std::int64_t range() const { return range_; }
+
+        // See REQUIRE_COMPLEXITY_AT_MOST.
+        void require_complexity_at_most(Complexity limit, const char* expr,
+                                        const char* file, int line) {
+            bound_ = detail::ComplexityBound{limit, expr, file, line};
+        }
+        const std::optional<detail::ComplexityBound>& complexity_bound()
+            const {
+            return bound_;
+        }
+
+        std::size_t iterations() const { return iterations_; }
+        bool completed() const { return completed_; }
+        bool started() const { return started_; }
+        std::chrono::nanoseconds elapsed() const { return elapsed_; }
+
+    private:
+        void finish() {
+            if (!paused_) {
+                elapsed_ += clock::now() - start_;
+                if (perf_ != nullptr)
+                    perf_->stop();
+            }
+            completed_ = true;
+        }
+
+        std::size_t iterations_;
+        detail::PerfCounters* perf_;
+        std::int64_t range_;
+        std::optional<detail::ComplexityBound> bound_;
+        clock::time_point start_{};
+        std::chrono::nanoseconds elapsed_{0};
+        bool started_ = false;
+        bool paused_ = false;
+        bool completed_ = false;
+    };
 
-// ----- Legacy ASSERT_* aliases (fatal) -----
+    // Keeps `value` (and the computation producing it) alive without
+    // otherwise affecting code generation.
+#if defined(__GNUC__) || defined(__clang__)
+    template <typename T>
+    inline void DoNotOptimize(const T& value) {
+        asm volatile("" : : "r,m"(value) : "memory");
+    }
+
+    // Register-sized scalars stay in a register, anything else in memory;
+    // GCC rejects the "+r,m" alternative list once the call is inlined.
+    template <typename T>
+    inline void DoNotOptimize(T& value) {
+        if constexpr (std::is_scalar_v<T> && sizeof(T) <= sizeof(void*))
+            asm volatile("" : "+r"(value) : : "memory");
+        else
+            asm volatile("" : "+m"(value) : : "memory");
+    }
+
+    // Forces pending writes to memory to be treated as observed.
+    inline void ClobberMemory() { asm volatile("" : : : "memory"); }
+#else
+    namespace detail {
+        inline void use_char_pointer(const volatile char*) {}
+    }  // namespace detail
+
+    template <typename T>
+    inline void DoNotOptimize(const T& value) {
+        detail::use_char_pointer(
+            &reinterpret_cast<const volatile char&>(value));
+        std::atomic_signal_fence(std::memory_order_acq_rel);
+    }
+
+    inline void ClobberMemory() {
+        std::atomic_signal_fence(std::memory_order_acq_rel);
+    }
+#endif
+
+    struct BenchmarkOptions {
+        std::chrono::nanoseconds warmup = std::chrono::milliseconds(50);
+        std::chrono::nanoseconds sample_time = std::chrono::milliseconds(10);
+        unsigned samples = 20;
+
+        // Baseline file to write the samples of this run to, and one to
+        // compare this run against. Empty disables either step.
+        std::string save_baseline;
+        std::string compare_baseline;
+
+        // A benchmark regresses when it is slower than its baseline with a
+        // one-sided Mann-Whitney p-value below `alpha` and its median grew
+        // by more than `threshold` (relative, 0.05 = 5%).
+        double alpha = 0.05;
+        double threshold = 0.05;
+    };
+
+    // Robust summary of a set of samples (nanoseconds per iteration).
+    struct SampleStats {
+        double min = 0;
+        double median = 0;
+        double mean = 0;
+        double stddev = 0;  // sample standard deviation
+        double mad = 0;     // median absolute deviation
+    };
+
+    namespace detail {
+        inline double median_of(std::vector<double> v) {
+            if (v.empty())
+                return 0;
+            const std::size_t mid = v.size() / 2;
+            std::nth_element(v.begin(), v.begin() + mid, v.end());
+            const double upper = v[mid];
+            if (v.size() % 2 != 0)
+                return upper;
+            return (*std::max_element(v.begin(), v.begin() + mid) + upper) /
+                   2;
+        }
+    }  // namespace detail
+
+    inline SampleStats summarize(const std::vector<double>& samples) {
+        SampleStats stats;
+        if (samples.empty())
+            return stats;
+
+        stats.min = *std::min_element(samples.begin(), samples.end());
+        stats.median = detail::median_of(samples);
+
+        double sum = 0;
+        for (double x : samples)
+            sum += x;
+        stats.mean = sum / samples.size();
+
+        double sq = 0;
+        std::vector<double> deviations;
+        deviations.reserve(samples.size());
+        for (double x : samples) {
+            sq += (x - stats.mean) * (x - stats.mean);
+            deviations.push_back(std::fabs(x - stats.median));
+        }
+        if (samples.size() > 1)
+            stats.stddev = std::sqrt(sq / (samples.size() - 1));
+        stats.mad = detail::median_of(std::move(deviations));
+        return stats;
+    }
+
+    struct BenchmarkResult {
+        const TestCase* bench = nullptr;
+        std::size_t iterations = 0;  // per sample
+        std::vector<double> samples;  // ns per iteration
+        SampleStats stats;
+        std::string error;  // non-empty if the body failed
+        std::optional<PerfStats> perf;  // totals over all samples
+        std::int64_t range = 0;  // input size of a BENCHMARK_RANGE point
+        std::optional<detail::ComplexityBound> complexity_bound;
+
+        bool ok() const { return error.empty(); }
+    };
+
+    namespace detail {
+        inline std::chrono::nanoseconds run_batch(
+            const TestCase& bench, std::size_t iterations,
+            PerfCounters* perf = nullptr, std::int64_t range = 0,
+            std::optional<ComplexityBound>* bound = nullptr) {
+            BenchmarkState state(iterations, perf, range);
+            bench.benchmark(state);
+            if (!state.completed())
+                abort_current(
+                    "benchmark body did not iterate its state to the end");
+            if (bound != nullptr && state.complexity_bound())
+                *bound = state.complexity_bound();
+            return state.elapsed();
+        }
+
+        // Iteration count expected to fill `target`, given that `n`
+        // iterations took `took`. Grows at most 10x per step.
+        inline std::size_t next_iterations(std::size_t n,
+                                           std::chrono::nanoseconds took,
+                                           std::chrono::nanoseconds target) {
+            const double ratio =
+                took.count() <= 0
+                    ? 10.0
+                    : 1.2 * static_cast<double>(target.count()) /
+                          static_cast<double>(took.count());
+            const double grown = n * std::min(10.0, std::max(1.5, ratio));
+            return static_cast<std::size_t>(std::ceil(grown));
+        }
+
+        inline void append_ns(std::string& out, double ns) {
+            char buf[48];
+            int n;
+            if (ns < 1e3)
+                n = std::snprintf(buf, sizeof buf, "%.2f ns", ns);
+            else if (ns < 1e6)
+                n = std::snprintf(buf, sizeof buf, "%.2f us", ns / 1e3);
+            else if (ns < 1e9)
+                n = std::snprintf(buf, sizeof buf, "%.2f ms", ns / 1e6);
+            else
+                n = std::snprintf(buf, sizeof buf, "%.2f s", ns / 1e9);
+            out.append(buf, static_cast<std::size_t>(n));
+        }
+
+        inline std::string format_ns(double ns) {
+            std::string text;
+            append_ns(text, ns);
+            return text;
+        }
+
+        inline void append_count(std::string& out, double x) {
+            char buf[32];
+            int n;
+            if (x < 1e3)
+                n = std::snprintf(buf, sizeof buf, "%.4g", x);
+            else if (x < 1e6)
+                n = std::snprintf(buf, sizeof buf, "%.2fk", x / 1e3);
+            else if (x < 1e9)
+                n = std::snprintf(buf, sizeof buf, "%.2fM", x / 1e6);
+            else
+                n = std::snprintf(buf, sizeof buf, "%.2fG", x / 1e9);
+            out.append(buf, static_cast<std::size_t>(n));
+        }
+
+        // "cycles 1.20M, instructions 2.31M, IPC 1.92, ..." for the
+        // counted events, each divided by `per`.
+        inline void append_perf(std::string& out, const PerfStats& perf,
+                                double per = 1) {
+            static const char* const labels[PerfStats::kEvents] = {
+                "cycles",       "instructions", "cache-misses",
+                "branch-misses", "ctx-switches", "task-clock",
+                "page-faults"};
+            bool first = true;
+            for (unsigned e = 0; e < PerfStats::kEvents; ++e) {
+                const auto event = PerfStats::Event(e);
+                if (!perf.has(event))
+                    continue;
+                if (!first)
+                    out.append(", ");
+                first = false;
+                out.append(labels[e]);
+                out.push_back(' ');
+                const double x = static_cast<double>(perf[event]) / per;
+                if (event == PerfStats::TaskClock)
+                    append_ns(out, x);
+                else
+                    append_count(out, x);
+                if (event == PerfStats::Instructions &&
+                    perf.has(PerfStats::Cycles)) {
+                    char buf[32];
+                    const int n = std::snprintf(buf, sizeof buf, ", IPC %.2f",
+                                                perf.ipc());
+                    out.append(buf, static_cast<std::size_t>(n));
+                }
+            }
+        }
+    }  // namespace detail
+
+    // Warms up, calibrates the iteration count so that one sample takes
+    // about opts.sample_time, then records opts.samples samples. `range`
+    // is passed to the body as state.range().
+    inline BenchmarkResult run_benchmark(const TestCase& bench,
+                                         const BenchmarkOptions& opts = {},
+                                         std::int64_t range = 0) {
+        using clock = std::chrono::steady_clock;
+        BenchmarkResult result;
+        result.bench = &bench;
+        result.range = range;
+        detail::TestContext ctx;
+        const bool completed = detail::invoke_guarded(ctx, [&] {
+            std::size_t n = 1;
+            const auto warmup_end = clock::now() + opts.warmup;
+            for (;;) {
+                const auto took = detail::run_batch(bench, n, nullptr, range,
+                                                    &result.complexity_bound);
+                if (took >= opts.sample_time) {
+                    if (clock::now() >= warmup_end)
+                        break;
+                } else {
+                    n = detail::next_iterations(n, took, opts.sample_time);
+                }
+            }
+
+            result.iterations = n;
+            result.samples.reserve(opts.samples);
+            detail::PerfCounters* perf = nullptr;
+            if (detail::perf_enabled()) {
+                perf = &detail::thread_perf_counters();
+                perf->reset();
+            }
+            for (unsigned i = 0; i < opts.samples; ++i) {
+                const auto took = detail::run_batch(bench, n, perf, range);
+                result.samples.push_back(static_cast<double>(took.count()) /
+                                         static_cast<double>(n));
+            }
+            result.stats = summarize(result.samples);
+            if (perf != nullptr && perf->active())
+                result.perf = perf->read();
+        });
+        if (!completed) {
+            if (!ctx.error.empty())
+                result.error = ctx.error;
+            else if (!ctx.failures.empty())
+                result.error = format_failure(ctx.failures.back());
+            else
+                result.error = "unknown exception";
+        }
+        return result;
+    }
+
+    namespace detail {
+        // "Name", or "Name/1024" for one input size of a BENCHMARK_RANGE.
+        inline std::string benchmark_name(const BenchmarkResult& result) {
+            std::string name = result.bench->name;
+            if (result.bench->is_range())
+                name += "/" + std::to_string(result.range);
+            return name;
+        }
+    }  // namespace detail
+
+    inline std::string format_benchmark(const BenchmarkResult& result) {
+        const std::string name = detail::benchmark_name(result);
+        if (!result.ok()) {
+            return NTEST_COLOR(red)("[FAIL] " + name) + " - " +
+                   NTEST_COLOR(yellow)(result.error) + "\n";
+        }
+        const auto& st = result.stats;
+        std::ostringstream oss;
+        oss << NTEST_COLOR(cyan)("[BENCH] " + name) << "\n"
+            << "    median " << detail::format_ns(st.median) << "  mean "
+            << detail::format_ns(st.mean) << "  min "
+            << detail::format_ns(st.min) << "  stddev "
+            << detail::format_ns(st.stddev) << "  MAD "
+            << detail::format_ns(st.mad) << "  (" << result.samples.size()
+            << " samples x " << result.iterations << " iterations)\n";
+        if (result.perf) {
+            std::string line = "    per iteration: ";
+            detail::append_perf(line, *result.perf,
+                                static_cast<double>(result.iterations) *
+                                    static_cast<double>(result.samples.size()));
+            oss << line << "\n";
+        }
+        return oss.str();
+    }
+
+    // =========================
+    // Complexity
+    // =========================
+
+    struct ComplexityFit {
+        Complexity model = Complexity::O_1;
+        double coefficient = 0;  // ns per unit of the model's f(n)
+        double rms = 0;          // RMS residual relative to the mean time
+    };
+
+    struct ComplexityResult {
+        const TestCase* bench = nullptr;
+        std::vector<BenchmarkResult> points;  // one per input size
+        std::vector<ComplexityFit> fits;      // every model, in enum order
+        ComplexityFit best;                   // the lowest RMS
+        std::string error;  // a failing point or an exceeded bound
+
+        bool ok() const { return error.empty(); }
+    };
+
+    namespace detail {
+        inline double complexity_term(Complexity model, double n) {
+            switch (model) {
+            case Complexity::O_1:
+                return 1;
+            case Complexity::O_LOG_N:
+                return std::log2(n);
+            case Complexity::O_N:
+                return n;
+            case Complexity::O_N_LOG_N:
+                return n * std::log2(n);
+            case Complexity::O_N_SQUARED:
+                return n * n;
+            }
+            return 1;
+        }
+
+        // lo, 2 lo, 4 lo, ... and finally hi.
+        inline std::vector<std::int64_t> range_sizes(std::int64_t lo,
+                                                     std::int64_t hi) {
+            std::vector<std::int64_t> sizes;
+            for (std::int64_t n = std::max<std::int64_t>(lo, 1); n < hi;
+                 n *= 2)
+                sizes.push_back(n);
+            sizes.push_back(hi);
+            return sizes;
+        }
+    }  // namespace detail
+
+    // Least-squares fit of time(n) = coefficient * f(n) for one model.
+    inline ComplexityFit fit_complexity(const std::vector<std::int64_t>& sizes,
+                                        const std::vector<double>& ns,
+                                        Complexity model) {
+        ComplexityFit fit;
+        fit.model = model;
+        if (sizes.empty() || sizes.size() != ns.size())
+            return fit;
+        double tf = 0;
+        double ff = 0;
+        double mean = 0;
+        for (std::size_t i = 0; i < sizes.size(); ++i) {
+            const double f = detail::complexity_term(
+                model, static_cast<double>(sizes[i]));
+            tf += ns[i] * f;
+            ff += f * f;
+            mean += ns[i];
+        }
+        mean /= static_cast<double>(sizes.size());
+        fit.coefficient = ff > 0 ? tf / ff : 0;
+        double rss = 0;
+        for (std::size_t i = 0; i < sizes.size(); ++i) {
+            const double r = ns[i] - fit.coefficient *
+                                         detail::complexity_term(
+                                             model,
+                                             static_cast<double>(sizes[i]));
+            rss += r * r;
+        }
+        if (mean > 0)
+            fit.rms = std::sqrt(rss / static_cast<double>(sizes.size())) /
+                      mean;
+        return fit;
+    }
+
+    // Every model, in enum order.
+    inline std::vector<ComplexityFit> fit_complexity(
+        const std::vector<std::int64_t>& sizes, const std::vector<double>& ns) {
+        std::vector<ComplexityFit> fits;
+        for (int m = 0; m <= static_cast<int>(Complexity::O_N_SQUARED); ++m)
+            fits.push_back(fit_complexity(sizes, ns, Complexity(m)));
+        return fits;
+    }
+
+    // Runs a BENCHMARK_RANGE once per input size and fits the median
+    // times. Fails if a point fails or the best fit grows faster than a
+    // bound the body declared with REQUIRE_COMPLEXITY_AT_MOST.
+    inline ComplexityResult run_benchmark_range(
+        const TestCase& bench, const BenchmarkOptions& opts = {}) {
+        ComplexityResult result;
+        result.bench = &bench;
+        std::optional<detail::ComplexityBound> bound;
+        std::vector<std::int64_t> sizes;
+        std::vector<double> medians;
+        for (const std::int64_t n :
+             detail::range_sizes(bench.range_lo, bench.range_hi)) {
+            result.points.push_back(run_benchmark(bench, opts, n));
+            const BenchmarkResult& point = result.points.back();
+            if (!point.ok()) {
+                result.error =
+                    detail::benchmark_name(point) + ": " + point.error;
+                return result;
+            }
+            if (point.complexity_bound)
+                bound = point.complexity_bound;
+            sizes.push_back(n);
+            medians.push_back(point.stats.median);
+        }
+        if (sizes.size() < 2) {
+            result.error = "needs at least two input sizes to fit";
+            return result;
+        }
+
+        result.fits = fit_complexity(sizes, medians);
+        result.best = *std::min_element(
+            result.fits.begin(), result.fits.end(),
+            [](const ComplexityFit& a, const ComplexityFit& b) {
+                return a.rms < b.rms;
+            });
+        if (bound && result.best.model > bound->limit) {
+            char rms[32];
+            std::snprintf(rms, sizeof rms, "%.1f%%", result.best.rms * 100);
+            Failure f;
+            f.expr = bound->expr;
+            f.file = bound->file;
+            f.line = bound->line;
+            f.msg = std::string("best fit ") +
+                    complexity_name(result.best.model) + " (RMS " + rms +
+                    "), limit " + complexity_name(bound->limit);
+            result.error = format_failure(f);
+        }
+        return result;
+    }
+
+    inline std::string format_complexity(const ComplexityResult& result) {
+        const std::string name = result.bench->name;
+        std::string out;
+        if (!result.fits.empty()) {
+            out += NTEST_COLOR(cyan)("[BIG-O] " + name);
+            out += " ~ ";
+            out += complexity_name(result.best.model);
+            out += "  (coefficient ";
+            detail::append_ns(out, result.best.coefficient);
+            char rms[48];
+            std::snprintf(rms, sizeof rms, ", RMS %.1f%%)\n",
+                          result.best.rms * 100);
+            out += rms;
+        }
+        if (!result.ok()) {
+            out += NTEST_COLOR(red)("[FAIL] " + name) + " - " +
+                   NTEST_COLOR(yellow)(result.error) + "\n";
+        }
+        return out;
+    }
+
+    // =========================
+    // Performance budgets
+    // =========================
+
+    namespace detail {
+        // REQUIRE_FASTER_THAN and REQUIRE_THROUGHPUT_AT_LEAST time this many
+        // samples and compare the median with the limit. Each sample runs
+        // enough calls to last about kBudgetSampleTime, so that short
+        // expressions are not lost in the clock's resolution.
+        inline constexpr unsigned kBudgetSamples = 9;
+        inline constexpr std::chrono::nanoseconds kBudgetSampleTime =
+            std::chrono::microseconds(200);
+
+        struct BudgetTiming {
+            double ns_per_call = 0;     // median over the samples
+            double units_per_sec = 0;   // median over the samples
+            std::size_t calls = 0;      // per sample
+            unsigned samples = 0;
+        };
+
+        // Times fn(), which returns the work one call did (bytes, items,
+        // or 1). A first call slower than `give_up` is reported as the
+        // only sample, so a badly blown budget does not run nine times.
+        template <typename Fn>
+        BudgetTiming time_budget(Fn&& fn, std::chrono::nanoseconds give_up) {
+            using clock = std::chrono::steady_clock;
+            BudgetTiming out;
+            auto start = clock::now();
+            double units = fn();
+            const std::chrono::nanoseconds first = clock::now() - start;
+            const double first_ns = std::max<double>(1, first.count());
+            out.calls = 1;
+            out.samples = 1;
+            out.ns_per_call = first_ns;
+            out.units_per_sec = units * 1e9 / first_ns;
+            if (give_up.count() > 0 && first > give_up)
+                return out;
+
+            out.calls = static_cast<std::size_t>(std::clamp<double>(
+                static_cast<double>(kBudgetSampleTime.count()) / first_ns, 1,
+                1e6));
+            std::vector<double> ns(kBudgetSamples);
+            std::vector<double> rates(kBudgetSamples);
+            for (unsigned s = 0; s < kBudgetSamples; ++s) {
+                units = 0;
+                start = clock::now();
+                for (std::size_t i = 0; i < out.calls; ++i)
+                    units += fn();
+                const std::chrono::nanoseconds took = clock::now() - start;
+                const double took_ns = std::max<double>(1, took.count());
+                ns[s] = took_ns / static_cast<double>(out.calls);
+                rates[s] = units * 1e9 / took_ns;
+            }
+            out.samples = kBudgetSamples;
+            out.ns_per_call = median_of(std::move(ns));
+            out.units_per_sec = median_of(std::move(rates));
+            return out;
+        }
+
+        // Calls fn() and hands its result, if it has one, to DoNotOptimize
+        // so that a timed expression is not optimized away.
+        template <typename Fn>
+        void sink_result(Fn&& fn) {
+            if constexpr (std::is_void_v<std::invoke_result_t<Fn&>>) {
+                fn();
+            } else {
+                auto&& value = fn();
+                DoNotOptimize(value);
+            }
+        }
+
+        inline void append_samples(std::string& out, const BudgetTiming& t) {
+            out += " over " + std::to_string(t.samples) + " sample";
+            if (t.samples != 1)
+                out += "s";
+            out += " of " + std::to_string(t.calls) + " call";
+            if (t.calls != 1)
+                out += "s";
+        }
+
+        template <typename Fn>
+        void check_faster_than(std::chrono::nanoseconds limit, Fn&& fn,
+                               const char* expr, const char* file, int line) {
+            const BudgetTiming t = time_budget(fn, 10 * limit);
+            if (t.ns_per_call <= static_cast<double>(limit.count()))
+                return;
+            std::string msg = "median ";
+            append_ns(msg, t.ns_per_call);
+            msg += " per call";
+            append_samples(msg, t);
+            msg += ", limit ";
+            append_ns(msg, static_cast<double>(limit.count()));
+            FAIL(expr, file, line, msg.c_str());
+        }
+
+        template <typename Fn>
+        void check_throughput(double per_sec, Fn&& fn, const char* expr,
+                              const char* file, int line) {
+            const BudgetTiming t = time_budget(fn, {});
+            if (t.units_per_sec >= per_sec)
+                return;
+            std::string msg = "median ";
+            append_count(msg, t.units_per_sec);
+            msg += "/s";
+            append_samples(msg, t);
+            msg += ", need at least ";
+            append_count(msg, per_sec);
+            msg += "/s";
+            FAIL(expr, file, line, msg.c_str());
+        }
+
+        // Resident set size of the whole process and its high-water mark,
+        // in bytes; -1 where the platform does not report one.
+        struct RssSample {
+            std::int64_t current = -1;
+            std::int64_t peak = -1;
+        };
+
+        inline RssSample rss_now() {
+            RssSample sample;
+#if NTEST_HAS_FORK
+            rusage usage{};
+            if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#if defined(__APPLE__)
+                sample.peak = usage.ru_maxrss;  // bytes
+#else
+                sample.peak = std::int64_t{usage.ru_maxrss} * 1024;  // KiB
+#endif
+            }
+#endif
+#if defined(__linux__)
+            if (std::FILE* f = std::fopen("/proc/self/statm", "r")) {
+                long size = 0;
+                long resident = 0;
+                if (std::fscanf(f, "%ld %ld", &size, &resident) == 2)
+                    sample.current =
+                        std::int64_t{resident} * sysconf(_SC_PAGESIZE);
+                std::fclose(f);
+            }
+#endif
+            return sample;
+        }
+
+        // The larger of the growth in current RSS and, if `expr` raised
+        // the high-water mark, the new peak above the starting RSS. The
+        // peak catches memory that was touched and released again.
+        inline std::int64_t rss_growth(const RssSample& before,
+                                       const RssSample& after) {
+            std::int64_t growth = 0;
+            if (before.current >= 0 && after.current >= 0)
+                growth = after.current - before.current;
+            if (before.peak >= 0 && after.peak > before.peak) {
+                const std::int64_t base =
+                    before.current >= 0 ? before.current : before.peak;
+                growth = std::max(growth, after.peak - base);
+            }
+            return growth;
+        }
+
+        inline void check_rss_growth(const RssSample& before,
+                                     std::int64_t limit, const char* expr,
+                                     const char* file, int line) {
+            if (before.current < 0 && before.peak < 0)
+                FAIL(expr, file, line,
+                     "resident set size is not available on this platform");
+            const std::int64_t growth = rss_growth(before, rss_now());
+            if (growth <= limit)
+                return;
+            const std::string msg = "resident set grew by " +
+                                    format_bytes(growth) + ", limit " +
+                                    format_bytes(limit);
+            FAIL(expr, file, line, msg.c_str());
+        }
+    }  // namespace detail
+
+    // =========================
+    // Benchmark baselines
+    // =========================
+
+    // Samples (ns per iteration) keyed by benchmark name.
+    using Baseline = std::map<std::string, std::vector<double>>;
+
+    // Compact text format, one benchmark per line:
+    //   ntest-baseline 1
+    //   <name> <sample count> <sample> <sample> ...
+    inline void write_baseline(std::ostream& os,
+                               const std::vector<BenchmarkResult>& results) {
+        os << "ntest-baseline 1\n" << std::setprecision(6);
+        for (const auto& r : results) {
+            if (!r.ok())
+                continue;
+            os << detail::benchmark_name(r) << ' ' << r.samples.size();
+            for (double x : r.samples)
+                os << ' ' << x;
+            os << '\n';
+        }
+    }
+
+    inline Baseline read_baseline(std::istream& is) {
+        std::string magic;
+        int version = 0;
+        if (!(is >> magic >> version) || magic != "ntest-baseline" ||
+            version != 1)
+            detail::raise(
+                std::runtime_error("not an ntest-baseline v1 file"));
+
+        Baseline baseline;
+        std::string name;
+        std::size_t count = 0;
+        while (is >> name >> count) {
+            auto& samples = baseline[name];
+            samples.resize(count);
+            for (double& x : samples) {
+                if (!(is >> x))
+                    detail::raise(std::runtime_error(
+                        "truncated baseline entry: " + name));
+            }
+        }
+        if (!is.eof())
+            detail::raise(std::runtime_error("malformed baseline file"));
+        return baseline;
+    }
+
+    struct MannWhitney {
+        double u = 0;  // U statistic of the first sample
+        double z = 0;  // normal approximation, tie- and continuity-corrected
+        double p = 1;  // one-sided p-value that `a` tends to exceed `b`
+    };
+
+    // Mann-Whitney U test of H1: values in `a` are stochastically greater
+    // than values in `b`.
+    inline MannWhitney mann_whitney(const std::vector<double>& a,
+                                    const std::vector<double>& b) {
+        MannWhitney out;
+        const double n1 = static_cast<double>(a.size());
+        const double n2 = static_cast<double>(b.size());
+        if (a.empty() || b.empty())
+            return out;
+
+        std::vector<std::pair<double, bool>> all;  // value, from `a`
+        all.reserve(a.size() + b.size());
+        for (double x : a)
+            all.emplace_back(x, true);
+        for (double x : b)
+            all.emplace_back(x, false);
+        std::sort(all.begin(), all.end());
+
+        // Average ranks over ties, accumulating the tie correction term.
+        double rank_sum_a = 0;
+        double ties = 0;
+        for (std::size_t i = 0; i < all.size();) {
+            std::size_t j = i;
+            while (j < all.size() && all[j].first == all[i].first)
+                ++j;
+            const double rank = (i + 1 + j) / 2.0;
+            const double t = static_cast<double>(j - i);
+            ties += t * t * t - t;
+            for (std::size_t k = i; k < j; ++k) {
+                if (all[k].second)
+                    rank_sum_a += rank;
+            }
+            i = j;
+        }
+
+        const double n = n1 + n2;
+        out.u = rank_sum_a - n1 * (n1 + 1) / 2;
+        const double mean = n1 * n2 / 2;
+        const double var = n1 * n2 / 12 * ((n + 1) - ties / (n * (n - 1)));
+        if (var <= 0)
+            return out;  // every value identical
+        const double diff = out.u - mean;
+        const double corrected =
+            diff > 0 ? diff - 0.5 : (diff < 0 ? diff + 0.5 : 0.0);
+        out.z = corrected / std::sqrt(var);
+        out.p = 0.5 * std::erfc(out.z / std::sqrt(2.0));
+        return out;
+    }
+
+    struct BenchmarkComparison {
+        enum class Verdict { Unchanged, Regression, Improvement, New };
+
+        std::string name;
+        Verdict verdict = Verdict::New;
+        double baseline_median = 0;
+        double current_median = 0;
+        double delta = 0;  // relative change of the median, +0.1 = 10% slower
+        double p = 1;      // p-value for the direction of `delta`
+    };
+
+    inline BenchmarkComparison compare_to_baseline(
+        const BenchmarkResult& result, const Baseline& baseline,
+        const BenchmarkOptions& opts) {
+        BenchmarkComparison cmp;
+        cmp.name = detail::benchmark_name(result);
+        cmp.current_median = result.stats.median;
+
+        const auto it = baseline.find(cmp.name);
+        if (it == baseline.end() || it->second.empty())
+            return cmp;
+
+        cmp.baseline_median = detail::median_of(it->second);
+        if (cmp.baseline_median > 0)
+            cmp.delta = cmp.current_median / cmp.baseline_median - 1;
+
+        const bool slower = cmp.delta >= 0;
+        cmp.p = slower ? mann_whitney(result.samples, it->second).p
+                       : mann_whitney(it->second, result.samples).p;
+
+        cmp.verdict = BenchmarkComparison::Verdict::Unchanged;
+        if (cmp.p < opts.alpha && std::fabs(cmp.delta) > opts.threshold) {
+            cmp.verdict = slower ? BenchmarkComparison::Verdict::Regression
+                                 : BenchmarkComparison::Verdict::Improvement;
+        }
+        return cmp;
+    }
+
+    inline std::string format_comparison(const BenchmarkComparison& cmp) {
+        std::ostringstream oss;
+        switch (cmp.verdict) {
+            case BenchmarkComparison::Verdict::New:
+                oss << NTEST_COLOR(yellow)("[NEW] " + cmp.name)
+                    << " - not in baseline\n";
+                return oss.str();
+            case BenchmarkComparison::Verdict::Regression:
+                oss << NTEST_COLOR(red)("[REGRESSION] " + cmp.name);
+                break;
+            case BenchmarkComparison::Verdict::Improvement:
+                oss << NTEST_COLOR(green)("[IMPROVED] " + cmp.name);
+                break;
+            case BenchmarkComparison::Verdict::Unchanged:
+                oss << "[UNCHANGED] " << cmp.name;
+                break;
+        }
+        oss << "\n    median " << detail::format_ns(cmp.baseline_median)
+            << " -> " << detail::format_ns(cmp.current_median) << " ("
+            << std::showpos << std::fixed << std::setprecision(1)
+            << cmp.delta * 100 << std::noshowpos << "%)  p="
+            << std::setprecision(4) << cmp.p << " (" << std::setprecision(1)
+            << (1 - cmp.p) * 100 << "% confidence)\n";
+        return oss.str();
+    }
+
+    // =========================
+    // Property-based testing
+    // =========================
+
+    // SplitMix64. Each property case draws from its own stream, derived
+    // from the run seed and the case index, so any case can be replayed
+    // alone and cases can be evaluated in any order or on any thread.
+    class Rng {
+    public:
+        explicit Rng(std::uint64_t seed) : state_(seed) {}
+
+        std::uint64_t next() {
+            std::uint64_t z = (state_ += 0x9e3779b97f4a7c15ull);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            return z ^ (z >> 31);
+        }
+
+        // Uniform in [0, bound); the full 64-bit range if bound is 0.
+        std::uint64_t below(std::uint64_t bound) {
+            return bound == 0 ? next() : next() % bound;
+        }
+
+        // Uniform in [0, 1).
+        double unit() {
+            return static_cast<double>(next() >> 11) *
+                   (1.0 / 9007199254740992.0);
+        }
+
+    private:
+        std::uint64_t state_;
+    };
+
+    struct PropertyOptions {
+        std::size_t cases = 100;  // generated inputs per property
+        std::uint64_t seed = 0;   // 0 picks a fresh seed for every check
+        unsigned threads = 1;     // evaluating cases; 0 = one per core
+        std::size_t batch = 256;  // cases a thread claims at a time
+        std::size_t max_shrinks = 10000;  // candidate runs while shrinking
+    };
+
+    // Generators produce values of `value_type` from an Rng and a size
+    // hint that grows from 0 to 100 over the run, and propose simpler
+    // variants of a failing value through shrink(), simplest first.
+    namespace gen {
+        template <typename T>
+        struct Integers {
+            using value_type = T;
+            T lo;
+            T hi;
+
+            // The in-range value closest to zero, which shrinking aims for.
+            T target() const {
+                if (lo > T(0))
+                    return lo;
+                if (hi < T(0))
+                    return hi;
+                return T(0);
+            }
+
+            T operator()(Rng& rng, std::size_t size) const {
+                const auto from = static_cast<std::uint64_t>(lo);
+                const std::uint64_t span =
+                    static_cast<std::uint64_t>(hi) - from;
+                switch (rng.below(8)) {
+                    case 0:
+                        return lo;  // bias towards the edges
+                    case 1:
+                        return hi;
+                    case 2: {
+                        // Near the target, within the size hint.
+                        const T t = target();
+                        const auto room = static_cast<std::uint64_t>(size);
+                        const std::uint64_t step = rng.below(room + 1);
+                        const bool down = (rng.next() & 1) != 0;
+                        const auto tu = static_cast<std::uint64_t>(t);
+                        if (down && tu - from >= step)
+                            return static_cast<T>(tu - step);
+                        if (!down &&
+                            static_cast<std::uint64_t>(hi) - tu >= step)
+                            return static_cast<T>(tu + step);
+                        return t;
+                    }
+                    default:
+                        return static_cast<T>(
+                            from + rng.below(span == ~std::uint64_t(0)
+                                                 ? 0
+                                                 : span + 1));
+                }
+            }
+
+            std::vector<T> shrink(const T& value) const {
+                std::vector<T> out;
+                const T t = target();
+                if (value == t)
+                    return out;
+                out.push_back(t);
+                // Halve the distance to the target, then step by one.
+                for (T d = static_cast<T>((value - t) / 2); d != T(0);
+                     d = static_cast<T>(d / 2))
+                    out.push_back(static_cast<T>(value - d));
+                const T one = value > t ? T(1) : static_cast<T>(-1);
+                if (static_cast<T>(value - one) != t)
+                    out.push_back(static_cast<T>(value - one));
+                return out;
+            }
+        };
+
+        template <typename T = int>
+        Integers<T> ints(T lo = std::numeric_limits<T>::min(),
+                         T hi = std::numeric_limits<T>::max()) {
+            static_assert(std::is_integral_v<T>,
+                          "ints() needs an integer type");
+            if (lo > hi)
+                detail::raise(std::invalid_argument("ints(): lo > hi"));
+            return Integers<T>{lo, hi};
+        }
+
+        struct Bools {
+            using value_type = bool;
+            bool operator()(Rng& rng, std::size_t) const {
+                return (rng.next() & 1) != 0;
+            }
+            std::vector<bool> shrink(bool value) const {
+                return value ? std::vector<bool>{false} : std::vector<bool>{};
+            }
+        };
+
+        inline Bools bools() { return {}; }
+
+        template <typename T>
+        struct Floats {
+            using value_type = T;
+            T lo;
+            T hi;
+
+            T target() const {
+                return lo > T(0) ? lo : hi < T(0) ? hi : T(0);
+            }
+
+            T operator()(Rng& rng, std::size_t) const {
+                switch (rng.below(8)) {
+                    case 0:
+                        return lo;
+                    case 1:
+                        return hi;
+                    case 2:
+                        return target();
+                    default: {
+                        // Scaled separately so hi - lo cannot overflow.
+                        const T u = static_cast<T>(rng.unit());
+                        const T x = lo * (T(1) - u) + hi * u;
+                        return std::min(std::max(x, lo), hi);
+                    }
+                }
+            }
+
+            std::vector<T> shrink(const T& value) const {
+                std::vector<T> out;
+                const T t = target();
+                if (value == t || std::isnan(value))
+                    return out;
+                out.push_back(t);
+                const T whole = std::trunc(value);
+                if (whole != value && whole >= lo && whole <= hi)
+                    out.push_back(whole);
+                const T half = t + (value - t) / 2;
+                if (std::fabs(half - t) > std::numeric_limits<T>::epsilon() &&
+                    half != value)
+                    out.push_back(half);
+                return out;
+            }
+        };
+
+        template <typename T = double>
+        Floats<T> floats(T lo = T(-1e6), T hi = T(1e6)) {
+            static_assert(std::is_floating_point_v<T>,
+                          "floats() needs a floating-point type");
+            if (!(lo <= hi))
+                detail::raise(std::invalid_argument("floats(): lo > hi"));
+            return Floats<T>{lo, hi};
+        }
+
+        // Picks one of a fixed set of values; shrinks towards the first.
+        template <typename T>
+        struct ElementOf {
+            using value_type = T;
+            std::vector<T> values;
+
+            T operator()(Rng& rng, std::size_t) const {
+                return values[rng.below(values.size())];
+            }
+
+            std::vector<T> shrink(const T& value) const {
+                const auto it = std::find(values.begin(), values.end(), value);
+                return std::vector<T>(values.begin(), it);
+            }
+        };
+
+        template <typename T>
+        ElementOf<T> element_of(std::vector<T> values) {
+            if (values.empty())
+                detail::raise(std::invalid_argument("element_of(): no values"));
+            return ElementOf<T>{std::move(values)};
+        }
+    }  // namespace gen
+
+    namespace detail {
+        // Shrink candidates for a sequence: empty, then with ever smaller
+        // chunks removed, then with one element simplified.
+        template <typename Seq, typename ShrinkElement>
+        std::vector<Seq> shrink_sequence(const Seq& seq, std::size_t min_size,
+                                         ShrinkElement&& shrink_element) {
+            std::vector<Seq> out;
+            const std::size_t n = seq.size();
+            if (n > min_size && min_size == 0)
+                out.emplace_back();
+            for (std::size_t chunk = n / 2; chunk > 0; chunk /= 2) {
+                for (std::size_t at = 0;
+                     at + chunk <= n && n - chunk >= min_size; at += chunk) {
+                    Seq smaller;
+                    smaller.reserve(n - chunk);
+                    smaller.insert(smaller.end(), seq.begin(),
+                                   seq.begin() + at);
+                    smaller.insert(smaller.end(), seq.begin() + at + chunk,
+                                   seq.end());
+                    out.push_back(std::move(smaller));
+                }
+            }
+            for (std::size_t i = 0; i < n; ++i) {
+                for (auto& simpler : shrink_element(seq[i])) {
+                    Seq copy = seq;
+                    copy[i] = std::move(simpler);
+                    out.push_back(std::move(copy));
+                }
+            }
+            return out;
+        }
+
+        inline std::size_t sized_length(Rng& rng, std::size_t size,
+                                        std::size_t min_size,
+                                        std::size_t max_size) {
+            const std::size_t cap =
+                std::max(min_size, std::min(max_size, size));
+            return min_size + rng.below(cap - min_size + 1);
+        }
+    }  // namespace detail
+
+    namespace gen {
+        template <typename G>
+        struct Vectors {
+            using value_type = std::vector<typename G::value_type>;
+            G element;
+            std::size_t min_size;
+            std::size_t max_size;
+
+            value_type operator()(Rng& rng, std::size_t size) const {
+                value_type out(
+                    detail::sized_length(rng, size, min_size, max_size));
+                for (std::size_t i = 0; i < out.size(); ++i)
+                    out[i] = element(rng, size);  // also fine for bool
+                return out;
+            }
+
+            std::vector<value_type> shrink(const value_type& value) const {
+                return detail::shrink_sequence(
+                    value, min_size,
+                    [&](const auto& x) { return element.shrink(x); });
+            }
+        };
+
+        template <typename G>
+        Vectors<G> vectors(G element, std::size_t max_size = 100,
+                           std::size_t min_size = 0) {
+            if (min_size > max_size)
+                detail::raise(
+                    std::invalid_argument("vectors(): min_size > max_size"));
+            return Vectors<G>{std::move(element), min_size, max_size};
+        }
+
+        struct Strings {
+            using value_type = std::string;
+            std::string alphabet;
+            std::size_t max_size;
+
+            std::string operator()(Rng& rng, std::size_t size) const {
+                std::string out(detail::sized_length(rng, size, 0, max_size),
+                                '\0');
+                for (char& c : out)
+                    c = alphabet[rng.below(alphabet.size())];
+                return out;
+            }
+
+            std::vector<std::string> shrink(const std::string& value) const {
+                return detail::shrink_sequence(value, 0, [&](char c) {
+                    std::string simpler;
+                    if (c != alphabet.front())
+                        simpler.push_back(alphabet.front());
+                    return simpler;
+                });
+            }
+        };
+
+        // Strings over `alphabet`; shrinking simplifies towards its first
+        // character. The default is printable ASCII.
+        inline Strings strings(std::size_t max_size = 100,
+                               std::string alphabet = std::string()) {
+            if (alphabet.empty()) {
+                for (char c = ' '; c <= '~'; ++c)
+                    alphabet.push_back(c);
+                std::rotate(alphabet.begin(), alphabet.begin() + ('a' - ' '),
+                            alphabet.end());  // shrink towards 'a'
+            }
+            return Strings{std::move(alphabet), max_size};
+        }
+    }  // namespace gen
+
+    namespace detail {
+        template <typename T, typename = void>
+        struct is_streamable : std::false_type {};
+        template <typename T>
+        struct is_streamable<
+            T, std::void_t<decltype(std::declval<std::ostream&>()
+                                    << std::declval<const T&>())>>
+            : std::true_type {};
+
+        template <typename T>
+        struct is_vector : std::false_type {};
+        template <typename T, typename A>
+        struct is_vector<std::vector<T, A>> : std::true_type {};
+
+        // Renders a property input for the failure report.
+        template <typename T>
+        void describe(std::ostream& os, const T& value) {
+            if constexpr (std::is_same_v<T, std::string>) {
+                os << std::quoted(value);
+            } else if constexpr (std::is_same_v<T, bool>) {
+                os << (value ? "true" : "false");
+            } else if constexpr (std::is_floating_point_v<T>) {
+                os << std::setprecision(std::numeric_limits<T>::max_digits10)
+                   << value;
+            } else if constexpr (is_vector<T>::value) {
+                os << '[';
+                for (std::size_t i = 0; i < value.size(); ++i) {
+                    if (i > 0)
+                        os << ", ";
+                    describe(os, static_cast<const typename T::value_type&>(
+                                     value[i]));
+                }
+                os << ']';
+            } else if constexpr (is_streamable<T>::value) {
+                os << value;
+            } else {
+                os << "<unprintable>";
+            }
+        }
+
+        // Settings used by PROPERTY tests; the runner installs its own.
+        inline PropertyOptions& property_defaults() {
+            static PropertyOptions options;
+            return options;
+        }
+
+        class PropertyDefaultsScope {
+        public:
+            explicit PropertyDefaultsScope(const PropertyOptions& options)
+                : previous_(property_defaults()) {
+                property_defaults() = options;
+            }
+            ~PropertyDefaultsScope() { property_defaults() = previous_; }
+            PropertyDefaultsScope(const PropertyDefaultsScope&) = delete;
+            PropertyDefaultsScope& operator=(const PropertyDefaultsScope&) =
+                delete;
+
+        private:
+            PropertyOptions previous_;
+        };
+
+        inline std::uint64_t fresh_seed() {
+            Rng rng(static_cast<std::uint64_t>(
+                std::chrono::high_resolution_clock::now()
+                    .time_since_epoch()
+                    .count()));
+            const std::uint64_t seed = rng.next();
+            return seed != 0 ? seed : 1;
+        }
+
+        inline std::uint64_t case_seed(std::uint64_t seed, std::size_t index) {
+            return Rng(seed ^ (0xd1b54a32d192ed03ull * (index + 1))).next();
+        }
+
+        // Evaluates fails(i) for i in [0, cases) in batches, on `threads`
+        // threads, and returns the lowest failing index. Batches are
+        // claimed in order and a batch is abandoned only once a lower
+        // failure is known, so the answer matches a sequential scan.
+        template <typename Fails>
+        std::optional<std::size_t> find_counterexample(
+            const PropertyOptions& opts, Fails&& fails) {
+            const std::size_t none = std::numeric_limits<std::size_t>::max();
+            const std::size_t batch = std::max<std::size_t>(opts.batch, 1);
+            std::atomic<std::size_t> next_batch{0};
+            std::atomic<std::size_t> lowest{none};
+
+            auto work = [&] {
+                for (;;) {
+                    const std::size_t start = next_batch.fetch_add(batch);
+                    if (start >= opts.cases || start > lowest.load())
+                        return;
+                    const std::size_t end = std::min(opts.cases, start + batch);
+                    for (std::size_t i = start; i < end; ++i) {
+                        if (i > lowest.load())
+                            break;
+                        if (fails(i)) {
+                            std::size_t seen = lowest.load();
+                            while (i < seen &&
+                                   !lowest.compare_exchange_weak(seen, i)) {
+                            }
+                            break;
+                        }
+                    }
+                }
+            };
+
+            unsigned threads = opts.threads != 0
+                                   ? opts.threads
+                                   : std::thread::hardware_concurrency();
+            const std::size_t batches = (opts.cases + batch - 1) / batch;
+            threads = static_cast<unsigned>(std::min<std::size_t>(
+                std::max(threads, 1u), std::max<std::size_t>(batches, 1)));
+            run_on_threads(threads, [&](unsigned) { work(); });
+
+            if (lowest.load() == none)
+                return std::nullopt;
+            return lowest.load();
+        }
+
+        template <std::size_t... I, typename Fn>
+        void for_each_index(std::index_sequence<I...>, Fn&& fn) {
+            (fn(std::integral_constant<std::size_t, I>{}), ...);
+        }
+
+        template <typename Gens>
+        struct property_signature;
+        template <typename... Gens>
+        struct property_signature<std::tuple<Gens...>> {
+            using type = void(typename Gens::value_type...);
+        };
+        template <typename Gens>
+        using property_signature_t = typename property_signature<Gens>::type;
+    }  // namespace detail
+
+    // Runs `property` on opts.cases inputs drawn from `gens`. On the first
+    // failing input the inputs are shrunk greedily, one argument at a
+    // time, and the current test is failed with the minimal case, the
+    // seed that reproduces it and the assertion it broke.
+    template <typename Property, typename... Gens>
+    void check_property(const PropertyOptions& opts, Property&& property,
+                        const Gens&... gens) {
+        using Values = std::tuple<typename Gens::value_type...>;
+        const std::uint64_t seed =
+            opts.seed != 0 ? opts.seed : detail::fresh_seed();
+        const std::size_t cases = std::max<std::size_t>(opts.cases, 1);
+
+        auto generate = [&](std::size_t index) {
+            Rng rng(detail::case_seed(seed, index));
+            const std::size_t size = index * 100 / cases;
+            return Values{gens(rng, size)...};
+        };
+        auto holds = [&](const Values& values, std::string* why) {
+            detail::TestContext ctx;
+            const bool completed = detail::invoke_guarded(
+                ctx, [&] { std::apply(property, values); });
+            if (completed && ctx.failures.empty())
+                return true;
+            if (why != nullptr)
+                *why = !ctx.error.empty()
+                           ? ctx.error
+                           : format_failure(ctx.failures.front());
+            return false;
+        };
+
+        const auto found = detail::find_counterexample(
+            opts, [&](std::size_t i) { return !holds(generate(i), nullptr); });
+        if (!found)
+            return;
+
+        Values current = generate(*found);
+        std::string why;
+        holds(current, &why);
+        const auto all = std::tie(gens...);
+        std::size_t runs = 0;
+        std::size_t steps = 0;
+        for (bool improved = true; improved && runs < opts.max_shrinks;) {
+            improved = false;
+            auto try_arg = [&](auto k) {
+                if (improved)
+                    return;
+                for (auto& candidate :
+                     std::get<k>(all).shrink(std::get<k>(current))) {
+                    if (runs++ >= opts.max_shrinks)
+                        return;
+                    Values next = current;
+                    std::get<k>(next) = std::move(candidate);
+                    std::string reason;
+                    if (!holds(next, &reason)) {
+                        current = std::move(next);
+                        why = std::move(reason);
+                        ++steps;
+                        improved = true;
+                        return;
+                    }
+                }
+            };
+            detail::for_each_index(std::index_sequence_for<Gens...>{}, try_arg);
+        }
+
+        std::ostringstream report;
+        report << "property falsified after " << *found + 1 << " of "
+               << opts.cases << " cases (seed " << seed << ", shrunk "
+               << steps << " times): (";
+        detail::for_each_index(std::index_sequence_for<Gens...>{}, [&](auto k) {
+            if (k != 0)
+                report << ", ";
+            detail::describe(report, std::get<k>(current));
+        });
+        report << ") - " << why;
+        detail::abort_current(report.str());
+    }
+
+    template <typename Property, typename... Gens,
+              typename = std::enable_if_t<!std::is_same_v<
+                  std::decay_t<Property>, PropertyOptions>>>
+    void check_property(Property&& property, const Gens&... gens) {
+        check_property(detail::property_defaults(),
+                       std::forward<Property>(property), gens...);
+    }
+
+    // =========================
+    // Bulk comparisons
+    // =========================
+
+    // A byte range for REQUIRE_BYTES_EQ: NTest::bytes(buffer, length).
+    class ByteView {
+    public:
+        constexpr ByteView(const void* data, std::size_t size)
+            : data_(static_cast<const unsigned char*>(data)), size_(size) {}
+
+        constexpr const unsigned char* data() const { return data_; }
+        constexpr std::size_t size() const { return size_; }
+
+    private:
+        const unsigned char* data_;
+        std::size_t size_;
+    };
+
+    inline ByteView bytes(const void* data, std::size_t size) {
+        return ByteView(data, size);
+    }
+
+    // How far apart an actual and an expected element may be in
+    // REQUIRE_ALL_NEAR: |actual - expected| <= abs + rel * |expected|, or at
+    // most `ulps` representable values apart when ulps > 0. Equal values
+    // and two NaNs always match.
+    struct Tolerance {
+        double abs = 0;
+        double rel = 0;
+        std::uint64_t ulps = 0;
+
+        static Tolerance within(double abs, double rel = 0) {
+            return Tolerance{abs, rel, 0};
+        }
+        static Tolerance ulp(std::uint64_t ulps) {
+            return Tolerance{0, 0, ulps};
+        }
+    };
+
+    namespace detail {
+        template <typename C>
+        using element_t =
+            std::remove_cv_t<std::remove_pointer_t<decltype(std::data(
+                std::declval<const C&>()))>>;
+
+        // Index of the first byte that differs, or n.
+        inline std::size_t first_byte_mismatch(const unsigned char* a,
+                                               const unsigned char* b,
+                                               std::size_t n) {
+            std::size_t i = 0;
+#if NTEST_HAS_SSE2
+            auto same16 = [&](std::size_t at) {
+                return _mm_cmpeq_epi8(
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + at)),
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + at)));
+            };
+            for (; i + 64 <= n; i += 64) {
+                const __m128i low = _mm_and_si128(same16(i), same16(i + 16));
+                const __m128i high =
+                    _mm_and_si128(same16(i + 32), same16(i + 48));
+                const __m128i same = _mm_and_si128(low, high);
+                if (_mm_movemask_epi8(same) != 0xFFFF)
+                    break;
+            }
+            for (; i + 16 <= n; i += 16) {
+                if (_mm_movemask_epi8(same16(i)) != 0xFFFF)
+                    break;
+            }
+#endif
+            for (; i < n; ++i) {
+                if (a[i] != b[i])
+                    return i;
+            }
+            return n;
+        }
+
+        // Element types whose == is exactly byte equality.
+        template <typename T>
+        inline constexpr bool compares_bytewise =
+            std::is_integral_v<T> || std::is_enum_v<T> || std::is_pointer_v<T>;
+
+        template <typename T>
+        void describe_element(std::ostream& os, const T& value) {
+            if constexpr (std::is_integral_v<T> && sizeof(T) == 1 &&
+                          !std::is_same_v<T, bool>)
+                os << static_cast<int>(value);  // not as a character
+            else
+                describe(os, value);
+        }
+
+        template <typename T, typename U>
+        [[noreturn]] NTEST_COLD void fail_mismatch(const T* a, const U* b,
+                                                   std::size_t n,
+                                                   std::size_t first,
+                                                   const char* unit,
+                                                   const char* expr,
+                                                   const char* file,
+                                                   int line) {
+            std::size_t differ = 0;
+            for (std::size_t k = first; k < n; ++k) {
+                if (!(a[k] == b[k]))
+                    ++differ;
+            }
+            std::ostringstream msg;
+            msg << differ << " of " << n << ' ' << unit << " differ, first at ["
+                << first << "]: ";
+            describe_element(msg, a[first]);
+            msg << " vs ";
+            describe_element(msg, b[first]);
+            FAIL(expr, file, line, msg.str().c_str());
+        }
+
+        [[noreturn]] NTEST_COLD inline void fail_sizes(std::size_t actual,
+                                                       std::size_t expected,
+                                                       const char* expr,
+                                                       const char* file,
+                                                       int line) {
+            const std::string msg = "sizes differ: " + std::to_string(actual) +
+                                    " vs " + std::to_string(expected);
+            FAIL(expr, file, line, msg.c_str());
+        }
+
+        template <typename A, typename B>
+        void check_bytes_eq(const A& actual, const B& expected,
+                            const char* expr, const char* file, int line) {
+            const std::size_t n = std::size(actual) * sizeof(element_t<A>);
+            const std::size_t m = std::size(expected) * sizeof(element_t<B>);
+            if (n != m)
+                fail_sizes(n, m, expr, file, line);
+            const auto* a =
+                reinterpret_cast<const unsigned char*>(std::data(actual));
+            const auto* b =
+                reinterpret_cast<const unsigned char*>(std::data(expected));
+            const std::size_t first = first_byte_mismatch(a, b, n);
+            if (NTEST_UNLIKELY(first != n))
+                fail_mismatch(a, b, n, first, "bytes", expr, file, line);
+        }
+
+        template <typename A, typename B>
+        void check_array_eq(const A& actual, const B& expected,
+                            const char* expr, const char* file, int line) {
+            using T = element_t<A>;
+            const std::size_t n = std::size(actual);
+            if (n != std::size(expected))
+                fail_sizes(n, std::size(expected), expr, file, line);
+            const auto* a = std::data(actual);
+            const auto* b = std::data(expected);
+            std::size_t first = 0;
+            if constexpr (std::is_same_v<T, element_t<B>> &&
+                          compares_bytewise<T>) {
+                first = first_byte_mismatch(
+                            reinterpret_cast<const unsigned char*>(a),
+                            reinterpret_cast<const unsigned char*>(b),
+                            n * sizeof(T)) /
+                        sizeof(T);
+            } else {
+                while (first < n && a[first] == b[first])
+                    ++first;
+            }
+            if (NTEST_UNLIKELY(first != n))
+                fail_mismatch(a, b, n, first, "elements", expr, file, line);
+        }
+
+        // Distance between two non-NaN values in units in the last place:
+        // how many representable values lie between them, plus one.
+        template <typename T>
+        std::uint64_t ulp_distance(T a, T b) {
+            using Bits = std::conditional_t<sizeof(T) == 4, std::uint32_t,
+                                            std::uint64_t>;
+            static_assert(sizeof(T) == sizeof(Bits), "float or double only");
+            constexpr Bits sign = Bits{1} << (sizeof(Bits) * 8 - 1);
+            // Sign-magnitude to a scale on which neighbours differ by one
+            // and both zeros meet.
+            auto biased = [](T x) {
+                Bits bits;
+                std::memcpy(&bits, &x, sizeof bits);
+                return (bits & sign) != 0 ? Bits(~bits + 1) : Bits(bits | sign);
+            };
+            const Bits x = biased(a);
+            const Bits y = biased(b);
+            return x > y ? x - y : y - x;
+        }
+
+        template <typename T>
+        bool near(T actual, T expected, const Tolerance& tol) {
+            if (actual == expected)
+                return true;
+            if (std::isnan(actual) || std::isnan(expected))
+                return std::isnan(actual) && std::isnan(expected);
+            if (tol.ulps > 0) {
+                if constexpr (sizeof(T) <= 8)
+                    return ulp_distance(actual, expected) <= tol.ulps;
+            }
+            return std::fabs(actual - expected) <=
+                   static_cast<T>(tol.abs) +
+                       static_cast<T>(tol.rel) * std::fabs(expected);
+        }
+
+#if NTEST_HAS_SSE2
+        // Lanes of (a, e) that satisfy `tol`, as a movemask of 4 floats;
+        // the same arithmetic as near().
+        inline int near_lanes(__m128 a, __m128 e, const Tolerance& tol) {
+            const __m128 both_nan =
+                _mm_and_ps(_mm_cmpunord_ps(a, a), _mm_cmpunord_ps(e, e));
+            const __m128 equal = _mm_cmpeq_ps(a, e);
+            __m128 ok;
+            if (tol.ulps > 0 && _mm_movemask_ps(equal) == 0xF) {
+                ok = equal;  // the common case, without the integer work
+            } else if (tol.ulps > 0) {
+                const __m128i sign = _mm_set1_epi32(INT32_MIN);
+                auto biased = [&](__m128 x) {
+                    const __m128i bits = _mm_castps_si128(x);
+                    const __m128i neg = _mm_srai_epi32(bits, 31);
+                    return _mm_or_si128(
+                        _mm_and_si128(neg,
+                                      _mm_sub_epi32(_mm_setzero_si128(), bits)),
+                        _mm_andnot_si128(neg, _mm_or_si128(bits, sign)));
+                };
+                const __m128i x = biased(a);
+                const __m128i y = biased(e);
+                // Unsigned |x - y| <= ulps, via signed compares of
+                // sign-flipped values.
+                const __m128i x_gt_y = _mm_cmpgt_epi32(_mm_xor_si128(x, sign),
+                                                       _mm_xor_si128(y, sign));
+                const __m128i dist =
+                    _mm_or_si128(_mm_and_si128(x_gt_y, _mm_sub_epi32(x, y)),
+                                 _mm_andnot_si128(x_gt_y, _mm_sub_epi32(y, x)));
+                const auto limit = static_cast<std::uint32_t>(
+                    std::min<std::uint64_t>(tol.ulps, UINT32_MAX));
+                const __m128i over = _mm_cmpgt_epi32(
+                    _mm_xor_si128(dist, sign),
+                    _mm_xor_si128(
+                        _mm_set1_epi32(static_cast<std::int32_t>(limit)),
+                        sign));
+                const __m128 any_nan = _mm_or_ps(_mm_cmpunord_ps(a, a),
+                                                 _mm_cmpunord_ps(e, e));
+                ok = _mm_andnot_ps(_mm_or_ps(_mm_castsi128_ps(over), any_nan),
+                                   _mm_castsi128_ps(_mm_set1_epi32(-1)));
+            } else {
+                const __m128 mag = _mm_castsi128_ps(_mm_set1_epi32(INT32_MAX));
+                const __m128 diff = _mm_and_ps(_mm_sub_ps(a, e), mag);
+                const __m128 limit = _mm_add_ps(
+                    _mm_set1_ps(static_cast<float>(tol.abs)),
+                    _mm_mul_ps(_mm_set1_ps(static_cast<float>(tol.rel)),
+                               _mm_and_ps(e, mag)));
+                ok = _mm_or_ps(equal, _mm_cmple_ps(diff, limit));
+            }
+            return _mm_movemask_ps(_mm_or_ps(ok, both_nan));
+        }
+
+        // As above for 2 doubles. SSE2 has no 64-bit compares, so for ulps
+        // only bitwise-equal lanes are accepted here; near() decides the
+        // rest.
+        inline int near_lanes(__m128d a, __m128d e, const Tolerance& tol) {
+            const __m128d both_nan =
+                _mm_and_pd(_mm_cmpunord_pd(a, a), _mm_cmpunord_pd(e, e));
+            __m128d ok;
+            if (tol.ulps > 0) {
+                ok = _mm_cmpeq_pd(a, e);
+            } else {
+                const __m128d mag =
+                    _mm_castsi128_pd(_mm_set1_epi64x(INT64_MAX));
+                const __m128d diff = _mm_and_pd(_mm_sub_pd(a, e), mag);
+                const __m128d limit =
+                    _mm_add_pd(_mm_set1_pd(tol.abs),
+                               _mm_mul_pd(_mm_set1_pd(tol.rel),
+                                          _mm_and_pd(e, mag)));
+                ok = _mm_or_pd(_mm_cmpeq_pd(a, e), _mm_cmple_pd(diff, limit));
+            }
+            return _mm_movemask_pd(_mm_or_pd(ok, both_nan));
+        }
+#endif
+
+        // Index of the first element outside `tol`, or n.
+        template <typename T>
+        std::size_t first_far(const T* a, const T* e, std::size_t n,
+                              const Tolerance& tol) {
+            std::size_t i = 0;
+#if NTEST_HAS_SSE2
+            if constexpr (std::is_same_v<T, float>) {
+                for (; i + 8 <= n; i += 8) {
+                    const int ok =
+                        near_lanes(_mm_loadu_ps(a + i), _mm_loadu_ps(e + i),
+                                   tol) &
+                        near_lanes(_mm_loadu_ps(a + i + 4),
+                                   _mm_loadu_ps(e + i + 4), tol);
+                    if (ok != 0xF)
+                        break;
+                }
+            } else if constexpr (std::is_same_v<T, double>) {
+                for (; i + 4 <= n; i += 4) {
+                    const int ok =
+                        near_lanes(_mm_loadu_pd(a + i), _mm_loadu_pd(e + i),
+                                   tol) &
+                        near_lanes(_mm_loadu_pd(a + i + 2),
+                                   _mm_loadu_pd(e + i + 2), tol);
+                    if (ok != 0x3 && !(near(a[i], e[i], tol) &&
+                                       near(a[i + 1], e[i + 1], tol) &&
+                                       near(a[i + 2], e[i + 2], tol) &&
+                                       near(a[i + 3], e[i + 3], tol)))
+                        break;
+                }
+            }
+#endif
+            for (; i < n; ++i) {
+                if (!near(a[i], e[i], tol))
+                    return i;
+            }
+            return n;
+        }
+
+        template <typename T>
+        [[noreturn]] NTEST_COLD void fail_far(const T* a, const T* e,
+                                              std::size_t n, std::size_t first,
+                                              const Tolerance& tol,
+                                              const char* expr,
+                                              const char* file, int line) {
+            std::size_t differ = 0;
+            std::size_t worst = first;
+            double worst_error = -1;
+            for (std::size_t k = first; k < n; ++k) {
+                if (near(a[k], e[k], tol))
+                    continue;
+                ++differ;
+                double error = std::numeric_limits<double>::infinity();
+                if (!std::isnan(a[k]) && !std::isnan(e[k])) {
+                    if constexpr (sizeof(T) <= 8) {
+                        if (tol.ulps > 0)
+                            error = static_cast<double>(
+                                ulp_distance(a[k], e[k]));
+                        else
+                            error = std::fabs(static_cast<double>(a[k]) -
+                                              static_cast<double>(e[k]));
+                    } else {
+                        error = static_cast<double>(std::fabs(a[k] - e[k]));
+                    }
+                }
+                if (error > worst_error) {
+                    worst_error = error;
+                    worst = k;
+                }
+            }
+            std::ostringstream msg;
+            msg << differ << " of " << n << " elements differ, first at ["
+                << first << "]: ";
+            describe(msg, a[first]);
+            msg << " vs ";
+            describe(msg, e[first]);
+            msg << "; max error ";
+            if (tol.ulps > 0 && sizeof(T) <= 8)
+                msg << worst_error << " ulps at [" << worst
+                    << "], tolerance " << tol.ulps << " ulps";
+            else
+                msg << worst_error << " at [" << worst << "], tolerance abs "
+                    << tol.abs << " rel " << tol.rel;
+            FAIL(expr, file, line, msg.str().c_str());
+        }
+
+        template <typename A, typename B>
+        void check_all_near(const A& actual, const B& expected,
+                            const Tolerance& tol, const char* expr,
+                            const char* file, int line) {
+            using T = element_t<A>;
+            static_assert(std::is_floating_point_v<T> &&
+                              std::is_same_v<T, element_t<B>>,
+                          "REQUIRE_ALL_NEAR compares arrays of one "
+                          "floating-point type");
+            const std::size_t n = std::size(actual);
+            if (n != std::size(expected))
+                fail_sizes(n, std::size(expected), expr, file, line);
+            const T* a = std::data(actual);
+            const T* e = std::data(expected);
+            const std::size_t first = first_far(a, e, n, tol);
+            if (NTEST_UNLIKELY(first != n))
+                fail_far(a, e, n, first, tol, expr, file, line);
+        }
+    }  // namespace detail
+
+    // =========================
+    // Data-driven tests
+    // =========================
+
+    // Read-only contents of a whole file: memory-mapped where the platform
+    // allows it, read into memory otherwise. Failing to open the file
+    // fails the running test.
+    class MappedFile {
+    public:
+        explicit MappedFile(std::string path) : path_(std::move(path)) {
+#if NTEST_HAS_MMAP
+            const int fd = ::open(path_.c_str(), O_RDONLY);
+            if (fd < 0)
+                detail::abort_current("cannot open data file " + path_);
+            struct stat st {};
+            if (::fstat(fd, &st) != 0) {
+                ::close(fd);
+                detail::abort_current("cannot stat data file " + path_);
+            }
+            size_ = static_cast<std::size_t>(st.st_size);
+            if (size_ > 0) {
+                void* p = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+                ::close(fd);
+                if (p == MAP_FAILED)
+                    detail::abort_current("cannot map data file " + path_);
+                ::madvise(p, size_, MADV_SEQUENTIAL);
+                data_ = static_cast<const char*>(p);
+                mapped_ = true;
+            } else {
+                ::close(fd);
+            }
+#else
+            std::ifstream in(path_, std::ios::binary);
+            if (!in)
+                detail::abort_current("cannot open data file " + path_);
+            fallback_.assign(std::istreambuf_iterator<char>(in), {});
+            data_ = fallback_.data();
+            size_ = fallback_.size();
+#endif
+        }
+
+        ~MappedFile() {
+#if NTEST_HAS_MMAP
+            if (mapped_)
+                ::munmap(const_cast<char*>(data_), size_);
+#endif
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        const std::string& path() const { return path_; }
+        std::string_view bytes() const { return {data_, size_}; }
+
+    private:
+        std::string path_;
+        const char* data_ = nullptr;
+        std::size_t size_ = 0;
+#if NTEST_HAS_MMAP
+        bool mapped_ = false;
+#else
+        std::string fallback_;
+#endif
+    };
+
+    // Record type for text split on `Delim`; the body sees each record as
+    // a std::string_view without the delimiter. A std::string_view record
+    // type means Lines.
+    template <char Delim>
+    struct Delimited {};
+    using Lines = Delimited<'\n'>;
+
+    struct DataOptions {
+        unsigned threads = 0;              // 0 = one per hardware thread
+        std::size_t min_chunk = 1u << 20;  // bytes per unit of work
+    };
+
+    namespace detail {
+        // Fixed-size records are viewed in place, so they must be
+        // trivially copyable (and the file's layout must match).
+        template <typename Record>
+        struct record_format {
+            static_assert(std::is_trivially_copyable_v<Record>,
+                          "fixed-size records must be trivially copyable");
+            using value_type = Record;
+            static constexpr bool fixed = true;
+        };
+        template <char Delim>
+        struct record_format<Delimited<Delim>> {
+            using value_type = std::string_view;
+            static constexpr bool fixed = false;
+            static constexpr char delimiter = Delim;
+        };
+        template <>
+        struct record_format<std::string_view> : record_format<Lines> {};
+
+        template <typename Record>
+        using record_t = typename record_format<Record>::value_type;
+
+        // Start offsets of `chunks` pieces of `bytes`, each beginning on a
+        // record boundary, plus bytes.size() at the end.
+        template <typename Record>
+        std::vector<std::size_t> record_chunks(std::string_view bytes,
+                                               std::size_t chunks) {
+            using Format = record_format<Record>;
+            std::vector<std::size_t> bounds{0};
+            for (std::size_t k = 1; k < chunks; ++k) {
+                std::size_t at = bytes.size() / chunks * k;
+                if constexpr (Format::fixed) {
+                    at -= at % sizeof(Record);
+                } else {
+                    // Just past the delimiter that ends the record
+                    // containing `at`.
+                    const auto end = bytes.find(Format::delimiter, at - 1);
+                    at = end == std::string_view::npos ? bytes.size()
+                                                       : end + 1;
+                }
+                bounds.push_back(std::max(at, bounds.back()));
+            }
+            bounds.push_back(bytes.size());
+            return bounds;
+        }
+
+        // What one unit of work saw. Records are identified by (ordinal
+        // within the chunk, byte offset); where[i] is the record that
+        // raised ctx.failures[i].
+        struct DataChunk {
+            using Position = std::pair<std::size_t, std::size_t>;
+            std::size_t records = 0;
+            Position current;
+            std::vector<Position> where;
+            TestContext ctx;
+            bool stopped = false;  // by a fatal failure, at `current`
+            std::string output;
+        };
+
+        inline void locate_failure(Failure& f, const std::string& where) {
+            f.msg = f.msg.empty() ? where : where + ": " + f.msg;
+        }
+    }  // namespace detail
+
+    // Calls body(record) for every record of `bytes` (see Delimited; any
+    // other Record is read as consecutive fixed-size values in place).
+    // Large inputs are split on record boundaries across opts.threads
+    // threads. Failures name the record's index and byte offset; a fatal
+    // one stops the check, and the report is the same as a sequential scan
+    // would give: the lowest failing record and the non-fatal failures
+    // before it, in order.
+    template <typename Record, typename Body>
+    void check_records(std::string_view bytes, Body&& body,
+                       const DataOptions& opts = {},
+                       const std::string& source = "") {
+        using Format = detail::record_format<Record>;
+        if constexpr (Format::fixed) {
+            if (bytes.size() % sizeof(Record) != 0) {
+                detail::abort_current(
+                    (source.empty() ? "data" : source) + ": " +
+                    std::to_string(bytes.size()) +
+                    " bytes is not a whole number of " +
+                    std::to_string(sizeof(Record)) + "-byte records");
+            }
+        }
+
+        unsigned threads = opts.threads != 0
+                               ? opts.threads
+                               : std::thread::hardware_concurrency();
+        threads = std::max(threads, 1u);
+        const std::size_t pieces = std::clamp<std::size_t>(
+            bytes.size() / std::max<std::size_t>(opts.min_chunk, 1), 1,
+            std::size_t{threads} * 4);
+        const std::vector<std::size_t> bounds =
+            detail::record_chunks<Record>(bytes, pieces);
+        std::vector<detail::DataChunk> chunks(pieces);
+
+        const std::size_t none = std::numeric_limits<std::size_t>::max();
+        std::atomic<std::size_t> next_chunk{0};
+        std::atomic<std::size_t> lowest{none};  // offset of a fatal failure
+
+        auto scan = [&](detail::DataChunk& chunk, std::size_t begin,
+                        std::size_t end) {
+            auto visit = [&](const auto& record, std::size_t at) {
+                chunk.current = {chunk.records, at};
+                body(record);
+                if (NTEST_UNLIKELY(chunk.where.size() !=
+                                   chunk.ctx.failures.size()))
+                    chunk.where.resize(chunk.ctx.failures.size(),
+                                       chunk.current);
+                ++chunk.records;
+            };
+            const char* data = bytes.data();
+            if constexpr (Format::fixed) {
+                for (std::size_t at = begin; at < end; at += sizeof(Record)) {
+                    if (at > lowest.load(std::memory_order_relaxed))
+                        return;
+                    visit(*reinterpret_cast<const Record*>(data + at), at);
+                }
+            } else {
+                for (std::size_t at = begin; at < end;) {
+                    if (at > lowest.load(std::memory_order_relaxed))
+                        return;
+                    const void* hit =
+                        std::memchr(data + at, Format::delimiter, end - at);
+                    const std::size_t stop =
+                        hit != nullptr
+                            ? static_cast<std::size_t>(
+                                  static_cast<const char*>(hit) - data)
+                            : end;
+                    visit(std::string_view(data + at, stop - at), at);
+                    at = stop + 1;
+                }
+            }
+        };
+
+        auto work = [&] {
+            for (;;) {
+                const std::size_t k = next_chunk.fetch_add(1);
+                if (k >= pieces || bounds[k] > lowest.load())
+                    return;
+                detail::DataChunk& chunk = chunks[k];
+                std::string* const outer = detail::capture_target();
+                detail::capture_target() = &chunk.output;
+                chunk.stopped = !detail::invoke_guarded(
+                    chunk.ctx, [&] { scan(chunk, bounds[k], bounds[k + 1]); });
+                detail::capture_target() = outer;
+                chunk.where.resize(chunk.ctx.failures.size(), chunk.current);
+                if (chunk.stopped) {
+                    const std::size_t at = chunk.current.second;
+                    std::size_t seen = lowest.load();
+                    while (at < seen &&
+                           !lowest.compare_exchange_weak(seen, at)) {
+                    }
+                }
+            }
+        };
+
+        threads = static_cast<unsigned>(
+            std::min<std::size_t>(threads, pieces));
+        detail::run_on_threads(threads, [&](unsigned) { work(); });
+
+        // Replay in file order up to the first fatal failure.
+        std::size_t base = 0;  // records before the current chunk
+        for (detail::DataChunk& chunk : chunks) {
+            if (std::string* out = detail::capture_target())
+                out->append(chunk.output);
+            else
+                std::cout << chunk.output;
+
+            auto where = [&](const detail::DataChunk::Position& position) {
+                const auto [ordinal, at] = position;
+                std::string text = "record " +
+                                   std::to_string(base + ordinal) +
+                                   " at offset " + std::to_string(at);
+                if (!source.empty())
+                    text += " of " + source;
+                return text;
+            };
+            const std::size_t expectations =
+                chunk.ctx.failures.size() -
+                (chunk.stopped && chunk.ctx.error.empty() ? 1 : 0);
+            for (std::size_t i = 0; i < expectations; ++i) {
+                Failure& f = chunk.ctx.failures[i];
+                detail::locate_failure(f, where(chunk.where[i]));
+                detail::expect_failed(f.expr, f.file, f.line, f.msg.c_str());
+            }
+            if (chunk.stopped) {
+                const std::string at = where(chunk.current);
+                if (!chunk.ctx.error.empty())
+                    detail::abort_current(at + ": " + chunk.ctx.error);
+                Failure& f = chunk.ctx.failures.back();
+                detail::locate_failure(f, at);
+                FAIL(f.expr, f.file, f.line, f.msg.c_str());
+            }
+            base += chunk.records;
+        }
+    }
+
+    // check_records over the contents of the file at `path`.
+    template <typename Record, typename Body>
+    void check_data(const std::string& path, Body&& body,
+                    const DataOptions& opts = {}) {
+        const MappedFile file(path);
+        check_records<Record>(file.bytes(), std::forward<Body>(body), opts,
+                              path);
+    }
+
+    // =========================
+    // Stress tests
+    // =========================
+
+    // Passed to a TEST_STRESS body on every call.
+    struct StressState {
+        unsigned thread = 0;          // 0 .. threads - 1
+        unsigned threads = 1;
+        std::uint64_t iteration = 0;  // of this thread
+    };
+
+    namespace detail {
+        // Log-linear latency histogram: 8 buckets per power of two, so a
+        // quantile is within ~12% of the true value, in constant memory.
+        class LatencyHistogram {
+        public:
+            void add(std::int64_t ns) {
+                ++counts_[bucket(ns)];
+                min_ = std::min(min_, ns);
+                max_ = std::max(max_, ns);
+                ++total_;
+            }
+
+            void merge(const LatencyHistogram& other) {
+                for (std::size_t i = 0; i < kBuckets; ++i)
+                    counts_[i] += other.counts_[i];
+                min_ = std::min(min_, other.min_);
+                max_ = std::max(max_, other.max_);
+                total_ += other.total_;
+            }
+
+            std::uint64_t total() const { return total_; }
+
+            std::int64_t quantile(double q) const {
+                if (total_ == 0)
+                    return 0;
+                const auto rank = static_cast<std::uint64_t>(
+                    q * static_cast<double>(total_ - 1));
+                std::uint64_t seen = 0;
+                for (std::size_t i = 0; i < kBuckets; ++i) {
+                    seen += counts_[i];
+                    if (seen > rank)
+                        return std::clamp(midpoint(i), min_, max_);
+                }
+                return max_;
+            }
+
+            StressStats stats() const {
+                StressStats s;
+                s.iterations = total_;
+                if (total_ > 0) {
+                    s.min = std::chrono::nanoseconds(min_);
+                    s.max = std::chrono::nanoseconds(max_);
+                }
+                s.p50 = std::chrono::nanoseconds(quantile(0.50));
+                s.p90 = std::chrono::nanoseconds(quantile(0.90));
+                s.p99 = std::chrono::nanoseconds(quantile(0.99));
+                return s;
+            }
+
+        private:
+            static constexpr std::size_t kSub = 8;
+            static constexpr std::size_t kBuckets = 64 * kSub;
+
+            static std::size_t bucket(std::int64_t ns) {
+                const auto v =
+                    static_cast<std::uint64_t>(std::max<std::int64_t>(ns, 0));
+                if (v < kSub)
+                    return static_cast<std::size_t>(v);
+                std::size_t exp = 63;
+                while ((v >> exp) == 0)
+                    --exp;
+                const std::size_t sub = static_cast<std::size_t>(
+                    (v >> (exp - 3)) & (kSub - 1));
+                return (exp - 2) * kSub + sub;
+            }
+
+            static std::int64_t midpoint(std::size_t i) {
+                if (i < kSub)
+                    return static_cast<std::int64_t>(i);
+                const std::size_t exp = i / kSub + 2;
+                const std::uint64_t width = std::uint64_t{1} << (exp - 3);
+                const std::uint64_t low =
+                    (std::uint64_t{1} << exp) + (i % kSub) * width;
+                return static_cast<std::int64_t>(low + width / 2);
+            }
+
+            std::uint64_t counts_[kBuckets] = {};
+            std::int64_t min_ = std::numeric_limits<std::int64_t>::max();
+            std::int64_t max_ = 0;
+            std::uint64_t total_ = 0;
+        };
+
+        // What one stress thread saw; where[i] is the iteration that
+        // raised ctx.failures[i].
+        struct StressWorker {
+            LatencyHistogram latency;
+            TestContext ctx;
+            std::vector<std::uint64_t> where;
+            std::uint64_t iteration = 0;  // current, or the one that stopped
+            bool stopped = false;         // by a fatal failure
+            std::string output;
+        };
+    }  // namespace detail
+
+    // Calls body(state) `iterations` times on each of `threads` threads,
+    // all released at once by a start barrier, and times every call. The
+    // first fatal failure on any thread stops them all and fails the test
+    // with its thread and iteration; other failures are reported as
+    // expectations, each with its own. The timing distribution ends up in
+    // the test's result (TestResult::stress).
+    template <typename Body>
+    void check_stress(unsigned threads, std::uint64_t iterations,
+                      Body&& body) {
+        threads = std::max(threads, 1u);
+        std::vector<detail::StressWorker> workers(threads);
+        std::atomic<unsigned> arrived{0};
+        std::atomic<bool> stop{false};
+        std::atomic<int> first{-1};  // thread that failed first
+        const auto start = std::chrono::steady_clock::now();
+
+        auto run = [&](unsigned t) {
+            detail::StressWorker& w = workers[t];
+            std::string* const outer = detail::capture_target();
+            detail::capture_target() = &w.output;
+            arrived.fetch_add(1);
+            while (arrived.load() < threads)
+                std::this_thread::yield();
+
+            StressState state;
+            state.thread = t;
+            state.threads = threads;
+            const bool completed = detail::invoke_guarded(w.ctx, [&] {
+                for (; w.iteration < iterations; ++w.iteration) {
+                    if (stop.load(std::memory_order_relaxed))
+                        return;
+                    state.iteration = w.iteration;
+                    const auto t0 = std::chrono::steady_clock::now();
+                    body(state);
+                    const auto t1 = std::chrono::steady_clock::now();
+                    w.latency.add((t1 - t0).count());
+                    if (NTEST_UNLIKELY(w.where.size() !=
+                                       w.ctx.failures.size()))
+                        w.where.resize(w.ctx.failures.size(), w.iteration);
+                }
+            });
+            detail::capture_target() = outer;
+            w.where.resize(w.ctx.failures.size(), w.iteration);
+            w.stopped = !completed;
+            if (w.stopped) {
+                int none = -1;
+                first.compare_exchange_strong(none, static_cast<int>(t));
+                stop.store(true);
+            }
+        };
+
+        detail::run_on_threads(threads, run);
+
+        detail::LatencyHistogram latency;
+        for (const auto& w : workers)
+            latency.merge(w.latency);
+        StressStats stats = latency.stats();
+        stats.threads = threads;
+        stats.wall = std::chrono::steady_clock::now() - start;
+        if (detail::TestContext* ctx = detail::current_context())
+            ctx->stress = stats;
+
+        for (auto& w : workers) {
+            if (std::string* out = detail::capture_target())
+                out->append(w.output);
+            else
+                std::cout << w.output;
+        }
+        auto where = [&](unsigned t, std::uint64_t iteration) {
+            return "thread " + std::to_string(t) + ", iteration " +
+                   std::to_string(iteration) + " of " +
+                   std::to_string(iterations);
+        };
+        const int winner = first.load();
+        std::string also;  // other threads stopped by exceptions
+        for (unsigned t = 0; t < threads; ++t) {
+            detail::StressWorker& w = workers[t];
+            std::size_t expectations = w.ctx.failures.size();
+            if (static_cast<int>(t) == winner && w.ctx.error.empty())
+                --expectations;  // the fatal one, raised below
+            for (std::size_t i = 0; i < expectations; ++i) {
+                Failure& f = w.ctx.failures[i];
+                detail::locate_failure(f, where(t, w.where[i]));
+                detail::expect_failed(f.expr, f.file, f.line, f.msg.c_str());
+            }
+            if (w.stopped && static_cast<int>(t) != winner &&
+                !w.ctx.error.empty())
+                also += "; also " + where(t, w.iteration) + ": " + w.ctx.error;
+        }
+        if (winner < 0)
+            return;
+        detail::StressWorker& w = workers[static_cast<unsigned>(winner)];
+        const std::string at =
+            where(static_cast<unsigned>(winner), w.iteration);
+        if (!w.ctx.error.empty())
+            detail::abort_current(at + ": " + w.ctx.error + also);
+        Failure& f = w.ctx.failures.back();
+        detail::locate_failure(f, at);
+        f.msg += also;
+        FAIL(f.expr, f.file, f.line, f.msg.c_str());
+    }
+
+    // =========================
+    // Worker threads
+    // =========================
+
+    // True once a fatal failure or exception on one of the current test's
+    // NTest::Threads, or an exception unwinding past a Thread on the test's
+    // own thread, asked the test's threads to stop. Long-running workers
+    // poll it to wind down early.
+    inline bool cancelled() {
+        const detail::TestContext* ctx = detail::current_context();
+        return ctx != nullptr && ctx->threads && ctx->threads->cancelled();
+    }
+
+    namespace detail {
+        // The first fatal failure or exception of a worker, if any.
+        struct ThreadFatal {
+            bool failed = false;
+            Failure failure;
+            std::string error;  // set if an exception ended the thread
+        };
+
+        // Runs on the test's own thread: moves what its workers reported
+        // into `ctx` and the test's output. Later fatal failures become
+        // expectations, and later exceptions are appended to the first.
+        inline ThreadFatal collect_threads(TestContext& ctx) {
+            ThreadFatal fatal;
+            if (!ctx.threads || ctx.thread != 0)
+                return fatal;
+            for (auto& e : ctx.threads->drain()) {
+                if (!e->output.empty()) {
+                    if (std::string* out = capture_target())
+                        out->append(e->output);
+                    else
+                        std::cout << e->output;
+                }
+                const std::string where = "thread " + std::to_string(e->thread);
+                if (e->has_failure)
+                    locate_failure(e->failure, where);
+                if (!e->error.empty())
+                    e->error = where + ": " + e->error;
+
+                const bool is_fatal = !e->error.empty() ||
+                                      (e->has_failure && e->failure.fatal);
+                if (is_fatal && !fatal.failed) {
+                    fatal.failed = true;
+                    fatal.failure = std::move(e->failure);
+                    fatal.error = std::move(e->error);
+                } else if (!e->error.empty()) {
+                    std::string& first = fatal.error.empty()
+                                             ? fatal.failure.msg
+                                             : fatal.error;
+                    first += "; also " + e->error;
+                } else if (e->has_failure) {
+                    e->failure.fatal = false;
+                    ctx.failures.push_back(std::move(e->failure));
+                }
+            }
+            return fatal;
+        }
+
+        // Body of an NTest::Thread: runs fn() under a context of its own
+        // that reports to the owning test.
+        template <typename Fn>
+        void run_worker(const std::shared_ptr<ThreadFailures>& owner,
+                        unsigned id, Fn&& fn) {
+            if (!owner) {  // started outside of a test
+                fn();
+                return;
+            }
+            TestContext ctx;
+            ctx.threads = owner;
+            ctx.thread = id;
+            std::string output;
+            capture_target() = &output;
+            const bool completed = invoke_guarded(ctx, fn);
+            capture_target() = nullptr;
+
+            auto entry = std::make_unique<ThreadFailures::Entry>();
+            entry->thread = id;
+            entry->output = std::move(output);
+            if (!completed) {
+                owner->cancel();
+                if (!ctx.error.empty()) {
+                    entry->error = std::move(ctx.error);
+                } else {
+                    entry->has_failure = true;
+                    entry->failure = std::move(ctx.failures.back());
+                }
+            }
+            if (!entry->output.empty() || !completed)
+                owner->push(std::move(entry));
+        }
+    }  // namespace detail
+
+    // std::thread for use inside a test. Assertions on the new thread are
+    // attributed to the test that started it, and so is its std::cout
+    // output, kept together per thread. A fatal failure or exception ends
+    // only the thread and sets cancelled(); the next join() on the test's
+    // own thread then fails the test with it. Destruction joins, after
+    // cancelling if the test is being unwound by a failure of its own.
+    // Without exceptions a failed REQUIRE skips destructors, so join
+    // explicitly before any assertion that may fail.
+    class Thread {
+    public:
+        Thread() = default;
+
+        template <typename Fn, typename... Args>
+        explicit Thread(Fn&& fn, Args&&... args) {
+            if (detail::TestContext* ctx = detail::current_context()) {
+                if (!ctx->threads)
+                    ctx->threads = std::make_shared<detail::ThreadFailures>();
+                owner_ = ctx->threads;
+                id_ = owner_->next_thread();
+            }
+            thread_ = detail::start_thread(
+                [owner = owner_, id = id_, fn = std::forward<Fn>(fn),
+                 args = std::make_tuple(
+                     std::forward<Args>(args)...)]() mutable {
+                    detail::run_worker(
+                        owner, id, [&] { std::apply(fn, std::move(args)); });
+                });
+        }
+
+        Thread(Thread&&) noexcept = default;
+        Thread& operator=(Thread&& other) noexcept {
+            if (this != &other) {
+                finish();
+                thread_ = std::move(other.thread_);
+                owner_ = std::move(other.owner_);
+                id_ = other.id_;
+                unwinding_ = other.unwinding_;
+            }
+            return *this;
+        }
+        ~Thread() { finish(); }
+
+        // Waits for the thread, then fails the calling test if any of its
+        // threads failed fatally.
+        void join() {
+            thread_.join();
+            detail::TestContext* ctx = detail::current_context();
+            if (ctx == nullptr || ctx->threads != owner_)
+                return;
+            detail::ThreadFatal fatal = detail::collect_threads(*ctx);
+            if (!fatal.failed)
+                return;
+            if (!fatal.error.empty())
+                detail::abort_current(fatal.error);
+            FAIL(fatal.failure.expr, fatal.failure.file, fatal.failure.line,
+                 fatal.failure.msg.c_str());
+        }
+
+        bool joinable() const { return thread_.joinable(); }
+        std::thread::id get_id() const { return thread_.get_id(); }
+        unsigned number() const { return id_; }  // as in "thread N"
+
+    private:
+        void finish() {
+            if (!thread_.joinable())
+                return;
+            if (owner_ && std::uncaught_exceptions() > unwinding_)
+                owner_->cancel();
+            thread_.join();
+        }
+
+        std::thread thread_;
+        std::shared_ptr<detail::ThreadFailures> owner_;
+        unsigned id_ = 0;
+        int unwinding_ = std::uncaught_exceptions();
+    };
+
+    // =========================
+    // Output
+    // =========================
+
+    // Destination for everything the runner prints. write() may be called
+    // from several threads.
+    class OutputSink {
+    public:
+        virtual ~OutputSink() = default;
+        virtual void write(std::string_view text) = 0;
+        virtual void flush() = 0;
+    };
+
+    // Collects writes and hands them to `target` in large batches: when
+    // `capacity` bytes are pending, when `max_delay` has passed since the
+    // last batch, and on flush().
+    class BufferedSink : public OutputSink {
+    public:
+        explicit BufferedSink(
+            std::streambuf* target, std::size_t capacity = 64 * 1024,
+            std::chrono::milliseconds max_delay = std::chrono::milliseconds(
+                100))
+            : target_(target),
+              capacity_(capacity),
+              max_delay_(max_delay),
+              last_flush_(std::chrono::steady_clock::now()) {
+            buffer_.reserve(capacity);
+        }
+        ~BufferedSink() override { flush(); }
+        BufferedSink(const BufferedSink&) = delete;
+        BufferedSink& operator=(const BufferedSink&) = delete;
+
+        void write(std::string_view text) override {
+            std::lock_guard<std::mutex> lock(mutex_);
+            buffer_.append(text);
+            if (buffer_.size() >= capacity_ ||
+                std::chrono::steady_clock::now() - last_flush_ >= max_delay_)
+                flush_locked();
+        }
+
+        void flush() override {
+            std::lock_guard<std::mutex> lock(mutex_);
+            flush_locked();
+        }
+
+    private:
+        void flush_locked() {
+            if (!buffer_.empty()) {
+                target_->sputn(buffer_.data(),
+                               static_cast<std::streamsize>(buffer_.size()));
+                buffer_.clear();
+            }
+            target_->pubsync();
+            last_flush_ = std::chrono::steady_clock::now();
+        }
+
+        std::streambuf* target_;
+        std::size_t capacity_;
+        std::chrono::milliseconds max_delay_;
+        std::chrono::steady_clock::time_point last_flush_;
+        std::string buffer_;
+        std::mutex mutex_;
+    };
+
+    // =========================
+    // Test selection
+    // =========================
+
+    namespace detail {
+        // Shell-style match of `text` against `pattern` with `*` and `?`.
+        // Linear in practice: only the most recent `*` is backtracked.
+        inline bool glob_match(std::string_view pattern,
+                               std::string_view text) {
+            std::size_t p = 0;
+            std::size_t t = 0;
+            std::size_t star = std::string_view::npos;
+            std::size_t resume = 0;
+            while (t < text.size()) {
+                if (p < pattern.size() &&
+                    (pattern[p] == '?' || pattern[p] == text[t])) {
+                    ++p;
+                    ++t;
+                } else if (p < pattern.size() && pattern[p] == '*') {
+                    star = p++;
+                    resume = t;
+                } else if (star != std::string_view::npos) {
+                    p = star + 1;
+                    t = ++resume;
+                } else {
+                    return false;
+                }
+            }
+            while (p < pattern.size() && pattern[p] == '*')
+                ++p;
+            return p == pattern.size();
+        }
+
+        // True if `tags` ("[a][b]") contains the tag `tag` ("[a]").
+        inline bool has_tag(std::string_view tags, std::string_view tag) {
+            return tags.find(tag) != std::string_view::npos;
+        }
+    }  // namespace detail
+
+    // Selects tests by name and tag. Patterns are parsed once, when added:
+    //   Parser*        glob on the test name (`*` and `?`)
+    //   [io][fast]     tests carrying every listed tag
+    //   ~pattern       excludes whatever `pattern` matches
+    // A test runs if it matches any inclusive pattern (or there are none)
+    // and no exclusive one. add_regex() adds ECMAScript regexes that are
+    // searched in the name, with the same `~` prefix.
+    class TestFilter {
+    public:
+        void add(std::string_view pattern) {
+            Term term;
+            term.exclude = consume_negation(pattern);
+            if (!pattern.empty() && pattern.front() == '[') {
+                term.kind = Term::Kind::Tags;
+                while (!pattern.empty()) {
+                    const auto close = pattern.find(']');
+                    if (pattern.front() != '[' ||
+                        close == std::string_view::npos)
+                        detail::raise(std::invalid_argument(
+                            "malformed tag pattern: " + std::string(pattern)));
+                    term.tags.emplace_back(pattern.substr(0, close + 1));
+                    pattern.remove_prefix(close + 1);
+                }
+            } else {
+                term.kind = Term::Kind::Glob;
+                term.text = pattern;
+            }
+            push(std::move(term));
+        }
+
+        void add_regex(std::string_view pattern) {
+            Term term;
+            term.exclude = consume_negation(pattern);
+            term.kind = Term::Kind::Regex;
+            term.text = pattern;
+#if NTEST_EXCEPTIONS
+            try {
+                term.regex.assign(term.text, std::regex::ECMAScript |
+                                                 std::regex::optimize);
+            } catch (const std::regex_error& e) {
+                detail::raise(std::invalid_argument(
+                    "invalid regex " + term.text + ": " + e.what()));
+            }
+#else
+            term.regex.assign(term.text,
+                              std::regex::ECMAScript | std::regex::optimize);
+#endif
+            push(std::move(term));
+        }
+
+        bool empty() const { return terms_.empty(); }
+
+        bool matches(const TestCase& test) const {
+            bool included = !has_includes_;
+            for (const Term& term : terms_) {
+                if (included && !term.exclude)
+                    continue;  // already in; only exclusions matter now
+                if (term.matches(test)) {
+                    if (term.exclude)
+                        return false;
+                    included = true;
+                }
+            }
+            return included;
+        }
+
+    private:
+        struct Term {
+            enum class Kind { Glob, Tags, Regex };
+
+            Kind kind = Kind::Glob;
+            bool exclude = false;
+            std::string text;
+            std::vector<std::string> tags;
+            std::regex regex;
+
+            bool matches(const TestCase& test) const {
+                switch (kind) {
+                    case Kind::Glob:
+                        return detail::glob_match(text, test.name);
+                    case Kind::Tags:
+                        for (const std::string& tag : tags) {
+                            if (!detail::has_tag(test.tags, tag))
+                                return false;
+                        }
+                        return true;
+                    case Kind::Regex:
+                        return std::regex_search(test.name, regex);
+                }
+                return false;
+            }
+        };
+
+        static bool consume_negation(std::string_view& pattern) {
+            if (pattern.empty() || pattern.front() != '~')
+                return false;
+            pattern.remove_prefix(1);
+            return true;
+        }
+
+        void push(Term term) {
+            has_includes_ |= !term.exclude;
+            terms_.push_back(std::move(term));
+        }
+
+        std::vector<Term> terms_;
+        bool has_includes_ = false;
+    };
+
+    // What earlier runs learned about a test.
+    struct CachedResult {
+        bool passed = true;                // outcome of the latest run
+        std::chrono::nanoseconds wall{0};  // smoothed duration, 0 = unknown
+    };
+
+    // Outcome and duration history of each test, by name.
+    using ResultCache = std::map<std::string, CachedResult>;
+
+    // Format: a "ntest-cache 2" header, then one "pass|fail WALL_NS NAME"
+    // line per test. The cache is advisory, so a missing, outdated or
+    // malformed file reads as empty.
+    inline ResultCache read_result_cache(std::istream& in) {
+        ResultCache cache;
+        std::string line;
+        if (!std::getline(in, line) || line != "ntest-cache 2")
+            return cache;
+        while (std::getline(in, line)) {
+            std::istringstream fields(line);
+            std::string outcome;
+            long long wall = 0;
+            std::string name;
+            if (!(fields >> outcome >> wall >> name) ||
+                (outcome != "pass" && outcome != "fail") || wall < 0)
+                continue;
+            cache[name] = CachedResult{outcome == "pass",
+                                       std::chrono::nanoseconds(wall)};
+        }
+        return cache;
+    }
+
+    inline void write_result_cache(std::ostream& out,
+                                   const ResultCache& cache) {
+        out << "ntest-cache 2\n";
+        for (const auto& [name, entry] : cache) {
+            out << (entry.passed ? "pass " : "fail ") << entry.wall.count()
+                << " " << name << "\n";
+        }
+    }
+
+    // =========================
+    // Runner
+    // =========================
+
+    class Reporter;
+
+    enum class Verbosity {
+        Normal,        // every test
+        FailuresOnly,  // failing tests and the summary
+        Quiet          // failing tests and the one-line count only
+    };
+
+    struct RunOptions {
+        // Number of worker threads. 1 runs every test on the calling thread,
+        // 0 uses std::thread::hardware_concurrency().
+        unsigned jobs = 1;
+
+        // Run every test inside a forked worker process so that crashes,
+        // signals and calls to exit() only fail the offending test. Ignored
+        // (with a warning) on platforms without fork().
+        bool isolate = false;
+
+        // Only tests (and benchmarks) matching the filter are run.
+        TestFilter filter;
+
+        // Print the selected tests instead of running them.
+        bool list = false;
+
+        // Deterministic split of the test list for distributing one binary
+        // across several CI runners: test i runs in shard i % shard_count
+        // after filtering.
+        unsigned shard_index = 0;
+        unsigned shard_count = 1;
+
+        // Split shards by the durations in `cache_file` instead, so each
+        // gets a similar amount of work. Every shard must see the same
+        // cache file, or tests may be run twice or not at all.
+        bool balance_shards = false;
+
+        // Case count, seed and threads for PROPERTY tests.
+        PropertyOptions property;
+
+        // Run the selected tests this many rounds; 0 keeps going until
+        // the process is stopped or, with until_fail, a round fails. The
+        // summary counts every run; the cache keeps each test's last
+        // failure, or else its last result.
+        std::size_t repeat = 1;
+        bool until_fail = false;
+
+        // BENCHMARK entries are skipped unless enabled. They run after the
+        // tests, one at a time on the calling thread.
+        bool benchmarks = false;
+        BenchmarkOptions benchmark;
+
+        // Per-test limit for tests without their own TEST_TIMEOUT, and a
+        // limit for the whole run; 0 disables. A test that overruns fails
+        // as a timeout. In-process the run cannot continue past a hung
+        // test, so it is reported and the process exits with a failure;
+        // with `isolate` the worker is killed and the run carries on.
+        std::chrono::milliseconds test_timeout{0};
+        std::chrono::milliseconds run_timeout{0};
+
+        // Count cycles, instructions, cache and branch misses, context
+        // switches, task-clock and page faults around every test body and
+        // benchmark loop (Linux perf_event_open; software events only
+        // where the hardware ones are not available).
+        bool perf = false;
+
+        // Sample test bodies on SIGPROF and write folded stacks; see
+        // ProfileOptions.
+        ProfileOptions profile;
+
+        // Print the N slowest tests after the run; 0 disables.
+        unsigned slowest = 0;
+
+        // Below Normal, passing tests are not formatted at all and their
+        // captured output is dropped.
+        Verbosity verbosity = Verbosity::Normal;
+
+        // Where the report goes; nullptr batches it to std::cout.
+        OutputSink* sink = nullptr;
+
+        // Receivers of the run's events, all fed at once. Empty means a
+        // ConsoleReporter on `sink` with `verbosity` and `slowest`.
+        std::vector<std::shared_ptr<Reporter>> reporters;
+
+        // Outcomes and durations are merged into this ResultCache file
+        // after each run; empty disables it. With it, parallel runs start
+        // the longest tests first, and previously failing tests can run
+        // first, or alone. If none failed, only_failed runs everything.
+        std::string cache_file;
+        bool failed_first = false;
+        bool only_failed = false;
+    };
+
+    struct TestResult {
+        enum class Status {
+            Passed,
+            Failed,
+            ExpectedFail,
+            UnexpectedPass,
+            TimedOut
+        };
+
+        const TestCase* test = nullptr;
+        Status status = Status::Passed;
+        std::string message;  // non-assertion failure reason
+        std::string output;   // captured output (parallel runs only)
+        std::vector<Failure> failures;  // recorded assertions, unformatted
+        std::chrono::nanoseconds wall{0};
+        std::chrono::nanoseconds cpu{0};  // CPU time of the test's thread
+        AllocationStats allocs;  // test's thread; needs allocation tracking
+        std::optional<StressStats> stress;  // TEST_STRESS timing
+        std::optional<PerfStats> perf;      // with RunOptions::perf
+        std::string profile;  // folded-stack file written by --profile
+
+        bool ok() const {
+            return status == Status::Passed || status == Status::ExpectedFail;
+        }
+
+        // Why the test stopped, formatted on demand.
+        std::string reason() const {
+            if (!message.empty())
+                return message;
+            for (const Failure& f : failures) {
+                if (f.fatal)
+                    return format_failure(f);
+            }
+            return {};
+        }
+    };
+
+    namespace detail {
+
+        // Stream buffer installed on std::cout during parallel runs so that
+        // output of concurrently running tests does not interleave.
+        class RoutingBuf : public std::streambuf {
+        public:
+            explicit RoutingBuf(std::streambuf* fallback)
+                : fallback_(fallback) {}
+
+        protected:
+            int_type overflow(int_type ch) override {
+                if (traits_type::eq_int_type(ch, traits_type::eof()))
+                    return traits_type::not_eof(ch);
+                if (std::string* target = capture_target()) {
+                    target->push_back(traits_type::to_char_type(ch));
+                    return ch;
+                }
+                std::lock_guard<std::mutex> lock(mutex_);
+                return fallback_->sputc(traits_type::to_char_type(ch));
+            }
+
+            std::streamsize xsputn(const char* s, std::streamsize n) override {
+                if (std::string* target = capture_target()) {
+                    target->append(s, static_cast<std::size_t>(n));
+                    return n;
+                }
+                std::lock_guard<std::mutex> lock(mutex_);
+                return fallback_->sputn(s, n);
+            }
+
+            int sync() override {
+                if (capture_target() != nullptr)
+                    return 0;
+                std::lock_guard<std::mutex> lock(mutex_);
+                return fallback_->pubsync();
+            }
+
+        private:
+            std::streambuf* fallback_;
+            std::mutex mutex_;
+        };
+
+        // Installs a RoutingBuf on std::cout for the lifetime of the guard.
+        class CoutRouting {
+        public:
+            CoutRouting()
+                : original_(std::cout.rdbuf()), routing_(original_) {
+                std::cout.flush();
+                std::cout.rdbuf(&routing_);
+            }
+            ~CoutRouting() {
+                std::cout.flush();
+                std::cout.rdbuf(original_);
+            }
+            CoutRouting(const CoutRouting&) = delete;
+            CoutRouting& operator=(const CoutRouting&) = delete;
+
+            std::streambuf* terminal() const { return original_; }
+
+        private:
+            std::streambuf* original_;
+            RoutingBuf routing_;
+        };
+
+        // Releases finished slots strictly in slot order, holding back any
+        // slot that finishes before its predecessors.
+        class OrderedOutput {
+        public:
+            using Release = std::function<void(std::size_t)>;
+
+            OrderedOutput(std::size_t slots, Release release)
+                : ready_(slots, false), release_(std::move(release)) {}
+
+            void publish(std::size_t slot) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ready_[slot] = true;
+                while (next_ < ready_.size() && ready_[next_])
+                    release_(next_++);
+            }
+
+            // Starts over for another pass over the same slots.
+            void reset() {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ready_.assign(ready_.size(), false);
+                next_ = 0;
+            }
+
+            // Releases whatever is held back regardless of order. Used when
+            // the run is aborted while earlier slots are still pending.
+            void drain() {
+                std::lock_guard<std::mutex> lock(mutex_);
+                for (; next_ < ready_.size(); ++next_) {
+                    if (ready_[next_])
+                        release_(next_);
+                }
+            }
+
+        private:
+            std::vector<bool> ready_;
+            Release release_;
+            std::size_t next_ = 0;
+            std::mutex mutex_;
+        };
+
+        inline std::chrono::nanoseconds thread_cpu_time() {
+#if defined(_WIN32)
+            FILETIME creation, exit, kernel, user;
+            if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel,
+                                &user))
+                return std::chrono::nanoseconds{0};
+            auto ticks = [](const FILETIME& ft) {
+                return (static_cast<std::uint64_t>(ft.dwHighDateTime) << 32) |
+                       ft.dwLowDateTime;
+            };
+            return std::chrono::nanoseconds{(ticks(kernel) + ticks(user)) *
+                                            100};  // 100 ns units
+#elif defined(CLOCK_THREAD_CPUTIME_ID)
+            timespec ts{};
+            ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+            return std::chrono::seconds{ts.tv_sec} +
+                   std::chrono::nanoseconds{ts.tv_nsec};
+#else
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::duration<double>(static_cast<double>(
+                                                  std::clock()) /
+                                              CLOCKS_PER_SEC));
+#endif
+        }
+
+        inline std::chrono::milliseconds effective_timeout(
+            const TestCase& test, std::chrono::milliseconds fallback) {
+            return test.timeout.count() > 0 ? test.timeout : fallback;
+        }
+
+        inline std::string format_ms(std::chrono::milliseconds ms) {
+            return std::to_string(ms.count()) + " ms";
+        }
+
+        // Runs a group of tests together on the calling thread, e.g. the
+        // ASYNC_TEST coroutines of NTestAsync.h on one event loop. Tests
+        // name their batch in TestCase::batch; func still runs one of them
+        // alone, which is what --isolate and run_test() do. run() enforces
+        // per-test timeouts itself and reports through the callbacks, each
+        // test's started(i) before its done(i, result).
+        class TestBatch {
+        public:
+            using Started = std::function<void(std::size_t)>;
+            using Done = std::function<void(std::size_t, TestResult)>;
+
+            virtual ~TestBatch() = default;
+            virtual void run(const std::vector<const TestCase*>& tests,
+                             std::chrono::milliseconds default_timeout,
+                             const Started& started, const Done& done) = 0;
+        };
+
+        // Reports why the run is being abandoned and exits without
+        // unwinding: a hung test thread cannot be joined.
+        [[noreturn]] inline void abort_run(const std::string& report) {
+            std::cout << report
+                      << NTEST_COLOR(bold)(NTEST_COLOR(red)(
+                             "\nRun aborted after timeout.\n"))
+                      << std::flush;
+            std::_Exit(EXIT_FAILURE);
+        }
+
+        // Watches in-process tests and the run as a whole. When a deadline
+        // passes, the overdue tests are reported and the process exits
+        // through abort_run(); `before_abort` is called first so callers
+        // can release buffered output.
+        class Watchdog {
+        public:
+            using clock = std::chrono::steady_clock;
+
+            Watchdog(std::chrono::milliseconds run_timeout,
+                     std::function<void()> before_abort)
+                : before_abort_(std::move(before_abort)) {
+                if (run_timeout.count() > 0)
+                    run_deadline_ = clock::now() + run_timeout;
+                thread_ = std::thread([this] { loop(); });
+            }
+
+            ~Watchdog() {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    stop_ = true;
+                }
+                cv_.notify_all();
+                thread_.join();
+            }
+
+            Watchdog(const Watchdog&) = delete;
+            Watchdog& operator=(const Watchdog&) = delete;
+
+            void begin(std::size_t slot, const TestCase& test,
+                       std::chrono::milliseconds timeout) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                Entry entry{&test, timeout, std::nullopt};
+                if (timeout.count() > 0)
+                    entry.deadline = clock::now() + timeout;
+                running_[slot] = entry;
+                cv_.notify_all();
+            }
+
+            void end(std::size_t slot) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                running_.erase(slot);
+            }
+
+        private:
+            struct Entry {
+                const TestCase* test;
+                std::chrono::milliseconds timeout;
+                std::optional<clock::time_point> deadline;
+            };
+
+            void loop() {
+                std::unique_lock<std::mutex> lock(mutex_);
+                while (!stop_) {
+                    std::optional<clock::time_point> wake = run_deadline_;
+                    for (const auto& kv : running_) {
+                        const auto& d = kv.second.deadline;
+                        if (d && (!wake || *d < *wake))
+                            wake = d;
+                    }
+                    if (!wake) {
+                        cv_.wait(lock);
+                        continue;
+                    }
+                    cv_.wait_until(lock, *wake);
+                    if (stop_)
+                        return;
+
+                    const auto now = clock::now();
+                    std::string report;
+                    for (const auto& kv : running_) {
+                        const Entry& e = kv.second;
+                        if (e.deadline && *e.deadline <= now) {
+                            report += NTEST_COLOR(red)(
+                                          std::string("[TIMEOUT] ") +
+                                          e.test->name) +
+                                      " - exceeded " + format_ms(e.timeout) +
+                                      "\n";
+                        }
+                    }
+                    if (run_deadline_ && *run_deadline_ <= now)
+                        report += NTEST_COLOR(red)("[TIMEOUT] run") +
+                                  " - exceeded the run timeout\n";
+                    if (report.empty())
+                        continue;
+
+                    for (const auto& kv : running_) {
+                        const Entry& e = kv.second;
+                        if (!e.deadline || *e.deadline > now)
+                            report += std::string("    still running: ") +
+                                      e.test->name + "\n";
+                    }
+                    if (before_abort_)
+                        before_abort_();
+                    abort_run(report);
+                }
+            }
+
+            std::function<void()> before_abort_;
+            std::optional<clock::time_point> run_deadline_;
+            std::map<std::size_t, Entry> running_;
+            std::mutex mutex_;
+            std::condition_variable cv_;
+            bool stop_ = false;
+            std::thread thread_;
+        };
+
+        class WorkQueue {
+        public:
+            void push(std::size_t item) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                items_.push_back(item);
+            }
+
+            // Owner takes from the front to keep registration order locally.
+            bool pop(std::size_t& item) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (items_.empty())
+                    return false;
+                item = items_.front();
+                items_.pop_front();
+                return true;
+            }
+
+            // Thieves take from the back, away from the owner.
+            bool steal(std::size_t& item) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (items_.empty())
+                    return false;
+                item = items_.back();
+                items_.pop_back();
+                return true;
+            }
+
+        private:
+            std::deque<std::size_t> items_;
+            std::mutex mutex_;
+        };
+
+        // Calls fn(item) exactly once for every entry of `items` using
+        // `workers` threads. Items are dealt round-robin onto per-worker
+        // queues; idle workers steal from the back of their neighbours.
+        template <typename Fn>
+        void run_work_stealing(const std::vector<std::size_t>& items,
+                               unsigned workers, Fn&& fn) {
+            if (workers <= 1 || items.size() <= 1) {
+                for (std::size_t item : items)
+                    fn(item);
+                return;
+            }
+            if (workers > items.size())
+                workers = static_cast<unsigned>(items.size());
+
+            std::vector<WorkQueue> queues(workers);
+            for (std::size_t i = 0; i < items.size(); ++i)
+                queues[i % workers].push(items[i]);
+
+            auto worker = [&](unsigned self) {
+                std::size_t item = 0;
+                for (;;) {
+                    bool found = queues[self].pop(item);
+                    for (unsigned k = 1; !found && k < workers; ++k)
+                        found = queues[(self + k) % workers].steal(item);
+                    if (!found)
+                        return;  // nothing is ever re-queued, so we are done
+                    fn(item);
+                }
+            };
+
+            std::vector<std::thread> threads;
+            threads.reserve(workers - 1);
+            for (unsigned w = 1; w < workers; ++w)
+                threads.emplace_back(worker, w);
+            worker(0);
+            for (auto& t : threads)
+                t.join();
+        }
+
+        [[noreturn]] inline void invalid_value(const std::string& what,
+                                               const std::string& value) {
+            raise(std::invalid_argument("invalid value for " + what + ": '" +
+                                        value + "'"));
+        }
+
+        inline unsigned parse_unsigned(const std::string& what,
+                                       const std::string& value) {
+            if (value.empty() || value[0] < '0' || value[0] > '9')
+                invalid_value(what, value);
+            char* end = nullptr;
+            errno = 0;
+            const unsigned long n = std::strtoul(value.c_str(), &end, 10);
+            if (errno != 0 || *end != '\0' ||
+                n > std::numeric_limits<unsigned>::max())
+                invalid_value(what, value);
+            return static_cast<unsigned>(n);
+        }
+
+        inline std::uint64_t parse_u64(const std::string& what,
+                                       const std::string& value) {
+            if (value.empty() || value[0] < '0' || value[0] > '9')
+                invalid_value(what, value);
+            char* end = nullptr;
+            errno = 0;
+            const unsigned long long n =
+                std::strtoull(value.c_str(), &end, 10);
+            if (errno != 0 || *end != '\0')
+                invalid_value(what, value);
+            return static_cast<std::uint64_t>(n);
+        }
+
+        // Subset of `tests` belonging to the configured shard, in order.
+        inline std::vector<TestCase*> select_shard(
+            const std::vector<TestCase*>& tests, const RunOptions& opts) {
+            if (opts.shard_count == 0 || opts.shard_index >= opts.shard_count)
+                raise(std::invalid_argument(
+                    "shard index " + std::to_string(opts.shard_index) +
+                    " out of range for shard count " +
+                    std::to_string(opts.shard_count)));
+            std::vector<TestCase*> selected;
+            for (std::size_t i = 0; i < tests.size(); ++i) {
+                if (i % opts.shard_count == opts.shard_index)
+                    selected.push_back(tests[i]);
+            }
+            return selected;
+        }
+
+        inline unsigned resolve_jobs(unsigned jobs) {
+            if (jobs == 0) {
+                jobs = std::thread::hardware_concurrency();
+                if (jobs == 0)
+                    jobs = 1;
+            }
+            return jobs;
+        }
+
+        // Expected duration of `test` from the cache, or nullopt if unknown.
+        inline std::optional<std::chrono::nanoseconds> expected_cost(
+            const ResultCache& cache, const TestCase& test) {
+            const auto it = cache.find(test.name);
+            if (it == cache.end() || it->second.wall.count() <= 0)
+                return std::nullopt;
+            return it->second.wall;
+        }
+
+        // Cost-balanced variant of select_shard(): greedy LPT over shards,
+        // taking tests by decreasing expected cost and giving each to the
+        // least loaded shard. Unknown tests cost the mean of known ones.
+        // Ties break on position, so every shard computes the same split
+        // from the same cache. Without any history this is select_shard().
+        inline std::vector<TestCase*> select_balanced_shard(
+            const std::vector<TestCase*>& tests, const RunOptions& opts,
+            const ResultCache& cache) {
+            std::vector<std::int64_t> cost(tests.size(), 0);
+            std::int64_t known_total = 0;
+            std::int64_t known = 0;
+            for (std::size_t i = 0; i < tests.size(); ++i) {
+                if (const auto c = expected_cost(cache, *tests[i])) {
+                    cost[i] = c->count();
+                    known_total += cost[i];
+                    ++known;
+                }
+            }
+            if (known == 0 || opts.shard_count <= 1)
+                return select_shard(tests, opts);
+            for (auto& c : cost) {
+                if (c == 0)
+                    c = known_total / known;
+            }
+
+            std::vector<std::size_t> order(tests.size());
+            for (std::size_t i = 0; i < order.size(); ++i)
+                order[i] = i;
+            std::stable_sort(order.begin(), order.end(),
+                             [&](std::size_t a, std::size_t b) {
+                                 return cost[a] > cost[b];
+                             });
+            std::vector<std::int64_t> load(opts.shard_count, 0);
+            std::vector<bool> mine(tests.size(), false);
+            for (std::size_t i : order) {
+                const auto lightest = static_cast<unsigned>(
+                    std::min_element(load.begin(), load.end()) -
+                    load.begin());
+                load[lightest] += cost[i];
+                mine[i] = lightest == opts.shard_index;
+            }
+            std::vector<TestCase*> selected;
+            for (std::size_t i = 0; i < tests.size(); ++i) {
+                if (mine[i])
+                    selected.push_back(tests[i]);
+            }
+            return selected;
+        }
+
+        // Longest-processing-time-first order for a pool of workers: the
+        // `slots` of `tests` are sorted by decreasing expected cost,
+        // unknown ones first since they may be long. Only the start order
+        // changes; results are still published by slot.
+        inline void order_by_cost(std::vector<std::size_t>& slots,
+                                  const std::vector<TestCase*>& tests,
+                                  const ResultCache& cache) {
+            const auto unknown = std::chrono::nanoseconds::max();
+            std::stable_sort(
+                slots.begin(), slots.end(), [&](std::size_t a, std::size_t b) {
+                    return expected_cost(cache, *tests[a]).value_or(unknown) >
+                           expected_cost(cache, *tests[b]).value_or(unknown);
+                });
+        }
+
+        // Applies the filter, the shard and the result cache, in that order.
+        // With a cache, earlier failures go first if asked. Sets `note` when
+        // the cache changes nothing the user asked for, and `history` to
+        // the cache read, if given.
+        inline std::vector<TestCase*> select_tests(
+            const std::vector<TestCase*>& all_tests, const RunOptions& opts,
+            std::string& note, ResultCache* history = nullptr) {
+            std::vector<TestCase*> matching;
+            for (TestCase* test : all_tests) {
+                if (opts.filter.matches(*test))
+                    matching.push_back(test);
+            }
+
+            ResultCache cache;
+            if (!opts.cache_file.empty()) {
+                std::ifstream in(opts.cache_file);
+                cache = read_result_cache(in);
+            }
+            std::vector<TestCase*> selected =
+                opts.balance_shards
+                    ? select_balanced_shard(matching, opts, cache)
+                    : select_shard(matching, opts);
+
+            if (opts.failed_first || opts.only_failed) {
+                auto failed_before = [&](const TestCase* test) {
+                    const auto it = cache.find(test->name);
+                    return it != cache.end() && !it->second.passed;
+                };
+                const auto split = std::stable_partition(
+                    selected.begin(), selected.end(), failed_before);
+                if (split == selected.begin()) {
+                    note = "no failures recorded in " + opts.cache_file +
+                           "; running all selected tests";
+                } else if (opts.only_failed) {
+                    selected.erase(split, selected.end());
+                }
+            }
+            if (history != nullptr)
+                *history = std::move(cache);
+            return selected;
+        }
+
+        // Holds one cache file for a read-merge-write cycle: a mutex for
+        // the threads of this process and, where fcntl() locks exist, a
+        // lock on FILE.lock for other processes, such as concurrent shards.
+        class CacheLock {
+        public:
+            explicit CacheLock(const std::string& path) : guard_(mutex()) {
+#if NTEST_HAS_FORK
+                fd_ = open((path + ".lock").c_str(),
+                           O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+                if (fd_ >= 0) {
+                    struct flock lock {};
+                    lock.l_type = F_WRLCK;
+                    lock.l_whence = SEEK_SET;
+                    while (fcntl(fd_, F_SETLKW, &lock) != 0 && errno == EINTR) {
+                    }
+                }
+#endif
+            }
+            ~CacheLock() {
+#if NTEST_HAS_FORK
+                if (fd_ >= 0)
+                    close(fd_);  // drops the lock
+#endif
+            }
+            CacheLock(const CacheLock&) = delete;
+            CacheLock& operator=(const CacheLock&) = delete;
+
+        private:
+            static std::mutex& mutex() {
+                static std::mutex m;
+                return m;
+            }
+
+            std::lock_guard<std::mutex> guard_;
+#if NTEST_HAS_FORK
+            int fd_ = -1;
+#endif
+        };
+
+        // Merges the outcomes of `results` into the cache file, replacing
+        // it atomically so an interrupted write leaves the old one intact.
+        // Durations are averaged with the previous figure to damp noise.
+        // Concurrent writers are serialized by CacheLock, and each writes
+        // its own temporary file.
+        inline void update_result_cache(
+            const std::string& path, const std::vector<TestResult>& results) {
+            const CacheLock lock(path);
+            ResultCache cache;
+            {
+                std::ifstream in(path);
+                cache = read_result_cache(in);
+            }
+            for (const TestResult& result : results) {
+                CachedResult& entry = cache[result.test->name];
+                entry.passed = result.ok();
+                entry.wall = entry.wall.count() > 0
+                                 ? (entry.wall + result.wall) / 2
+                                 : result.wall;
+            }
+            std::string temp = path + ".tmp";
+#if NTEST_HAS_FORK
+            temp += "." + std::to_string(getpid());
+#endif
+            {
+                std::ofstream out(temp);
+                write_result_cache(out, cache);
+                if (!out) {
+                    out.close();
+                    std::remove(temp.c_str());
+                    return;
+                }
+            }
+            std::rename(temp.c_str(), path.c_str());
+        }
+
+        inline double parse_double(const std::string& what,
+                                   const std::string& value) {
+            char* end = nullptr;
+            errno = 0;
+            const double x = std::strtod(value.c_str(), &end);
+            if (value.empty() || errno != 0 || *end != '\0')
+                invalid_value(what, value);
+            return x;
+        }
+
+    }  // namespace detail
+
+    // Runs a single test and classifies the outcome. Output written by the
+    // test goes wherever std::cout currently points.
+    inline TestResult run_test(const TestCase& test) {
+        TestResult result;
+        result.test = &test;
+        detail::TestContext ctx;
+        detail::PerfCounters* perf = nullptr;
+        if (detail::perf_enabled()) {
+            perf = &detail::thread_perf_counters();
+            perf->reset();
+        }
+        const ProfileOptions& profile = detail::profile_settings();
+        std::optional<detail::ProfileSession> sampler;
+        if (!profile.dir.empty())
+            sampler.emplace();
+        const AllocationScope heap;
+        const auto wall_start = std::chrono::steady_clock::now();
+        const auto cpu_start = detail::thread_cpu_time();
+
+        if (sampler)
+            sampler->start();
+        if (perf != nullptr)
+            perf->start();
+        bool completed = detail::invoke_guarded(ctx, test.func);
+        if (perf != nullptr) {
+            perf->stop();
+            if (perf->active())
+                result.perf = perf->read();
+        }
+        if (sampler)
+            sampler->stop();
+
+        // Whatever the test's threads reported since its last join().
+        detail::ThreadFatal thread_fatal = detail::collect_threads(ctx);
+        if (thread_fatal.failed && completed) {
+            completed = false;
+            if (!thread_fatal.error.empty())
+                ctx.error = std::move(thread_fatal.error);
+            else
+                ctx.failures.push_back(std::move(thread_fatal.failure));
+        } else if (thread_fatal.failed) {
+            Failure& f = thread_fatal.failure;
+            if (!thread_fatal.error.empty())
+                f = Failure{"exception on a worker thread", "", 0,
+                            std::move(thread_fatal.error), true};
+            f.fatal = false;
+            ctx.failures.push_back(std::move(f));
+        }
+
+        result.cpu = detail::thread_cpu_time() - cpu_start;
+        result.wall = std::chrono::steady_clock::now() - wall_start;
+        result.allocs = heap.stats();
+
+        if (sampler && sampler->samples() > 0 &&
+            result.wall >= profile.threshold) {
+            const std::string path = detail::profile_path(profile, test.name);
+            if (sampler->write(path, test.name))
+                result.profile = path;
+            else
+                std::cerr << "NTest: cannot write profile '" << path << "'"
+                          << std::endl;
+        }
+
+        if (test.shared != nullptr) {
+            // A failing teardown fails the test that triggered it, without
+            // hiding an earlier failure of its own.
+            detail::TestContext teardown;
+            if (!detail::invoke_guarded(teardown,
+                                        [&] { test.shared->release(); })) {
+                completed = false;
+                if (ctx.error.empty())
+                    ctx.error = std::move(teardown.error);
+            }
+            for (Failure& f : teardown.failures)
+                ctx.failures.push_back(std::move(f));
+        }
+        result.message = std::move(ctx.error);
+        result.failures = std::move(ctx.failures);
+        result.stress = ctx.stress;
+
+        if (test.expect_fail) {
+            result.status = completed ? TestResult::Status::UnexpectedPass
+                                      : TestResult::Status::ExpectedFail;
+        } else {
+            result.status = completed ? TestResult::Status::Passed
+                                      : TestResult::Status::Failed;
+        }
+        return result;
+    }
+
+    // Appends the report line(s) for one finished test to `out`, preceded
+    // by any output the test produced while it was captured.
+    inline void append_result(std::string& out, const TestResult& result) {
+        namespace Color = NTest::Color;
+        out.append(result.output);
+        for (const Failure& f : result.failures) {
+            if (!f.fatal) {
+                Color::append_yellow(out, "[EXPECT FAIL] ");
+                out.append(format_failure(f));
+                out.push_back('\n');
+            }
+        }
+
+        const std::string_view name = result.test->name;
+        switch (result.status) {
+            case TestResult::Status::Passed:
+                Color::append_green(out, "[PASS] ");
+                Color::append_green(out, name);
+                break;
+            case TestResult::Status::Failed:
+                Color::append_red(out, "[FAIL] ");
+                Color::append_red(out, name);
+                break;
+            case TestResult::Status::ExpectedFail:
+                Color::append_yellow(out, "[EXPECT FAIL] ");
+                out.append(name);
+                break;
+            case TestResult::Status::UnexpectedPass:
+                out.append("[UNEXPECTED PASS] ");
+                out.append(name);
+                break;
+            case TestResult::Status::TimedOut:
+                Color::append_red(out, "[TIMEOUT] ");
+                Color::append_red(out, name);
+                out.append(" - ");
+                Color::append_yellow(out, result.message);
+                out.push_back('\n');
+                return;
+        }
+
+        out.append(" (");
+        detail::append_ns(out, static_cast<double>(result.wall.count()));
+        if (allocation_tracking_enabled()) {
+            const AllocationStats& a = result.allocs;
+            out.append(", ");
+            out.append(std::to_string(a.count));
+            out.append(" allocs, ");
+            detail::append_bytes(out, static_cast<std::int64_t>(a.bytes));
+            out.append(", peak ");
+            detail::append_bytes(out, a.peak);
+        }
+        out.push_back(')');
+        // Recorded failures live on past the test, so only a clean pass
+        // has a meaningful leak figure.
+        if (allocation_tracking_enabled() && result.allocs.leaked > 0 &&
+            result.status == TestResult::Status::Passed &&
+            result.failures.empty()) {
+            std::string leak = " [leaked ";
+            detail::append_bytes(leak, result.allocs.leaked);
+            leak.push_back(']');
+            Color::append_yellow(out, leak);
+        }
+        if (result.stress) {
+            const StressStats& s = *result.stress;
+            out.append(" [stress ");
+            out.append(std::to_string(s.threads));
+            out.append(" threads, ");
+            out.append(std::to_string(s.iterations));
+            out.append(" calls: p50 ");
+            detail::append_ns(out, static_cast<double>(s.p50.count()));
+            out.append(", p99 ");
+            detail::append_ns(out, static_cast<double>(s.p99.count()));
+            out.append(", max ");
+            detail::append_ns(out, static_cast<double>(s.max.count()));
+            out.push_back(']');
+        }
+        if (result.perf) {
+            out.append(" [");
+            detail::append_perf(out, *result.perf);
+            out.push_back(']');
+        }
+        if (!result.profile.empty()) {
+            out.append(" [profile ");
+            out.append(result.profile);
+            out.push_back(']');
+        }
+        if (result.status == TestResult::Status::Failed) {
+            out.append(" - ");
+            Color::append_yellow(out, result.reason());
+        }
+        out.push_back('\n');
+    }
+
+    inline std::string format_result(const TestResult& result) {
+        std::string text;
+        append_result(text, result);
+        return text;
+    }
+
+    // Lists the `count` tests with the longest wall time.
+    inline std::string format_slowest(std::vector<const TestResult*> results,
+                                      unsigned count) {
+        std::sort(results.begin(), results.end(),
+                  [](const TestResult* a, const TestResult* b) {
+                      return a->wall > b->wall;
+                  });
+        if (results.size() > count)
+            results.resize(count);
+
+        std::ostringstream oss;
+        oss << NTEST_COLOR(cyan)("Slowest " + std::to_string(results.size()) +
+                                 " tests:")
+            << "\n";
+        for (const TestResult* r : results) {
+            oss << "    " << std::setw(10)
+                << detail::format_ns(static_cast<double>(r->wall.count()))
+                << "  cpu " << std::setw(10)
+                << detail::format_ns(static_cast<double>(r->cpu.count()))
+                << "  " << r->test->name << "\n";
+        }
+        return oss.str();
+    }
+
+    // =========================
+    // Reporters
+    // =========================
+
+    struct RunInfo {
+        std::size_t tests = 0;       // tests that will run
+        std::size_t benchmarks = 0;  // benchmarks that will run
+        std::size_t selected = 0;    // tests and benchmarks in this shard
+        std::size_t registered = 0;  // before sharding
+        unsigned shard_index = 0;
+        unsigned shard_count = 1;
+    };
+
+    struct RunSummary {
+        int passed = 0;
+        int failed = 0;
+        std::chrono::nanoseconds wall{0};
+        // Every test's result in report order. Captured output and recorded
+        // failures are released once reported, so only the status, timing
+        // and allocation figures remain.
+        const std::vector<TestResult>* results = nullptr;
+    };
+
+    // Receives the events of a run. The runner serializes calls, so an
+    // implementation needs no locking of its own. test_start fires as each
+    // test begins, which under -j is out of order; the other events arrive
+    // in registration order as soon as every earlier test has finished.
+    class Reporter {
+    public:
+        virtual ~Reporter() = default;
+        virtual void run_start(const RunInfo&) {}
+        virtual void test_start(const TestCase&) {}
+        // Each failure recorded by the test, just before its test_end.
+        virtual void assertion_failure(const TestCase&, const Failure&) {}
+        virtual void test_end(const TestResult&) {}
+        virtual void benchmark_end(const BenchmarkResult&) {}
+        virtual void benchmark_comparison(const BenchmarkComparison&) {}
+        // After the benchmark_end of every point of a BENCHMARK_RANGE.
+        virtual void complexity(const ComplexityResult&) {}
+        // Free-form diagnostics, e.g. an unreadable baseline file.
+        virtual void note(std::string_view) {}
+        virtual void run_end(const RunSummary&) {}
+        // Pushes out buffered output; called before an aborted run exits.
+        virtual void flush() {}
+    };
+
+    namespace detail {
+        // Buffered sink over a file it owns.
+        class FileSink : public OutputSink {
+        public:
+            explicit FileSink(const std::string& path) {
+                if (file_.open(path, std::ios::out | std::ios::trunc) ==
+                    nullptr)
+                    raise(std::invalid_argument("cannot open " + path));
+            }
+
+            void write(std::string_view text) override {
+                buffered_.write(text);
+            }
+            void flush() override { buffered_.flush(); }
+
+        private:
+            std::filebuf file_;
+            BufferedSink buffered_{&file_};
+        };
+
+        inline void append_xml_escaped(std::string& out,
+                                       std::string_view text) {
+            for (const char c : text) {
+                switch (c) {
+                    case '&':
+                        out += "&amp;";
+                        break;
+                    case '<':
+                        out += "&lt;";
+                        break;
+                    case '>':
+                        out += "&gt;";
+                        break;
+                    case '"':
+                        out += "&quot;";
+                        break;
+                    case '\'':
+                        out += "&apos;";
+                        break;
+                    default:
+                        // Other control characters are not allowed in XML.
+                        if (static_cast<unsigned char>(c) >= 0x20 ||
+                            c == '\t' || c == '\n' || c == '\r')
+                            out.push_back(c);
+                }
+            }
+        }
+
+        inline void append_json_string(std::string& out,
+                                       std::string_view text) {
+            out.push_back('"');
+            for (const char c : text) {
+                switch (c) {
+                    case '"':
+                        out += "\\\"";
+                        break;
+                    case '\\':
+                        out += "\\\\";
+                        break;
+                    case '\n':
+                        out += "\\n";
+                        break;
+                    case '\r':
+                        out += "\\r";
+                        break;
+                    case '\t':
+                        out += "\\t";
+                        break;
+                    default:
+                        if (static_cast<unsigned char>(c) < 0x20) {
+                            char esc[8];
+                            std::snprintf(esc, sizeof esc, "\\u%04x",
+                                          static_cast<unsigned>(c));
+                            out += esc;
+                        } else {
+                            out.push_back(c);
+                        }
+                }
+            }
+            out.push_back('"');
+        }
+
+        inline const char* status_name(TestResult::Status status) {
+            switch (status) {
+                case TestResult::Status::Passed:
+                    return "passed";
+                case TestResult::Status::Failed:
+                    return "failed";
+                case TestResult::Status::ExpectedFail:
+                    return "expected_fail";
+                case TestResult::Status::UnexpectedPass:
+                    return "unexpected_pass";
+                case TestResult::Status::TimedOut:
+                    return "timed_out";
+            }
+            return "unknown";
+        }
+
+        // Why a result counts as a failure, for structured reports.
+        inline std::string failure_reason(const TestResult& result) {
+            if (result.status == TestResult::Status::UnexpectedPass)
+                return "expected to fail, but passed";
+            return result.reason();
+        }
+    }  // namespace detail
+
+    // Opens a destination for a reporter: "-" or "" is stdout, anything
+    // else a file that is truncated. Throws std::invalid_argument if the
+    // file cannot be opened.
+    inline std::shared_ptr<OutputSink> open_output(const std::string& path) {
+        if (path.empty() || path == "-")
+            return std::make_shared<BufferedSink>(std::cout.rdbuf());
+        return std::make_shared<detail::FileSink>(path);
+    }
+
+    // Base for reporters that write text to a sink, optionally owning it.
+    class SinkReporter : public Reporter {
+    public:
+        explicit SinkReporter(OutputSink& out) : out_(out) {}
+        explicit SinkReporter(std::shared_ptr<OutputSink> out)
+            : owned_(std::move(out)), out_(*owned_) {}
+
+        void flush() override { out_.flush(); }
+
+    protected:
+        std::shared_ptr<OutputSink> owned_;
+        OutputSink& out_;
+        std::string buffer_;  // reused for every event
+    };
+
+    // The human-readable report: colored result lines, benchmark tables
+    // and the summary.
+    class ConsoleReporter : public SinkReporter {
+    public:
+        explicit ConsoleReporter(OutputSink& out,
+                                 Verbosity verbosity = Verbosity::Normal,
+                                 unsigned slowest = 0)
+            : SinkReporter(out), verbosity_(verbosity), slowest_(slowest) {}
+        explicit ConsoleReporter(std::shared_ptr<OutputSink> out,
+                                 Verbosity verbosity = Verbosity::Normal,
+                                 unsigned slowest = 0)
+            : SinkReporter(std::move(out)),
+              verbosity_(verbosity),
+              slowest_(slowest) {}
+
+        void run_start(const RunInfo& info) override {
+            if (verbosity_ == Verbosity::Quiet)
+                return;
+            out_.write(
+                NTEST_COLOR(bold)(NTEST_COLOR(cyan)("NTest Framework\n")) +
+                NTEST_COLOR(cyan)("Running Tests....\n"));
+            if (info.shard_count > 1) {
+                out_.write("Shard " + std::to_string(info.shard_index + 1) +
+                           "/" + std::to_string(info.shard_count) + ": " +
+                           std::to_string(info.selected) + " of " +
+                           std::to_string(info.registered) + " tests\n");
+            }
+        }
+
+        // Below Normal, passing tests are not formatted at all.
+        void test_end(const TestResult& result) override {
+            if (verbosity_ != Verbosity::Normal && result.ok())
+                return;
+            buffer_.clear();
+            append_result(buffer_, result);
+            out_.write(buffer_);
+        }
+
+        void benchmark_end(const BenchmarkResult& result) override {
+            if (!benchmarks_started_) {
+                out_.write(NTEST_COLOR(cyan)("Running Benchmarks....\n"));
+                benchmarks_started_ = true;
+            }
+            out_.write(format_benchmark(result));
+            out_.flush();  // benchmarks are slow; show progress
+        }
+
+        void benchmark_comparison(const BenchmarkComparison& cmp) override {
+            out_.write(format_comparison(cmp));
+        }
+
+        void complexity(const ComplexityResult& result) override {
+            out_.write(format_complexity(result));
+            out_.flush();
+        }
+
+        void note(std::string_view text) override {
+            buffer_.assign(text);
+            buffer_.push_back('\n');
+            out_.write(buffer_);
+        }
+
+        void run_end(const RunSummary& summary) override {
+            if (slowest_ > 0 && verbosity_ != Verbosity::Quiet &&
+                summary.results != nullptr && !summary.results->empty()) {
+                std::vector<const TestResult*> ranked;
+                for (const auto& result : *summary.results)
+                    ranked.push_back(&result);
+                out_.write(format_slowest(std::move(ranked), slowest_));
+            }
+            out_.write(std::to_string(summary.passed) + " passed, " +
+                       std::to_string(summary.failed) + " failed.\n");
+            if (verbosity_ != Verbosity::Quiet) {
+                out_.write(summary.failed > 0
+                               ? NTEST_COLOR(bold)(
+                                     NTEST_COLOR(red)("\nTest failed.\n"))
+                               : NTEST_COLOR(bold)(NTEST_COLOR(green)(
+                                     "\nAll tests passed :)\n")));
+            }
+            out_.flush();
+        }
+
+    private:
+        Verbosity verbosity_;
+        unsigned slowest_;
+        bool benchmarks_started_ = false;
+    };
+
+    // JUnit XML, one <testcase> written as each test is reported. Suite
+    // totals are left to the consumer, which keeps the file streamable.
+    class JUnitReporter : public SinkReporter {
+    public:
+        using SinkReporter::SinkReporter;
+
+        void run_start(const RunInfo&) override {
+            out_.write(
+                "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                "<testsuites>\n<testsuite name=\"NTest\">\n");
+        }
+
+        void test_end(const TestResult& result) override {
+            buffer_.clear();
+            open_case(*result.test, "NTest", result.wall);
+            const char* type = nullptr;
+            switch (result.status) {
+                case TestResult::Status::Failed:
+                    type = "assertion";
+                    break;
+                case TestResult::Status::UnexpectedPass:
+                    type = "unexpected-pass";
+                    break;
+                case TestResult::Status::TimedOut:
+                    type = "timeout";
+                    break;
+                default:
+                    break;
+            }
+            if (type != nullptr) {
+                buffer_ += "    <failure type=\"";
+                buffer_ += type;
+                buffer_ += "\" message=\"";
+                detail::append_xml_escaped(buffer_,
+                                           detail::failure_reason(result));
+                buffer_ += "\"/>\n";
+            }
+            if (result.perf) {
+                buffer_ += "    <properties>\n";
+                for (unsigned e = 0; e < PerfStats::kEvents; ++e) {
+                    const auto event = PerfStats::Event(e);
+                    if (!result.perf->has(event))
+                        continue;
+                    buffer_ += "      <property name=\"perf.";
+                    buffer_ += detail::perf_event_names[e];
+                    buffer_ += "\" value=\"";
+                    buffer_ += std::to_string((*result.perf)[event]);
+                    buffer_ += "\"/>\n";
+                }
+                buffer_ += "    </properties>\n";
+            }
+            bool has_output = !result.output.empty();
+            for (const Failure& f : result.failures)
+                has_output |= !f.fatal;
+            if (has_output) {
+                buffer_ += "    <system-out>";
+                for (const Failure& f : result.failures) {
+                    if (f.fatal)
+                        continue;
+                    buffer_ += "[EXPECT FAIL] ";
+                    detail::append_xml_escaped(buffer_, format_failure(f));
+                    buffer_ += '\n';
+                }
+                detail::append_xml_escaped(buffer_, result.output);
+                buffer_ += "</system-out>\n";
+            }
+            buffer_ += "  </testcase>\n";
+            out_.write(buffer_);
+        }
+
+        void benchmark_end(const BenchmarkResult& result) override {
+            buffer_.clear();
+            double total = 0;
+            for (const double ns : result.samples)
+                total += ns * static_cast<double>(result.iterations);
+            open_case(*result.bench, "NTest.benchmarks",
+                      std::chrono::nanoseconds(
+                          static_cast<std::int64_t>(total)),
+                      detail::benchmark_name(result));
+            if (!result.ok()) {
+                buffer_ += "    <failure type=\"benchmark\" message=\"";
+                detail::append_xml_escaped(buffer_, result.error);
+                buffer_ += "\"/>\n";
+            }
+            buffer_ += "  </testcase>\n";
+            out_.write(buffer_);
+        }
+
+        void complexity(const ComplexityResult& result) override {
+            buffer_.clear();
+            open_case(*result.bench, "NTest.complexity",
+                      std::chrono::nanoseconds(0));
+            if (!result.fits.empty()) {
+                buffer_ += "    <properties>\n"
+                           "      <property name=\"complexity\" value=\"";
+                buffer_ += complexity_name(result.best.model);
+                buffer_ += "\"/>\n      <property name=\"rms\" value=\"";
+                buffer_ += std::to_string(result.best.rms);
+                buffer_ += "\"/>\n    </properties>\n";
+            }
+            if (!result.ok()) {
+                buffer_ += "    <failure type=\"complexity\" message=\"";
+                detail::append_xml_escaped(buffer_, result.error);
+                buffer_ += "\"/>\n";
+            }
+            buffer_ += "  </testcase>\n";
+            out_.write(buffer_);
+        }
+
+        void run_end(const RunSummary&) override {
+            out_.write("</testsuite>\n</testsuites>\n");
+            out_.flush();
+        }
+
+    private:
+        void open_case(const TestCase& test, const char* classname,
+                       std::chrono::nanoseconds wall,
+                       std::string_view name = {}) {
+            char time[32];
+            std::snprintf(time, sizeof time, "%.6f",
+                          static_cast<double>(wall.count()) / 1e9);
+            buffer_ += "  <testcase classname=\"";
+            buffer_ += classname;
+            buffer_ += "\" name=\"";
+            detail::append_xml_escaped(buffer_,
+                                       name.empty() ? test.name : name);
+            buffer_ += "\" file=\"";
+            detail::append_xml_escaped(buffer_, test.file);
+            buffer_ += "\" line=\"";
+            buffer_ += std::to_string(test.line);
+            buffer_ += "\" time=\"";
+            buffer_ += time;
+            buffer_ += "\">\n";
+        }
+    };
+
+    // JSON Lines: one self-contained object per event, so a partially
+    // written file is still readable and can be tailed.
+    class JsonLinesReporter : public SinkReporter {
+    public:
+        using SinkReporter::SinkReporter;
+
+        void run_start(const RunInfo& info) override {
+            begin("run_start");
+            field("tests", info.tests);
+            field("benchmarks", info.benchmarks);
+            field("shard_index", info.shard_index);
+            field("shard_count", info.shard_count);
+            end();
+        }
+
+        void test_start(const TestCase& test) override {
+            begin("test_start");
+            field("name", test.name);
+            end();
+        }
+
+        void assertion_failure(const TestCase& test,
+                               const Failure& f) override {
+            begin("assertion_failure");
+            field("test", test.name);
+            field("expr", f.expr);
+            field("file", f.file);
+            field("line", f.line);
+            field("fatal", f.fatal);
+            field("message", f.msg);
+            end();
+        }
+
+        void test_end(const TestResult& result) override {
+            begin("test_end");
+            field("name", result.test->name);
+            field("file", result.test->file);
+            field("line", result.test->line);
+            field("status", detail::status_name(result.status));
+            field("wall_ns", result.wall.count());
+            field("cpu_ns", result.cpu.count());
+            if (allocation_tracking_enabled()) {
+                field("allocs", result.allocs.count);
+                field("alloc_bytes", result.allocs.bytes);
+            }
+            if (result.stress) {
+                const StressStats& s = *result.stress;
+                field("stress_threads", s.threads);
+                field("stress_calls", s.iterations);
+                field("stress_min_ns", s.min.count());
+                field("stress_p50_ns", s.p50.count());
+                field("stress_p90_ns", s.p90.count());
+                field("stress_p99_ns", s.p99.count());
+                field("stress_max_ns", s.max.count());
+            }
+            if (result.perf)
+                perf_fields(*result.perf);
+            if (!result.profile.empty())
+                field("profile", result.profile);
+            if (!result.ok())
+                field("message", detail::failure_reason(result));
+            if (!result.output.empty())
+                field("output", result.output);
+            end();
+        }
+
+        void benchmark_end(const BenchmarkResult& result) override {
+            begin("benchmark_end");
+            field("name", detail::benchmark_name(result));
+            if (result.bench->is_range())
+                field("range", result.range);
+            field("iterations", result.iterations);
+            field("samples", result.samples.size());
+            field("median_ns", result.stats.median);
+            field("mean_ns", result.stats.mean);
+            field("min_ns", result.stats.min);
+            field("stddev_ns", result.stats.stddev);
+            field("mad_ns", result.stats.mad);
+            if (result.perf) {
+                perf_fields(*result.perf,
+                            static_cast<double>(result.iterations) *
+                                static_cast<double>(result.samples.size()));
+            }
+            if (!result.ok())
+                field("error", result.error);
+            end();
+        }
+
+        void benchmark_comparison(const BenchmarkComparison& cmp) override {
+            static const char* const verdicts[] = {"unchanged", "regression",
+                                                   "improvement", "new"};
+            begin("benchmark_comparison");
+            field("name", cmp.name);
+            field("verdict", verdicts[static_cast<int>(cmp.verdict)]);
+            field("baseline_median_ns", cmp.baseline_median);
+            field("median_ns", cmp.current_median);
+            field("delta", cmp.delta);
+            field("p", cmp.p);
+            end();
+        }
+
+        void complexity(const ComplexityResult& result) override {
+            begin("complexity");
+            field("name", result.bench->name);
+            if (!result.fits.empty()) {
+                field("model", complexity_name(result.best.model));
+                field("coefficient_ns", result.best.coefficient);
+                field("rms", result.best.rms);
+            }
+            if (!result.ok())
+                field("error", result.error);
+            end();
+        }
+
+        void note(std::string_view text) override {
+            begin("note");
+            field("text", text);
+            end();
+        }
+
+        void run_end(const RunSummary& summary) override {
+            begin("run_end");
+            field("passed", summary.passed);
+            field("failed", summary.failed);
+            field("wall_ns", summary.wall.count());
+            end();
+            out_.flush();
+        }
+
+    private:
+        void begin(const char* event) {
+            buffer_ = "{\"event\":\"";
+            buffer_ += event;
+            buffer_ += '"';
+        }
+
+        void key(const char* name) {
+            buffer_ += ",\"";
+            buffer_ += name;
+            buffer_ += "\":";
+        }
+
+        void field(const char* name, std::string_view value) {
+            key(name);
+            detail::append_json_string(buffer_, value);
+        }
+        void field(const char* name, const char* value) {
+            field(name, std::string_view(value != nullptr ? value : ""));
+        }
+        void field(const char* name, const std::string& value) {
+            field(name, std::string_view(value));
+        }
+        void field(const char* name, bool value) {
+            key(name);
+            buffer_ += value ? "true" : "false";
+        }
+        void field(const char* name, double value) {
+            key(name);
+            char num[32];
+            std::snprintf(num, sizeof num, "%.17g",
+                          std::isfinite(value) ? value : 0.0);
+            buffer_ += num;
+        }
+        template <typename Int,
+                  typename = std::enable_if_t<std::is_integral_v<Int>>>
+        void field(const char* name, Int value) {
+            key(name);
+            buffer_ += std::to_string(value);
+        }
+
+        // perf_<event> totals, or perf_<event>_per_iter averages over
+        // `iterations`.
+        void perf_fields(const PerfStats& perf, double iterations = 0) {
+            for (unsigned e = 0; e < PerfStats::kEvents; ++e) {
+                const auto event = PerfStats::Event(e);
+                if (!perf.has(event))
+                    continue;
+                std::string name = "perf_";
+                name += detail::perf_event_names[e];
+                if (iterations > 0) {
+                    name += "_per_iter";
+                    field(name.c_str(),
+                          static_cast<double>(perf[event]) / iterations);
+                } else {
+                    field(name.c_str(), perf[event]);
+                }
+            }
+            if (perf.has(PerfStats::Cycles) &&
+                perf.has(PerfStats::Instructions))
+                field("perf_ipc", perf.ipc());
+        }
+
+        void end() {
+            buffer_ += "}\n";
+            out_.write(buffer_);
+        }
+    };
+
+    // Test Anything Protocol, version 13. Expected failures are reported
+    // as TODO items; details follow failing lines as a YAML block.
+    class TapReporter : public SinkReporter {
+    public:
+        using SinkReporter::SinkReporter;
+
+        void run_start(const RunInfo& info) override {
+            out_.write("TAP version 13\n1.." +
+                       std::to_string(info.tests + info.benchmarks) + "\n");
+        }
+
+        void test_end(const TestResult& result) override {
+            buffer_.clear();
+            const bool expected = result.status ==
+                                  TestResult::Status::ExpectedFail;
+            buffer_ += result.ok() && !expected ? "ok " : "not ok ";
+            buffer_ += std::to_string(++number_);
+            buffer_ += " - ";
+            buffer_ += result.test->name;
+            if (expected)
+                buffer_ += " # TODO expected to fail";
+            buffer_ += '\n';
+            if (!result.ok())
+                diagnostic(detail::failure_reason(result),
+                           detail::status_name(result.status));
+            for (const Failure& f : result.failures) {
+                if (!f.fatal)
+                    comment("[EXPECT FAIL] " + format_failure(f));
+            }
+            comment(result.output);
+            out_.write(buffer_);
+        }
+
+        void benchmark_end(const BenchmarkResult& result) override {
+            if (result.bench->is_range())
+                return;  // one line per range, from complexity()
+            buffer_.clear();
+            buffer_ += result.ok() ? "ok " : "not ok ";
+            buffer_ += std::to_string(++number_);
+            buffer_ += " - ";
+            buffer_ += result.bench->name;
+            buffer_ += '\n';
+            if (!result.ok())
+                diagnostic(result.error, "failed");
+            out_.write(buffer_);
+        }
+
+        void complexity(const ComplexityResult& result) override {
+            buffer_.clear();
+            buffer_ += result.ok() ? "ok " : "not ok ";
+            buffer_ += std::to_string(++number_);
+            buffer_ += " - ";
+            buffer_ += result.bench->name;
+            buffer_ += '\n';
+            if (!result.fits.empty())
+                comment(std::string("best fit ") +
+                        complexity_name(result.best.model));
+            if (!result.ok())
+                diagnostic(result.error, "failed");
+            out_.write(buffer_);
+        }
+
+        void note(std::string_view text) override {
+            buffer_.clear();
+            comment(text);
+            out_.write(buffer_);
+        }
+
+        void run_end(const RunSummary&) override { out_.flush(); }
+
+    private:
+        void diagnostic(const std::string& message, const char* status) {
+            buffer_ += "  ---\n  message: ";
+            detail::append_json_string(buffer_, message);
+            buffer_ += "\n  status: ";
+            buffer_ += status;
+            buffer_ += "\n  ...\n";
+        }
+
+        void comment(std::string_view text) {
+            while (!text.empty()) {
+                const std::size_t eol = text.find('\n');
+                buffer_ += "# ";
+                buffer_ += text.substr(0, eol);
+                buffer_ += '\n';
+                if (eol == std::string_view::npos)
+                    break;
+                text.remove_prefix(eol + 1);
+            }
+        }
+
+        std::size_t number_ = 0;
+    };
+
+    namespace detail {
+        // Fans events out to several reporters, serializing the calls.
+        class ReporterList : public Reporter {
+        public:
+            explicit ReporterList(std::vector<Reporter*> reporters)
+                : reporters_(std::move(reporters)) {}
+
+            void run_start(const RunInfo& info) override {
+                each([&](Reporter& r) { r.run_start(info); });
+            }
+            void test_start(const TestCase& test) override {
+                each([&](Reporter& r) { r.test_start(test); });
+            }
+            void assertion_failure(const TestCase& test,
+                                   const Failure& f) override {
+                each([&](Reporter& r) { r.assertion_failure(test, f); });
+            }
+            void test_end(const TestResult& result) override {
+                each([&](Reporter& r) { r.test_end(result); });
+            }
+            void benchmark_end(const BenchmarkResult& result) override {
+                each([&](Reporter& r) { r.benchmark_end(result); });
+            }
+            void benchmark_comparison(
+                const BenchmarkComparison& cmp) override {
+                each([&](Reporter& r) { r.benchmark_comparison(cmp); });
+            }
+            void complexity(const ComplexityResult& result) override {
+                each([&](Reporter& r) { r.complexity(result); });
+            }
+            void note(std::string_view text) override {
+                each([&](Reporter& r) { r.note(text); });
+            }
+            void run_end(const RunSummary& summary) override {
+                each([&](Reporter& r) { r.run_end(summary); });
+            }
+            void flush() override {
+                each([](Reporter& r) { r.flush(); });
+            }
+
+        private:
+            template <typename Fn>
+            void each(Fn&& fn) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                for (Reporter* r : reporters_)
+                    fn(*r);
+            }
+
+            std::vector<Reporter*> reporters_;
+            std::mutex mutex_;
+        };
+    }  // namespace detail
+
+    namespace detail {
+        // Runs `benches` serially, then saves and/or compares baselines.
+        // Returns the number of failures, i.e. failing bodies, unreadable
+        // baselines and significant regressions.
+        inline int run_benchmarks(const std::vector<TestCase*>& benches,
+                                  const BenchmarkOptions& opts, int& passed,
+                                  Reporter& reporter) {
+            int failed = 0;
+            std::optional<Baseline> baseline;
+            if (!opts.compare_baseline.empty()) {
+                std::ifstream in(opts.compare_baseline);
+                std::string error;
+                if (!in) {
+                    error = "cannot open file";
+                } else {
+#if NTEST_EXCEPTIONS
+                    try {
+                        baseline = read_baseline(in);
+                    } catch (const std::exception& e) {
+                        error = e.what();
+                    }
+#else
+                    baseline = read_baseline(in);
+#endif
+                }
+                if (!error.empty()) {
+                    reporter.note("[FAIL] baseline " + opts.compare_baseline +
+                                  " - " + error);
+                    ++failed;
+                }
+            }
+
+            std::vector<BenchmarkResult> results;
+            results.reserve(benches.size());
+            for (const TestCase* bench : benches) {
+                if (bench->is_range()) {
+                    ComplexityResult range = run_benchmark_range(*bench, opts);
+                    for (const BenchmarkResult& point : range.points)
+                        reporter.benchmark_end(point);
+                    reporter.complexity(range);
+                    range.ok() ? ++passed : ++failed;
+                    for (BenchmarkResult& point : range.points)
+                        results.push_back(std::move(point));
+                    continue;
+                }
+                results.push_back(run_benchmark(*bench, opts));
+                reporter.benchmark_end(results.back());
+                results.back().ok() ? ++passed : ++failed;
+            }
+
+            if (!opts.save_baseline.empty()) {
+                std::ofstream file(opts.save_baseline);
+                write_baseline(file, results);
+                if (!file) {
+                    reporter.note("[FAIL] baseline " + opts.save_baseline +
+                                  " - write failed");
+                    ++failed;
+                }
+            }
+
+            if (baseline) {
+                std::ostringstream oss;
+                oss << "Comparing against " << opts.compare_baseline
+                    << " (alpha " << opts.alpha << ", threshold "
+                    << opts.threshold * 100 << "%)";
+                reporter.note(oss.str());
+                for (const auto& result : results) {
+                    if (!result.ok())
+                        continue;
+                    const auto cmp =
+                        compare_to_baseline(result, *baseline, opts);
+                    reporter.benchmark_comparison(cmp);
+                    if (cmp.verdict ==
+                        BenchmarkComparison::Verdict::Regression)
+                        ++failed;
+                }
+            }
+            return failed;
+        }
+    }  // namespace detail
+
+#if NTEST_HAS_FORK
+    namespace detail {
+
+        inline bool write_exact(int fd, const void* data, std::size_t n) {
+            const char* p = static_cast<const char*>(data);
+            while (n > 0) {
+                const ssize_t w = ::write(fd, p, n);
+                if (w < 0 && errno == EINTR)
+                    continue;
+                if (w <= 0)
+                    return false;
+                p += w;
+                n -= static_cast<std::size_t>(w);
+            }
+            return true;
+        }
+
+        inline bool read_exact(int fd, void* data, std::size_t n) {
+            char* p = static_cast<char*>(data);
+            while (n > 0) {
+                const ssize_t r = ::read(fd, p, n);
+                if (r < 0 && errno == EINTR)
+                    continue;
+                if (r <= 0)
+                    return false;
+                p += r;
+                n -= static_cast<std::size_t>(r);
+            }
+            return true;
+        }
+
+        inline bool write_string(int fd, const std::string& s) {
+            const auto len = static_cast<std::uint32_t>(s.size());
+            return write_exact(fd, &len, sizeof len) &&
+                   write_exact(fd, s.data(), s.size());
+        }
+
+        inline bool read_string(int fd, std::string& s) {
+            std::uint32_t len = 0;
+            if (!read_exact(fd, &len, sizeof len))
+                return false;
+            s.resize(len);
+            return read_exact(fd, &s[0], len);
+        }
+
+        // Describes how a worker process died, for the failure message.
+        inline std::string describe_exit(int status) {
+            if (WIFSIGNALED(status)) {
+                const int sig = WTERMSIG(status);
+                const char* name = ::strsignal(sig);
+                return "crashed with signal " + std::to_string(sig) + " (" +
+                       (name != nullptr ? name : "unknown") + ")";
+            }
+            if (WIFEXITED(status))
+                return "exited with code " +
+                       std::to_string(WEXITSTATUS(status));
+            return "terminated abnormally";
+        }
+
+        // One forked worker process. The parent sends test slots over `cmd`
+        // and reads encoded results back from `res`.
+        struct IsolatedWorker {
+            pid_t pid = -1;
+            int cmd = -1;
+            int res = -1;
+            std::optional<std::size_t> slot;  // test currently running
+            std::chrono::steady_clock::time_point started{};
+        };
+
+        constexpr std::uint64_t kStopWorker = ~std::uint64_t{0};
+
+        [[noreturn]] inline void isolated_worker_main(
+            const std::vector<TestCase*>& tests, int cmd, int res) {
+            CoutRouting routing;
+            std::uint64_t slot = 0;
+            while (read_exact(cmd, &slot, sizeof slot) && slot != kStopWorker) {
+                std::string captured;
+                capture_target() = &captured;
+                const TestResult result = run_test(*tests[slot]);
+                capture_target() = nullptr;
+
+                // Failures travel pre-formatted: expectations as output,
+                // the fatal one as the message.
+                const std::string message = result.reason();
+                for (const Failure& f : result.failures) {
+                    if (!f.fatal)
+                        captured += NTEST_COLOR(yellow)("[EXPECT FAIL] ") +
+                                    format_failure(f) + "\n";
+                }
+
+                const auto status = static_cast<std::uint8_t>(result.status);
+                const std::int64_t metrics[6] = {
+                    result.wall.count(),
+                    result.cpu.count(),
+                    static_cast<std::int64_t>(result.allocs.count),
+                    static_cast<std::int64_t>(result.allocs.bytes),
+                    result.allocs.peak,
+                    result.allocs.leaked};
+                const std::uint8_t stressed = result.stress ? 1 : 0;
+                const std::uint8_t counted = result.perf ? 1 : 0;
+                if (!write_exact(res, &status, sizeof status) ||
+                    !write_exact(res, metrics, sizeof metrics) ||
+                    !write_exact(res, &stressed, sizeof stressed) ||
+                    (stressed != 0 &&
+                     !write_exact(res, &*result.stress, sizeof(StressStats))) ||
+                    !write_exact(res, &counted, sizeof counted) ||
+                    (counted != 0 &&
+                     !write_exact(res, &*result.perf, sizeof(PerfStats))) ||
+                    !write_string(res, result.profile) ||
+                    !write_string(res, message) ||
+                    !write_string(res, captured))
+                    break;
+            }
+            // Shared fixtures this worker built but whose remaining users
+            // ran elsewhere.
+            for (const TestCase* test : tests) {
+                if (test->shared != nullptr) {
+                    TestContext ignored;
+                    invoke_guarded(ignored, [&] { test->shared->reset(); });
+                }
+            }
+            ::_exit(0);
+        }
+
+        inline void spawn_worker(IsolatedWorker& w,
+                                 const std::vector<TestCase*>& tests,
+                                 const std::vector<IsolatedWorker>& siblings) {
+            int cmd[2];
+            int res[2];
+            if (::pipe(cmd) != 0)
+                raise(std::runtime_error("pipe() failed"));
+            if (::pipe(res) != 0) {
+                ::close(cmd[0]);
+                ::close(cmd[1]);
+                raise(std::runtime_error("pipe() failed"));
+            }
+
+            std::cout.flush();
+            const pid_t pid = ::fork();
+            if (pid < 0) {
+                for (int fd : {cmd[0], cmd[1], res[0], res[1]})
+                    ::close(fd);
+                raise(std::runtime_error("fork() failed"));
+            }
+            if (pid == 0) {
+                // Drop the parent's ends of every pipe so that EOF on a
+                // sibling's result pipe is not held back by this process.
+                for (const auto& s : siblings) {
+                    if (s.pid > 0) {
+                        ::close(s.cmd);
+                        ::close(s.res);
+                    }
+                }
+                ::close(cmd[1]);
+                ::close(res[0]);
+                isolated_worker_main(tests, cmd[0], res[1]);
+            }
+
+            ::close(cmd[0]);
+            ::close(res[1]);
+            w.pid = pid;
+            w.cmd = cmd[1];
+            w.res = res[0];
+            w.slot.reset();
+        }
+
+        inline void stop_worker(IsolatedWorker& w) {
+            if (w.pid <= 0)
+                return;
+            write_exact(w.cmd, &kStopWorker, sizeof kStopWorker);
+            ::close(w.cmd);
+            ::close(w.res);
+            int status = 0;
+            while (::waitpid(w.pid, &status, 0) < 0 && errno == EINTR) {
+            }
+            w = IsolatedWorker{};
+        }
+
+        // Kills and reaps a worker, returning its wait status.
+        inline int kill_worker(IsolatedWorker& w) {
+            ::kill(w.pid, SIGKILL);
+            int status = 0;
+            while (::waitpid(w.pid, &status, 0) < 0 && errno == EINTR) {
+            }
+            ::close(w.cmd);
+            ::close(w.res);
+            w = IsolatedWorker{};
+            return status;
+        }
+
+        // Runs `items` (indices into `tests`) on a pool of `workers` forked
+        // processes, invoking on_start(slot) in the parent as each test is
+        // handed out and on_result(slot, result) as it finishes. A worker
+        // that dies mid-test, or overruns its test timeout and is killed,
+        // fails only that test and is replaced if work remains. Passing
+        // `run_deadline` kills every worker and aborts the run via
+        // abort_run().
+        template <typename OnStart, typename OnResult, typename BeforeAbort>
+        void run_isolated(
+            const std::vector<TestCase*>& tests,
+            const std::vector<std::size_t>& items, unsigned workers,
+            std::chrono::milliseconds test_timeout,
+            std::optional<std::chrono::steady_clock::time_point> run_deadline,
+            OnStart&& on_start, OnResult&& on_result,
+            BeforeAbort&& before_abort) {
+            using clock = std::chrono::steady_clock;
+            if (items.empty())
+                return;
+            if (workers > items.size())
+                workers = static_cast<unsigned>(items.size());
+
+            // A worker dying between tests must not kill the runner when we
+            // write its next command.
+            struct sigaction ignore {};
+            struct sigaction previous {};
+            ignore.sa_handler = SIG_IGN;
+            ::sigaction(SIGPIPE, &ignore, &previous);
+
+            std::vector<IsolatedWorker> pool(workers);
+            std::size_t next = 0;
+            std::size_t done = 0;
+
+            auto dispatch = [&](IsolatedWorker& w) {
+                if (next >= items.size())
+                    return;
+                if (w.pid <= 0)
+                    spawn_worker(w, tests, pool);
+                const std::uint64_t slot = items[next++];
+                w.slot = static_cast<std::size_t>(slot);
+                w.started = clock::now();
+                on_start(*w.slot);
+                write_exact(w.cmd, &slot, sizeof slot);
+            };
+
+            auto deadline_of = [&](const IsolatedWorker& w)
+                -> std::optional<clock::time_point> {
+                const auto limit =
+                    effective_timeout(*tests[*w.slot], test_timeout);
+                if (limit.count() <= 0)
+                    return std::nullopt;
+                return w.started + limit;
+            };
+
+            for (auto& w : pool)
+                dispatch(w);
+
+            std::vector<pollfd> fds;
+            while (done < items.size()) {
+                fds.clear();
+                std::optional<clock::time_point> wake = run_deadline;
+                for (const auto& w : pool) {
+                    if (!w.slot)
+                        continue;
+                    fds.push_back(pollfd{w.res, POLLIN, 0});
+                    const auto d = deadline_of(w);
+                    if (d && (!wake || *d < *wake))
+                        wake = d;
+                }
+                int wait_ms = -1;
+                if (wake) {
+                    const auto left =
+                        std::chrono::ceil<std::chrono::milliseconds>(
+                            *wake - clock::now());
+                    wait_ms = static_cast<int>(
+                        std::max<std::int64_t>(0, left.count()));
+                }
+                if (::poll(fds.data(), fds.size(), wait_ms) < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    raise(std::runtime_error("poll() failed"));
+                }
+
+                const auto now = clock::now();
+                if (run_deadline && *run_deadline <= now) {
+                    std::string report;
+                    for (auto& w : pool) {
+                        if (!w.slot)
+                            continue;
+                        report += NTEST_COLOR(red)(
+                                      std::string("[TIMEOUT] ") +
+                                      tests[*w.slot]->name) +
+                                  " - killed at the run timeout\n";
+                        kill_worker(w);
+                    }
+                    before_abort();
+                    abort_run(report + NTEST_COLOR(red)("[TIMEOUT] run") +
+                              " - exceeded the run timeout\n");
+                }
+
+                for (auto& w : pool) {
+                    if (!w.slot)
+                        continue;
+                    bool ready = false;
+                    for (const auto& p : fds)
+                        ready |= p.fd == w.res && p.revents != 0;
+
+                    const std::size_t slot = *w.slot;
+                    TestResult result;
+                    result.test = tests[slot];
+                    if (!ready) {
+                        const auto d = deadline_of(w);
+                        if (!d || *d > now)
+                            continue;
+                        const auto limit =
+                            effective_timeout(*tests[slot], test_timeout);
+                        result.wall = now - w.started;
+                        kill_worker(w);
+                        result.status = TestResult::Status::TimedOut;
+                        result.message = "exceeded " + format_ms(limit);
+                    } else {
+                        std::uint8_t status = 0;
+                        std::int64_t metrics[6] = {};
+                        std::uint8_t stressed = 0;
+                        StressStats stress;
+                        std::uint8_t counted = 0;
+                        PerfStats perf;
+                        if (read_exact(w.res, &status, sizeof status) &&
+                            read_exact(w.res, metrics, sizeof metrics) &&
+                            read_exact(w.res, &stressed, sizeof stressed) &&
+                            (stressed == 0 ||
+                             read_exact(w.res, &stress, sizeof stress)) &&
+                            read_exact(w.res, &counted, sizeof counted) &&
+                            (counted == 0 ||
+                             read_exact(w.res, &perf, sizeof perf)) &&
+                            read_string(w.res, result.profile) &&
+                            read_string(w.res, result.message) &&
+                            read_string(w.res, result.output)) {
+                            result.status =
+                                static_cast<TestResult::Status>(status);
+                            result.wall = std::chrono::nanoseconds{metrics[0]};
+                            result.cpu = std::chrono::nanoseconds{metrics[1]};
+                            result.allocs.count =
+                                static_cast<std::uint64_t>(metrics[2]);
+                            result.allocs.bytes =
+                                static_cast<std::uint64_t>(metrics[3]);
+                            result.allocs.peak = metrics[4];
+                            result.allocs.leaked = metrics[5];
+                            if (stressed != 0)
+                                result.stress = stress;
+                            if (counted != 0)
+                                result.perf = perf;
+                            w.slot.reset();
+                        } else {
+                            result.wall = now - w.started;
+                            int exit_status = 0;
+                            while (::waitpid(w.pid, &exit_status, 0) < 0 &&
+                                   errno == EINTR) {
+                            }
+                            ::close(w.cmd);
+                            ::close(w.res);
+                            w = IsolatedWorker{};
+                            result.message = "test process " +
+                                             describe_exit(exit_status);
+                            result.status =
+                                tests[slot]->expect_fail
+                                    ? TestResult::Status::ExpectedFail
+                                    : TestResult::Status::Failed;
+                        }
+                    }
+                    ++done;
+                    on_result(slot, std::move(result));
+                    dispatch(w);
+                }
+            }
+
+            for (auto& w : pool)
+                stop_worker(w);
+            ::sigaction(SIGPIPE, &previous, nullptr);
+        }
+
+    }  // namespace detail
+#endif
+
+    // Assertion semantics:
+    // - REQUIRE / ASSERT abort the current test (see FAIL)
+    // - EXPECT records a failure and continues execution
+    // - All exceptions are caught by the runner
+    //
+    // Only the tests of the configured shard are run. With opts.jobs != 1
+    // they are spread over a work-stealing pool, with opts.isolate over a
+    // pool of forked processes. Either way each test's output is captured
+    // and handed to opts.reporters in the order of `tests`. Tests marked
+    // `serial` run afterwards, one at a time.
+    inline int run_tests(const std::vector<TestCase*>& all_tests,
+                         const RunOptions& opts) {
+        std::string selection_note;
+        ResultCache history;
+        const std::vector<TestCase*> selected =
+            detail::select_tests(all_tests, opts, selection_note, &history);
+
+        if (opts.list) {
+            std::string text;
+            for (const TestCase* test : selected) {
+                text += test->name;
+                if (*test->tags != '\0') {
+                    text += "  ";
+                    text += test->tags;
+                }
+                text += '\n';
+            }
+            text += std::to_string(selected.size()) + " matching tests\n";
+            if (opts.sink != nullptr) {
+                opts.sink->write(text);
+                opts.sink->flush();
+            } else {
+                std::cout << text << std::flush;
+            }
+            return 0;
+        }
+
+        std::vector<TestCase*> tests;
+        std::vector<TestCase*> benches;
+        for (TestCase* test : selected)
+            (test->is_benchmark() ? benches : tests).push_back(test);
+
+        // std::cout is routed for the whole run so tests' own output stays
+        // attached to their report.
+        detail::CoutRouting routing;
+        const detail::PropertyDefaultsScope property_defaults(opts.property);
+        const detail::PerfScope perf(opts.perf);
+        const detail::ProfileScope profiler(opts.profile);
+        const auto run_start = std::chrono::steady_clock::now();
+
+        std::optional<BufferedSink> console_sink;
+        std::optional<ConsoleReporter> console;
+        std::vector<Reporter*> receivers;
+        for (const auto& reporter : opts.reporters)
+            receivers.push_back(reporter.get());
+        if (receivers.empty()) {
+            OutputSink* sink = opts.sink;
+            if (sink == nullptr)
+                sink = &console_sink.emplace(routing.terminal());
+            receivers.push_back(
+                &console.emplace(*sink, opts.verbosity, opts.slowest));
+        }
+        detail::ReporterList reporter(std::move(receivers));
+
+        RunInfo info;
+        info.tests = tests.size();
+        info.benchmarks = opts.benchmarks ? benches.size() : 0;
+        info.selected = selected.size();
+        info.registered = all_tests.size();
+        info.shard_index = opts.shard_index;
+        info.shard_count = opts.shard_count;
+        reporter.run_start(info);
+        if (!selection_note.empty())
+            reporter.note(selection_note);
+        if (opts.perf) {
+            const detail::PerfSupport& support = detail::perf_support();
+            if (support.events == 0)
+                reporter.note("[WARN] performance counters unavailable (" +
+                              support.problem + ")");
+            else if (!support.hardware())
+                reporter.note("[WARN] hardware counters unavailable (" +
+                              support.problem +
+                              "); counting software events only");
+        }
+        if (!profiler.problem().empty())
+            reporter.note("[WARN] profiling disabled (" + profiler.problem() +
+                          ")");
+
+        bool isolate = opts.isolate;
+#if !NTEST_HAS_FORK
+        if (isolate) {
+            reporter.note(
+                "[WARN] process isolation is not supported on this "
+                "platform; running in-process");
+            isolate = false;
+        }
+#endif
+
+        const unsigned jobs = detail::resolve_jobs(opts.jobs);
+        std::vector<TestResult> results(tests.size());
+
+        bool any_timeout = opts.test_timeout.count() > 0;
+        for (const TestCase* test : tests)
+            any_timeout |= test->timeout.count() > 0;
+
+        detail::OrderedOutput ordered(tests.size(), [&](std::size_t i) {
+            TestResult& result = results[i];
+            for (const Failure& f : result.failures)
+                reporter.assertion_failure(*result.test, f);
+            reporter.test_end(result);
+            // Keep memory flat on long runs: only the summary fields stay.
+            std::string().swap(result.output);
+            std::vector<Failure>().swap(result.failures);
+        });
+        auto before_abort = [&] {
+            ordered.drain();
+            reporter.flush();
+        };
+        std::optional<detail::Watchdog> watchdog;
+        if (!isolate && (any_timeout || opts.run_timeout.count() > 0))
+            watchdog.emplace(opts.run_timeout, before_abort);
+
+        std::vector<std::size_t> parallel;
+        std::vector<std::size_t> serial;
+        std::map<detail::TestBatch*, std::vector<std::size_t>> batches;
+        for (std::size_t i = 0; i < tests.size(); ++i) {
+            if (tests[i]->batch != nullptr && !isolate)
+                batches[tests[i]->batch].push_back(i);
+            else
+                (tests[i]->serial && jobs > 1 ? serial : parallel).push_back(i);
+        }
+        if (jobs > 1 && !history.empty())
+            detail::order_by_cost(parallel, tests, history);
+
+        std::optional<std::chrono::steady_clock::time_point> deadline;
+        if (opts.run_timeout.count() > 0)
+            deadline = std::chrono::steady_clock::now() + opts.run_timeout;
+
+        // `kept` holds each test's last failure, or else its last result.
+        RunSummary summary;
+        std::vector<TestResult> kept(tests.size());
+        for (std::size_t round = 1;; ++round) {
+            if (opts.repeat != 1 || opts.until_fail) {
+                std::string note = "[ROUND] " + std::to_string(round);
+                if (opts.repeat != 0)
+                    note += " of " + std::to_string(opts.repeat);
+                reporter.note(note);
+            }
+            ordered.reset();
+            for (TestCase* test : tests) {
+                if (test->shared != nullptr)
+                    test->shared->expect_user();
+            }
+
+            if (isolate) {
+#if NTEST_HAS_FORK
+                auto started = [&](std::size_t i) {
+                    reporter.test_start(*tests[i]);
+                };
+                auto collect = [&](std::size_t i, TestResult result) {
+                    results[i] = std::move(result);
+                    ordered.publish(i);
+                };
+                detail::run_isolated(tests, parallel, jobs, opts.test_timeout,
+                                     deadline, started, collect, before_abort);
+                detail::run_isolated(tests, serial, 1, opts.test_timeout,
+                                     deadline, started, collect, before_abort);
+                // The workers used their own copies; drop this run's counts.
+                for (TestCase* test : tests) {
+                    if (test->shared != nullptr)
+                        test->shared->release();
+                }
+#endif
+            } else {
+                auto run_captured = [&](std::size_t i) {
+                    reporter.test_start(*tests[i]);
+                    std::string captured;
+                    std::string* const outer = detail::capture_target();
+                    detail::capture_target() = &captured;
+                    if (watchdog)
+                        watchdog->begin(i, *tests[i],
+                                        detail::effective_timeout(
+                                            *tests[i], opts.test_timeout));
+                    results[i] = run_test(*tests[i]);
+                    if (watchdog)
+                        watchdog->end(i);
+                    detail::capture_target() = outer;
+                    results[i].output = std::move(captured);
+                    ordered.publish(i);
+                };
+
+                for (auto& [batch, slots] : batches) {
+                    std::vector<const TestCase*> group;
+                    for (std::size_t i : slots)
+                        group.push_back(tests[i]);
+                    batch->run(
+                        group, opts.test_timeout,
+                        [&, &slots = slots](std::size_t k) {
+                            reporter.test_start(*tests[slots[k]]);
+                        },
+                        [&, &slots = slots](std::size_t k, TestResult result) {
+                            results[slots[k]] = std::move(result);
+                            ordered.publish(slots[k]);
+                        });
+                }
+                if (jobs == 1) {
+                    for (std::size_t i : parallel)
+                        run_captured(i);
+                } else {
+                    detail::run_work_stealing(parallel, jobs, run_captured);
+                }
+                for (std::size_t i : serial)
+                    run_captured(i);
+            }
+
+            bool round_failed = false;
+            for (std::size_t i = 0; i < tests.size(); ++i) {
+                if (results[i].ok()) {
+                    ++summary.passed;
+                } else {
+                    ++summary.failed;
+                    round_failed = true;
+                }
+                if (!results[i].ok() || kept[i].ok())
+                    kept[i] = std::move(results[i]);
+            }
+            if ((opts.until_fail && round_failed) ||
+                (opts.repeat != 0 && round >= opts.repeat))
+                break;
+        }
+        if (!opts.cache_file.empty())
+            detail::update_result_cache(opts.cache_file, kept);
+
+        if (opts.benchmarks && !benches.empty()) {
+            summary.failed += detail::run_benchmarks(
+                benches, opts.benchmark, summary.passed, reporter);
+        }
+
+        summary.wall = std::chrono::steady_clock::now() - run_start;
+        summary.results = &kept;
+        reporter.run_end(summary);
+        return summary.failed;
+    }
+
+    inline int run_all(const RunOptions& opts) {
+        return run_tests(REGISTRY(), opts);
+    }
+
+    namespace detail {
+        // Builds a reporter from a --reporter value, "NAME" or "NAME:FILE".
+        inline std::shared_ptr<Reporter> make_reporter(
+            const std::string& spec, const RunOptions& opts) {
+            const auto colon = spec.find(':');
+            const std::string name = spec.substr(0, colon);
+            const std::string path =
+                colon == std::string::npos ? "" : spec.substr(colon + 1);
+            if (name == "console")
+                return std::make_shared<ConsoleReporter>(
+                    open_output(path), opts.verbosity, opts.slowest);
+            if (name == "junit")
+                return std::make_shared<JUnitReporter>(open_output(path));
+            if (name == "jsonl")
+                return std::make_shared<JsonLinesReporter>(open_output(path));
+            if (name == "tap")
+                return std::make_shared<TapReporter>(open_output(path));
+            raise(std::invalid_argument("unknown reporter: " + name));
+        }
+    }  // namespace detail
+
+    // Options taken from the environment, overridden by any flags:
+    //   NTEST_SHARD_INDEX, NTEST_SHARD_COUNT, NTEST_SEED
+    inline RunOptions options_from_env() {
+        RunOptions opts;
+        if (const char* v = std::getenv("NTEST_SHARD_INDEX"))
+            opts.shard_index = detail::parse_unsigned("NTEST_SHARD_INDEX", v);
+        if (const char* v = std::getenv("NTEST_SHARD_COUNT"))
+            opts.shard_count = detail::parse_unsigned("NTEST_SHARD_COUNT", v);
+        if (const char* v = std::getenv("NTEST_SEED"))
+            opts.property.seed = detail::parse_u64("NTEST_SEED", v);
+        return opts;
+    }
+
+    // Parses runner flags on top of options_from_env():
+    //   PATTERN, --filter PATTERN  select tests; see TestFilter
+    //   --regex REGEX              select tests by regex on the name
+    //   --list                     print the selected tests and exit
+    //   --failed-first             run tests that failed last time first
+    //   --only-failed              run only tests that failed last time
+    //   --cache FILE               result cache (default .ntest-cache)
+    //   --no-cache                 neither read nor write the cache
+    //   -j N, -jN, --jobs N        worker threads (0 = one per core)
+    //   --isolate                  run tests in forked worker processes
+    //   --shard-index N            zero-based shard to run
+    //   --shard-count N            total number of shards
+    //   --balance-shards           split shards by cached durations
+    //   --timeout MS               default per-test timeout
+    //   --run-timeout MS           timeout for the whole run
+    //   --perf                     count cycles, cache misses, ... per
+    //                              test and per benchmark iteration
+    //   --profile DIR              write DIR/<test>.folded stack samples
+    //   --profile-threshold MS     only for tests taking at least MS
+    //   --profile-hz N             samples per CPU second (default 1000)
+    //   --slowest N                report the N slowest tests
+    //   --failures-only            report only failing tests
+    //   -q, --quiet                failing tests and the count line only
+    //   --reporter NAME[:FILE]     console, junit, jsonl or tap, written to
+    //                              FILE or stdout; repeat for several
+    //   --seed N                   seed for PROPERTY tests (0 = random)
+    //   --property-cases N         inputs generated per PROPERTY
+    //   --property-threads N       threads evaluating cases (0 = per core)
+    //   --benchmarks               also run BENCHMARK entries
+    //   --benchmark-samples N      samples recorded per benchmark
+    //   --benchmark-time MS        target duration of one sample
+    //   --benchmark-save FILE      write samples to a baseline file; implies
+    //                              --benchmarks, as does the next one
+    //   --benchmark-compare FILE   fail on regressions against a baseline
+    //   --benchmark-alpha P        significance level (default 0.05)
+    //   --benchmark-threshold PCT  minimum median slowdown (default 5)
+    // Throws std::invalid_argument on unknown flags or malformed values.
+    inline RunOptions parse_args(int argc, char** argv) {
+        RunOptions opts = options_from_env();
+        opts.cache_file = ".ntest-cache";
+        std::vector<std::string> reporters;
+        bool repeat_given = false;
+
+        for (int i = 1; i < argc; ++i) {
+            const std::string arg = argv[i];
+            std::string flag = arg;
+            std::optional<std::string> value;
+            const auto eq = arg.find('=');
+            if (arg.rfind("--", 0) == 0 && eq != std::string::npos) {
+                flag = arg.substr(0, eq);
+                value = arg.substr(eq + 1);
+            } else if (arg.size() > 2 && arg[0] == '-' && arg[1] != '-') {
+                flag = arg.substr(0, 2);  // -j8
+                value = arg.substr(2);
+            }
+            auto next_value = [&]() -> std::string {
+                if (value)
+                    return *value;
+                if (i + 1 >= argc)
+                    detail::raise(
+                        std::invalid_argument("missing value for " + flag));
+                return argv[++i];
+            };
+
+            if (!arg.empty() && arg[0] != '-') {
+                opts.filter.add(arg);
+            } else if (flag == "--filter") {
+                opts.filter.add(next_value());
+            } else if (flag == "--regex") {
+                opts.filter.add_regex(next_value());
+            } else if (flag == "--list") {
+                opts.list = true;
+            } else if (flag == "--failed-first") {
+                opts.failed_first = true;
+            } else if (flag == "--only-failed") {
+                opts.only_failed = true;
+            } else if (flag == "--cache") {
+                opts.cache_file = next_value();
+            } else if (flag == "--no-cache") {
+                opts.cache_file.clear();
+            } else if (flag == "-j" || flag == "--jobs") {
+                opts.jobs = detail::parse_unsigned(flag, next_value());
+            } else if (flag == "--isolate") {
+                opts.isolate = true;
+            } else if (flag == "--shard-index") {
+                opts.shard_index = detail::parse_unsigned(flag, next_value());
+            } else if (flag == "--shard-count") {
+                opts.shard_count = detail::parse_unsigned(flag, next_value());
+            } else if (flag == "--balance-shards") {
+                opts.balance_shards = true;
+            } else if (flag == "--timeout") {
+                opts.test_timeout = std::chrono::milliseconds(
+                    detail::parse_unsigned(flag, next_value()));
+            } else if (flag == "--run-timeout") {
+                opts.run_timeout = std::chrono::milliseconds(
+                    detail::parse_unsigned(flag, next_value()));
+            } else if (flag == "--perf") {
+                opts.perf = true;
+            } else if (flag == "--profile") {
+                opts.profile.dir = next_value();
+            } else if (flag == "--profile-threshold") {
+                opts.profile.threshold = std::chrono::milliseconds(
+                    detail::parse_unsigned(flag, next_value()));
+            } else if (flag == "--profile-hz") {
+                opts.profile.hz = detail::parse_unsigned(flag, next_value());
+            } else if (flag == "--slowest") {
+                opts.slowest = detail::parse_unsigned(flag, next_value());
+            } else if (flag == "--failures-only") {
+                opts.verbosity = Verbosity::FailuresOnly;
+            } else if (flag == "-q" || flag == "--quiet") {
+                opts.verbosity = Verbosity::Quiet;
+            } else if (flag == "--reporter") {
+                reporters.push_back(next_value());
+            } else if (flag == "--seed") {
+                opts.property.seed = detail::parse_u64(flag, next_value());
+            } else if (flag == "--property-cases") {
+                opts.property.cases = detail::parse_u64(flag, next_value());
+            } else if (flag == "--property-threads") {
+                opts.property.threads =
+                    detail::parse_unsigned(flag, next_value());
+            } else if (flag == "--repeat") {
+                opts.repeat = detail::parse_u64(flag, next_value());
+                repeat_given = true;
+            } else if (flag == "--until-fail") {
+                opts.until_fail = true;
+            } else if (flag == "--benchmarks") {
+                opts.benchmarks = true;
+            } else if (flag == "--benchmark-samples") {
+                opts.benchmark.samples =
+                    detail::parse_unsigned(flag, next_value());
+            } else if (flag == "--benchmark-time") {
+                opts.benchmark.sample_time = std::chrono::milliseconds(
+                    detail::parse_unsigned(flag, next_value()));
+            } else if (flag == "--benchmark-save") {
+                opts.benchmark.save_baseline = next_value();
+                opts.benchmarks = true;
+            } else if (flag == "--benchmark-compare") {
+                opts.benchmark.compare_baseline = next_value();
+                opts.benchmarks = true;
+            } else if (flag == "--benchmark-alpha") {
+                opts.benchmark.alpha = detail::parse_double(flag, next_value());
+            } else if (flag == "--benchmark-threshold") {
+                opts.benchmark.threshold =
+                    detail::parse_double(flag, next_value()) / 100;
+            } else {
+                detail::raise(
+                    std::invalid_argument("unknown option: " + arg));
+            }
+        }
+        if (opts.shard_count == 0 || opts.shard_index >= opts.shard_count)
+            detail::raise(std::invalid_argument(
+                "--shard-index must be less than --shard-count"));
+        // --until-fail alone keeps going until something fails.
+        if (opts.until_fail && !repeat_given)
+            opts.repeat = 0;
+        // Built last so the console sees the final verbosity.
+        for (const std::string& spec : reporters)
+            opts.reporters.push_back(detail::make_reporter(spec, opts));
+        return opts;
+    }
+
+    inline int run_all(int argc, char** argv) {
+        RunOptions opts;
+#if NTEST_EXCEPTIONS
+        try {
+            opts = parse_args(argc, argv);
+        } catch (const std::invalid_argument& e) {
+            std::cerr << NTEST_COLOR(red)(std::string("error: ") + e.what())
+                      << "\n";
+            return 1;
+        }
+#else
+        opts = parse_args(argc, argv);  // aborts on bad arguments
+#endif
+        return run_all(opts);
+    }
+
+    inline int run_all() { return run_all(0, nullptr); }
+
+}  // namespace NTest
+
+// =========================
+// Macros
+// =========================
+// TEST, TEST_EXPECT_FAIL, TEST_TIMEOUT, TEST_SERIAL and the plain
+// assertions live in NTestCore.h.
+
+// A fresh `fixture` is constructed for the test and destroyed after it;
+// the body runs as a member of a class derived from it:
+//   TEST_F(ParserTest, ParsesEmptyInput) { REQUIRE(parse("").empty()); }
+#define TEST_F(...) NTEST_EXPAND_(NTEST_TEST_F_(__VA_ARGS__, "", ~))
+#define NTEST_TEST_F_(fixture, name, tags, ...)                 \
+    namespace {                                                 \
+        struct _ntest_fixture_##name : fixture {                \
+            void body();                                        \
+        };                                                      \
+    }                                                           \
+    static void name() {                                        \
+        NTest::detail::run_fixture<_ntest_fixture_##name>();    \
+    }                                                           \
+    NTEST_REGISTER_(name, tags, NTest::TestFlags::None, 0);     \
+    void _ntest_fixture_##name::body()
+
+// The body receives `fixture& shared`, one instance reused by every
+// TEST_SHARED test of that type: built when the first of them needs it and
+// destroyed after the last one of the run ends. See NTest::shared().
+#define TEST_SHARED(...) NTEST_EXPAND_(NTEST_TEST_SHARED_(__VA_ARGS__, "", ~))
+#define NTEST_TEST_SHARED_(fixture, name, tags, ...)                         \
+    static void name(fixture& shared);                                       \
+    static void _ntest_shared_##name() { name(NTest::shared<fixture>()); }   \
+    static NTest::TestCase _ntest_##name(                                    \
+        #name, _ntest_shared_##name, __FILE__, __LINE__,                     \
+        NTest::TestFlags::None, 0, tags,                                     \
+        &NTest::detail::shared_slot<fixture>);                               \
+    static const NTest::detail::Registrar _ntest_registrar_##name(           \
+        _ntest_##name);                                                      \
+    static void name([[maybe_unused]] fixture& shared)
+
+// Runs the body once per record of the memory-mapped file at `path`; it
+// receives `const T& record`, where T is Record for fixed-size records and
+// std::string_view for Lines / Delimited<c> (see check_records):
+//   TEST_DATA(GoldenSums, "golden/sums.bin", Entry) { REQUIRE(...); }
+#define TEST_DATA(...) NTEST_EXPAND_(NTEST_TEST_DATA_(__VA_ARGS__, "", ~))
+#define NTEST_TEST_DATA_(name, path, Record, tags, ...)                     \
+    static void name(const NTest::detail::record_t<Record>& record);        \
+    static void _ntest_data_##name() {                                      \
+        NTest::check_data<Record>(path, name);                              \
+    }                                                                       \
+    static NTest::TestCase _ntest_##name(#name, _ntest_data_##name,         \
+                                         __FILE__, __LINE__,                \
+                                         NTest::TestFlags::None, 0, tags);  \
+    static const NTest::detail::Registrar _ntest_registrar_##name(          \
+        _ntest_##name);                                                     \
+    static void name(const NTest::detail::record_t<Record>& record)
+
+// Runs the body `iterations` times on each of `threads` threads at once;
+// it receives `const NTest::StressState& stress` (see check_stress):
+//   TEST_STRESS(QueueSurvivesContention, 8, 100000) { queue.push(1); }
+#define TEST_STRESS(...) NTEST_EXPAND_(NTEST_TEST_STRESS_(__VA_ARGS__, "", ~))
+#define NTEST_TEST_STRESS_(name, threads, iterations, tags, ...)            \
+    static void name(const NTest::StressState& stress);                     \
+    static void _ntest_stress_##name() {                                    \
+        NTest::check_stress((threads), (iterations), name);                 \
+    }                                                                       \
+    static NTest::TestCase _ntest_##name(#name, _ntest_stress_##name,       \
+                                         __FILE__, __LINE__,                \
+                                         NTest::TestFlags::None, 0, tags);  \
+    static const NTest::detail::Registrar _ntest_registrar_##name(          \
+        _ntest_##name);                                                     \
+    static void name([[maybe_unused]] const NTest::StressState& stress)
+
+// Body receives `NTest::BenchmarkState& state`; see BenchmarkState.
+#define BENCHMARK(...) NTEST_EXPAND_(NTEST_BENCHMARK_(__VA_ARGS__, "", ~))
+#define NTEST_BENCHMARK_(name, tags, ...)                                 \
+    static void name(NTest::BenchmarkState& state);                      \
+    static NTest::TestCase _ntest_##name(#name, name, __FILE__, __LINE__, \
+                                         tags);                           \
+    static const NTest::detail::Registrar _ntest_registrar_##name(       \
+        _ntest_##name);                                                  \
+    static void name([[maybe_unused]] NTest::BenchmarkState& state)
+
+// Runs the body once per input size from lo to hi, doubling each time;
+// the body reads the size from state.range(). The median times are
+// fitted to the Complexity models and the best fit is reported.
+#define BENCHMARK_RANGE(...) \
+    NTEST_EXPAND_(NTEST_BENCHMARK_RANGE_(__VA_ARGS__, "", ~))
+#define NTEST_BENCHMARK_RANGE_(name, lo, hi, tags, ...)                   \
+    static void name(NTest::BenchmarkState& state);                      \
+    static NTest::TestCase _ntest_##name(#name, name, __FILE__, __LINE__, \
+                                         tags, lo, hi);                   \
+    static const NTest::detail::Registrar _ntest_registrar_##name(       \
+        _ntest_##name);                                                  \
+    static void name([[maybe_unused]] NTest::BenchmarkState& state)
+
+// Checks the body on inputs drawn from the generators, shrinking the
+// first failing input to a minimal one before reporting it. The body's
+// parameters are the generators' value types, taken by value:
+//   PROPERTY(ReverseTwice, NTest::gen::vectors(NTest::gen::ints()))
+//   (std::vector<int> v) { ... }
+#define PROPERTY(name, ...)                                                \
+    static NTest::detail::property_signature_t<decltype(std::make_tuple(   \
+        __VA_ARGS__))>                                                     \
+        name;                                                              \
+    static void _ntest_property_##name() {                                 \
+        NTest::check_property(name, __VA_ARGS__);                          \
+    }                                                                      \
+    static NTest::TestCase _ntest_##name(#name, _ntest_property_##name,    \
+                                         __FILE__, __LINE__);              \
+    static const NTest::detail::Registrar _ntest_registrar_##name(         \
+        _ntest_##name);                                                    \
+    static void name
+
+// ----- Allocation assertions -----
+// Need NTEST_TRACK_ALLOCATIONS; otherwise they fail with a hint. Only
+// allocations made by the calling thread while evaluating `expr` count.
+
+#define REQUIRE_MAX_ALLOCS(n, expr)                                          \
+    do {                                                                     \
+        if (!NTest::allocation_tracking_enabled())                           \
+            NTest::detail::fail_untracked(#expr, __FILE__, __LINE__);        \
+        NTest::AllocationScope _heap;                                        \
+        expr;                                                                \
+        NTest::detail::check_max_allocs(_heap.stats(), (n), #expr, __FILE__, \
+                                        __LINE__);                           \
+    } while (0)
+
+#define REQUIRE_NO_ALLOC(expr) REQUIRE_MAX_ALLOCS(0, expr)
+
+// ----- Performance budgets -----
+// `expr` is evaluated repeatedly; see detail::time_budget. Its value, if
+// any, goes to DoNotOptimize. For REQUIRE_THROUGHPUT_AT_LEAST it must
+// yield the bytes or items one evaluation processed. RSS is process-wide:
+// use TEST_SERIAL or --isolate so that other tests do not grow it at the
+// same time.
+
+#define REQUIRE_FASTER_THAN(limit, expr)                                  \
+    do {                                                                  \
+        NTest::detail::check_faster_than(                                 \
+            std::chrono::duration_cast<std::chrono::nanoseconds>(limit),  \
+            [&] {                                                         \
+                NTest::detail::sink_result(                               \
+                    [&]() -> decltype(auto) { return expr; });            \
+                return 1.0;                                               \
+            },                                                            \
+            #expr, __FILE__, __LINE__);                                   \
+    } while (0)
+
+#define REQUIRE_THROUGHPUT_AT_LEAST(per_second, expr)                     \
+    do {                                                                  \
+        NTest::detail::check_throughput(                                  \
+            static_cast<double>(per_second),                              \
+            [&] { return static_cast<double>(expr); }, #expr, __FILE__,   \
+            __LINE__);                                                    \
+    } while (0)
+
+// Inside a BENCHMARK_RANGE body: fail the benchmark if the best fit
+// grows faster than `bound`, one of O_1, O_LOG_N, O_N, O_N_LOG_N and
+// O_N_SQUARED.
+#define REQUIRE_COMPLEXITY_AT_MOST(bound)                                 \
+    state.require_complexity_at_most(NTest::Complexity::bound,            \
+                                     "complexity <= " #bound, __FILE__,   \
+                                     __LINE__)
+
+#define REQUIRE_MAX_RSS_GROWTH(bytes, expr)                               \
+    do {                                                                  \
+        const NTest::detail::RssSample _rss = NTest::detail::rss_now();   \
+        expr;                                                             \
+        NTest::detail::check_rss_growth(_rss,                             \
+                                        static_cast<std::int64_t>(bytes), \
+                                        #expr, __FILE__, __LINE__);       \
+    } while (0)
+
+// ----- Bulk assertions -----
+// Compare contiguous ranges (anything std::data and std::size accept)
+// with vector kernels where available, then report the first mismatch
+// and how many there are. REQUIRE_ARRAY_EQ uses the elements' ==;
+// REQUIRE_BYTES_EQ takes NTest::bytes(ptr, n) for raw buffers, and
+// REQUIRE_ALL_NEAR a Tolerance:
+//   REQUIRE_ALL_NEAR(out, ref, NTest::Tolerance::ulp(4));
+
+#define REQUIRE_BYTES_EQ(actual, expected)                                \
+    do {                                                                  \
+        NTest::detail::check_bytes_eq((actual), (expected),               \
+                                      #actual " == " #expected, __FILE__, \
+                                      __LINE__);                          \
+    } while (0)
+
+#define REQUIRE_ARRAY_EQ(actual, expected)                                \
+    do {                                                                  \
+        NTest::detail::check_array_eq((actual), (expected),               \
+                                      #actual " == " #expected, __FILE__, \
+                                      __LINE__);                          \
+    } while (0)
+
+#define REQUIRE_ALL_NEAR(actual, expected, tolerance)                     \
+    do {                                                                  \
+        NTest::detail::check_all_near((actual), (expected), (tolerance),  \
+                                      #actual " ~= " #expected, __FILE__, \
+                                      __LINE__);                          \
+    } while (0)
+
+// =========================
+// Compiled assertion reporting
+// =========================
+// Define NTEST_IMPLEMENTATION in exactly one translation unit (usually the
+// one with main) before including NTest.h when other files include only
+// NTestCore.h. src/main.cpp, built as the ntest_main library, does this.
+#ifdef NTEST_IMPLEMENTATION
+namespace NTest::detail {
+    void fail_compiled(const char* expr, const char* file, int line,
+                       const char* msg) {
+        FAIL(expr, file, line, msg);
+    }
+
+    void expect_failed_compiled(const char* expr, const char* file, int line,
+                                const char* msg) {
+        expect_failed(expr, file, line, msg);
+    }
+}  // namespace NTest::detail
+#endif  // NTEST_IMPLEMENTATION
+
+// =========================
+// Allocation hooks
+// =========================
+// Define NTEST_TRACK_ALLOCATIONS in exactly one translation unit (usually
+// the one with main) before including NTest.h to replace the global
+// allocation functions with counting versions.
+#ifdef NTEST_TRACK_ALLOCATIONS
+#include <cstddef>
+#include <new>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+namespace NTest::detail {
+    // Every block carries its size and the distance back to the pointer
+    // returned by the system allocator in the two words before it.
+    constexpr std::size_t kAllocHeader = alignof(std::max_align_t) >= 16
+                                             ? alignof(std::max_align_t)
+                                             : 16;
+
+    inline void* tracked_alloc(std::size_t size, std::size_t align) {
+        const std::size_t header = align > kAllocHeader ? align : kAllocHeader;
+        void* base = nullptr;
+        if (align <= alignof(std::max_align_t)) {
+            base = std::malloc(size + header);
+        } else {
+#ifdef _WIN32
+            base = _aligned_malloc(size + header, align);
+#else
+            if (::posix_memalign(&base, align, size + header) != 0)
+                base = nullptr;
+#endif
+        }
+        if (base == nullptr)
+            return nullptr;
+        char* user = static_cast<char*>(base) + header;
+        reinterpret_cast<std::size_t*>(user)[-1] = size;
+        reinterpret_cast<std::size_t*>(user)[-2] = header;
+        record_alloc(size);
+        return user;
+    }
+
+    inline void tracked_free(void* ptr, std::size_t align) {
+        if (ptr == nullptr)
+            return;
+        char* user = static_cast<char*>(ptr);
+        const std::size_t size = reinterpret_cast<std::size_t*>(user)[-1];
+        const std::size_t header = reinterpret_cast<std::size_t*>(user)[-2];
+        record_free(size);
+#ifdef _WIN32
+        if (align > alignof(std::max_align_t)) {
+            _aligned_free(user - header);
+            return;
+        }
+#else
+        (void)align;
+#endif
+        std::free(user - header);
+    }
+
+    inline void* tracked_new(std::size_t size, std::size_t align) {
+        for (;;) {
+            if (void* p = tracked_alloc(size, align))
+                return p;
+            std::new_handler handler = std::get_new_handler();
+            if (handler == nullptr)
+                throw std::bad_alloc();
+            handler();
+        }
+    }
 
-#define ASSERT_TRUE(cond) REQUIRE(cond)
-#define ASSERT_FALSE(cond) REQUIRE(!(cond))
+    static const bool alloc_hooks_registered =
+        (alloc_hooks_installed = true, true);
+}  // namespace NTest::detail
 
-#define ASSERT_EQ(a, b) REQUIRE_EQ(a, b)
-#define ASSERT_NE(a, b) REQUIRE_NE(a, b)
+void* operator new(std::size_t size) {
+    return NTest::detail::tracked_new(size, alignof(std::max_align_t));
+}
+void* operator new[](std::size_t size) {
+    return NTest::detail::tracked_new(size, alignof(std::max_align_t));
+}
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    return NTest::detail::tracked_alloc(size, alignof(std::max_align_t));
+}
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+    return NTest::detail::tracked_alloc(size, alignof(std::max_align_t));
+}
+void* operator new(std::size_t size, std::align_val_t align) {
+    return NTest::detail::tracked_new(size, static_cast<std::size_t>(align));
+}
+void* operator new[](std::size_t size, std::align_val_t align) {
+    return NTest::detail::tracked_new(size, static_cast<std::size_t>(align));
+}
 
-#define ASSERT_LT(a, b) REQUIRE((a) < (b))
-#define ASSERT_GT(a, b) REQUIRE((a) > (b))
-#define ASSERT_LE(a, b) REQUIRE((a) <= (b))
-#define ASSERT_GE(a, b) REQUIRE((a) >= (b))
+void operator delete(void* ptr) noexcept {
+    NTest::detail::tracked_free(ptr, alignof(std::max_align_t));
+}
+void operator delete[](void* ptr) noexcept {
+    NTest::detail::tracked_free(ptr, alignof(std::max_align_t));
+}
+void operator delete(void* ptr, std::size_t) noexcept {
+    NTest::detail::tracked_free(ptr, alignof(std::max_align_t));
+}
+void operator delete[](void* ptr, std::size_t) noexcept {
+    NTest::detail::tracked_free(ptr, alignof(std::max_align_t));
+}
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    NTest::detail::tracked_free(ptr, alignof(std::max_align_t));
+}
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+    NTest::detail::tracked_free(ptr, alignof(std::max_align_t));
+}
+void operator delete(void* ptr, std::align_val_t align) noexcept {
+    NTest::detail::tracked_free(ptr, static_cast<std::size_t>(align));
+}
+void operator delete[](void* ptr, std::align_val_t align) noexcept {
+    NTest::detail::tracked_free(ptr, static_cast<std::size_t>(align));
+}
+void operator delete(void* ptr, std::size_t, std::align_val_t align) noexcept {
+    NTest::detail::tracked_free(ptr, static_cast<std::size_t>(align));
+}
+void operator delete[](void* ptr, std::size_t,
+                       std::align_val_t align) noexcept {
+    NTest::detail::tracked_free(ptr, static_cast<std::size_t>(align));
+}
+#endif  // NTEST_TRACK_ALLOCATIONS
 
 #endif  // NTEST_UNIT_H
\ No newline at end of file
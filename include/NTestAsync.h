@@ -0,0 +1,587 @@
+/**
+ * @file NTestAsync.h
+ * @author NoahGWood
+ * @brief ASYNC_TEST: coroutine test bodies sharing one event loop
+ * @version 0.2
+ * @date 2025-04-15
+ *
+ * Needs C++20 coroutines, exceptions and a POSIX platform. ASYNC_TESTs of
+ * a run are started together and interleaved on one thread whenever they
+ * co_await a timer or a file descriptor, so I/O-bound cases overlap their
+ * waits instead of queueing for worker threads.
+ */
+#ifndef NTEST_ASYNC_H
+#define NTEST_ASYNC_H
+
+#include <NTest.h>
+
+#if !defined(__cpp_impl_coroutine) || __cpp_impl_coroutine < 201902L
+#error "NTestAsync.h needs C++20 coroutines (-std=c++20)"
+#endif
+#if !NTEST_EXCEPTIONS
+#error "NTestAsync.h needs exceptions"
+#endif
+#if !NTEST_HAS_FORK
+#error "NTestAsync.h needs a POSIX platform"
+#endif
+
+#include <coroutine>
+#include <exception>
+#include <list>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#define NTEST_HAS_EPOLL 1
+#else
+#define NTEST_HAS_EPOLL 0
+#endif
+
+namespace NTest {
+    template <typename T = void>
+    class Task;
+
+    namespace detail {
+        struct TaskPromiseBase {
+            std::coroutine_handle<> continuation;  // awaiting coroutine
+            std::exception_ptr error;
+
+            struct FinalAwaiter {
+                bool await_ready() const noexcept { return false; }
+                template <typename P>
+                std::coroutine_handle<> await_suspend(
+                    std::coroutine_handle<P> done) noexcept {
+                    std::coroutine_handle<> next =
+                        done.promise().continuation;
+                    return next ? next : std::noop_coroutine();
+                }
+                void await_resume() const noexcept {}
+            };
+
+            std::suspend_always initial_suspend() const noexcept {
+                return {};
+            }
+            FinalAwaiter final_suspend() const noexcept { return {}; }
+            void unhandled_exception() { error = std::current_exception(); }
+        };
+
+        template <typename T>
+        struct TaskPromise : TaskPromiseBase {
+            std::optional<T> value;
+
+            Task<T> get_return_object();
+            template <typename U>
+            void return_value(U&& v) {
+                value.emplace(std::forward<U>(v));
+            }
+        };
+
+        template <>
+        struct TaskPromise<void> : TaskPromiseBase {
+            Task<void> get_return_object();
+            void return_void() const noexcept {}
+        };
+    }  // namespace detail
+
+    // =========================
+    // Tasks
+    // =========================
+
+    // A lazily started coroutine. co_await runs it to completion and
+    // yields its value, rethrowing whatever escaped it (so REQUIRE in a
+    // helper stops the whole test, as it does in a plain function).
+    template <typename T>
+    class [[nodiscard]] Task {
+    public:
+        using promise_type = detail::TaskPromise<T>;
+        using Handle = std::coroutine_handle<promise_type>;
+
+        Task() = default;
+        explicit Task(Handle handle) : handle_(handle) {}
+        Task(Task&& other) noexcept
+            : handle_(std::exchange(other.handle_, {})) {}
+        Task& operator=(Task&& other) noexcept {
+            if (this != &other) {
+                if (handle_)
+                    handle_.destroy();
+                handle_ = std::exchange(other.handle_, {});
+            }
+            return *this;
+        }
+        ~Task() {
+            if (handle_)
+                handle_.destroy();
+        }
+
+        bool await_ready() const noexcept { return !handle_ || handle_.done(); }
+        std::coroutine_handle<> await_suspend(
+            std::coroutine_handle<> caller) noexcept {
+            handle_.promise().continuation = caller;
+            return handle_;
+        }
+        T await_resume() {
+            promise_type& p = handle_.promise();
+            if (p.error)
+                std::rethrow_exception(p.error);
+            if constexpr (!std::is_void_v<T>)
+                return std::move(*p.value);
+        }
+
+        Handle handle() const { return handle_; }
+
+    private:
+        Handle handle_;
+    };
+
+    namespace detail {
+        template <typename T>
+        Task<T> TaskPromise<T>::get_return_object() {
+            return Task<T>(Task<T>::Handle::from_promise(*this));
+        }
+
+        inline Task<void> TaskPromise<void>::get_return_object() {
+            return Task<void>(Task<void>::Handle::from_promise(*this));
+        }
+
+        inline constexpr const char* kStalledMessage =
+            "ASYNC_TEST suspended without a timer or fd to wait for";
+
+        // One running ASYNC_TEST: its root coroutine and where its
+        // failures, output and resource usage go while it is resumed.
+        struct AsyncTest {
+            Task<> task;
+            TestContext* ctx = nullptr;   // null: report as the caller does
+            std::string* output = nullptr;
+            std::chrono::steady_clock::time_point start;
+            std::chrono::steady_clock::time_point deadline =
+                std::chrono::steady_clock::time_point::max();
+            std::chrono::nanoseconds cpu{0};
+            AllocationStats allocs;  // count and bytes only
+            bool finished = false;
+            bool timed_out = false;
+            bool stalled = false;  // suspended with nothing to resume it
+        };
+
+        // Resumes coroutines when their timer expires or their descriptor
+        // becomes ready. Single-threaded; lives for one batch.
+        class EventLoop {
+        public:
+            using clock = std::chrono::steady_clock;
+
+            EventLoop() {
+#if NTEST_HAS_EPOLL
+                epoll_ = ::epoll_create1(EPOLL_CLOEXEC);
+                if (epoll_ < 0)
+                    raise(std::runtime_error("epoll_create1 failed"));
+#endif
+            }
+            ~EventLoop() {
+                for (const FdWait& w : fds_)
+                    ::close(w.fd);
+#if NTEST_HAS_EPOLL
+                ::close(epoll_);
+#endif
+            }
+            EventLoop(const EventLoop&) = delete;
+            EventLoop& operator=(const EventLoop&) = delete;
+
+            void at(clock::time_point when, std::coroutine_handle<> h) {
+                timers_.emplace(when, Wait{running_, h});
+            }
+
+            // Waits on a duplicate of `fd`, so the caller may close its
+            // own while a cancelled test's wait is still registered.
+            void when_ready(int fd, bool write, std::coroutine_handle<> h) {
+                const int watched = ::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+                if (watched < 0)
+                    abort_current("cannot wait on fd " + std::to_string(fd) +
+                                  ": " + std::strerror(errno));
+                fds_.push_back(FdWait{Wait{running_, h}, watched, write});
+#if NTEST_HAS_EPOLL
+                epoll_event ev{};
+                ev.events = write ? EPOLLOUT : EPOLLIN;
+                ev.data.ptr = &fds_.back();
+                if (::epoll_ctl(epoll_, EPOLL_CTL_ADD, watched, &ev) != 0) {
+                    // Regular files cannot be polled; they are always
+                    // ready.
+                    fds_.pop_back();
+                    ::close(watched);
+                    ready_.push_back(Wait{running_, h});
+                }
+#endif
+            }
+
+            // Resumes the tests' root coroutines and everything they wait
+            // for until all have finished, timed out or stalled, calling
+            // finished() for each as soon as it does. A test stalls when
+            // nothing is left that could resume it.
+            template <typename OnFinish>
+            void run(const std::vector<AsyncTest*>& tests,
+                     const OnFinish& finished) {
+                std::size_t remaining = tests.size();
+                for (AsyncTest* t : tests)
+                    ready_.push_back(Wait{t, t->task.handle()});
+                while (remaining > 0) {
+                    while (!ready_.empty()) {
+                        const Wait w = ready_.front();
+                        ready_.pop_front();
+                        if (w.owner->finished)
+                            continue;
+                        resume(*w.owner, w.handle);
+                        if (w.owner->task.handle().done()) {
+                            w.owner->finished = true;
+                            --remaining;
+                            finished(*w.owner);
+                        }
+                    }
+                    if (remaining == 0)
+                        break;
+
+                    clock::time_point wake = clock::time_point::max();
+                    if (!timers_.empty())
+                        wake = timers_.begin()->first;
+                    const clock::time_point now = clock::now();
+                    for (AsyncTest* t : tests) {
+                        if (t->finished)
+                            continue;
+                        if (t->deadline <= now) {
+                            cancel(*t);
+                            t->timed_out = true;
+                            t->finished = true;
+                            --remaining;
+                            finished(*t);
+                        } else {
+                            wake = std::min(wake, t->deadline);
+                        }
+                    }
+                    if (remaining == 0)
+                        break;
+                    if (wake == clock::time_point::max() && fds_.empty()) {
+                        for (AsyncTest* t : tests) {
+                            if (t->finished)
+                                continue;
+                            cancel(*t);
+                            t->stalled = true;
+                            t->finished = true;
+                            finished(*t);
+                        }
+                        break;
+                    }
+                    wait(wake);
+                }
+            }
+
+            // The loop and test being resumed on this thread, if any.
+            static EventLoop*& current() {
+                thread_local EventLoop* loop = nullptr;
+                return loop;
+            }
+
+        private:
+            struct Wait {
+                AsyncTest* owner;
+                std::coroutine_handle<> handle;
+            };
+            struct FdWait {
+                Wait wait;
+                int fd;
+                bool write;
+            };
+
+            void resume(AsyncTest& owner, std::coroutine_handle<> h) {
+                std::optional<ContextScope> scope;
+                if (owner.ctx != nullptr)
+                    scope.emplace(*owner.ctx);
+                std::string* const outer =
+                    std::exchange(capture_target(), owner.output);
+                EventLoop* const outer_loop = std::exchange(current(), this);
+                AsyncTest* const outer_test = std::exchange(running_, &owner);
+                const AllocCounters heap = alloc_counters;
+                const auto cpu_start = thread_cpu_time();
+
+                h.resume();
+
+                owner.cpu += thread_cpu_time() - cpu_start;
+                owner.allocs.count += alloc_counters.count - heap.count;
+                owner.allocs.bytes += alloc_counters.bytes - heap.bytes;
+                running_ = outer_test;
+                current() = outer_loop;
+                capture_target() = outer;
+            }
+
+            // Destroys a timed-out test's coroutines and forgets its waits.
+            void cancel(AsyncTest& owner) {
+                for (auto it = timers_.begin(); it != timers_.end();) {
+                    if (it->second.owner == &owner)
+                        it = timers_.erase(it);
+                    else
+                        ++it;
+                }
+                for (auto it = fds_.begin(); it != fds_.end();) {
+                    if (it->wait.owner == &owner) {
+#if NTEST_HAS_EPOLL
+                        ::epoll_ctl(epoll_, EPOLL_CTL_DEL, it->fd, nullptr);
+#endif
+                        ::close(it->fd);
+                        it = fds_.erase(it);
+                    } else {
+                        ++it;
+                    }
+                }
+                // Locals of the test's frames are destroyed as if resumed.
+                std::optional<ContextScope> scope;
+                if (owner.ctx != nullptr)
+                    scope.emplace(*owner.ctx);
+                std::string* const outer =
+                    std::exchange(capture_target(), owner.output);
+                owner.task = Task<>();
+                capture_target() = outer;
+            }
+
+            // Sleeps until `wake` or a descriptor is ready, then queues
+            // everything that is due.
+            void wait(clock::time_point wake) {
+                int timeout_ms = -1;
+                if (wake != clock::time_point::max()) {
+                    const auto left = wake - clock::now();
+                    // Round up so timers never wake the loop early.
+                    timeout_ms = static_cast<int>(std::max<long long>(
+                        0, std::chrono::ceil<std::chrono::milliseconds>(left)
+                               .count()));
+                }
+#if NTEST_HAS_EPOLL
+                epoll_event events[64];
+                const int n = ::epoll_wait(epoll_, events, 64, timeout_ms);
+                for (int i = 0; i < n; ++i) {
+                    auto* w = static_cast<FdWait*>(events[i].data.ptr);
+                    ::epoll_ctl(epoll_, EPOLL_CTL_DEL, w->fd, nullptr);
+                    ready_.push_back(w->wait);
+                    ::close(w->fd);
+                    fds_.remove_if([w](const FdWait& f) { return &f == w; });
+                }
+#else
+                std::vector<pollfd> polled;
+                for (const FdWait& w : fds_)
+                    polled.push_back(
+                        pollfd{w.fd, short(w.write ? POLLOUT : POLLIN), 0});
+                const int n = ::poll(polled.data(), polled.size(), timeout_ms);
+                if (n > 0) {
+                    auto it = fds_.begin();
+                    for (const pollfd& p : polled) {
+                        if (p.revents != 0) {
+                            ready_.push_back(it->wait);
+                            ::close(it->fd);
+                            it = fds_.erase(it);
+                        } else {
+                            ++it;
+                        }
+                    }
+                }
+#endif
+                const clock::time_point now = clock::now();
+                while (!timers_.empty() && timers_.begin()->first <= now) {
+                    ready_.push_back(timers_.begin()->second);
+                    timers_.erase(timers_.begin());
+                }
+            }
+
+            std::multimap<clock::time_point, Wait> timers_;
+            std::list<FdWait> fds_;  // stable addresses for epoll data.ptr
+            std::deque<Wait> ready_;
+            AsyncTest* running_ = nullptr;
+#if NTEST_HAS_EPOLL
+            int epoll_ = -1;
+#endif
+        };
+
+        inline EventLoop& event_loop() {
+            EventLoop* loop = EventLoop::current();
+            if (loop == nullptr)
+                abort_current("NTest awaitables only work inside ASYNC_TEST");
+            return *loop;
+        }
+
+        struct FdAwaiter {
+            int fd;
+            bool write;
+
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> h) const {
+                event_loop().when_ready(fd, write, h);
+            }
+            void await_resume() const noexcept {}
+        };
+    }  // namespace detail
+
+    // =========================
+    // Awaitables
+    // =========================
+
+    // co_await NTest::sleep_for(20ms): lets the other async tests run.
+    inline auto sleep_for(std::chrono::nanoseconds duration) {
+        struct SleepAwaiter {
+            std::chrono::steady_clock::time_point when;
+
+            bool await_ready() const noexcept {
+                return when <= std::chrono::steady_clock::now();
+            }
+            void await_suspend(std::coroutine_handle<> h) const {
+                detail::event_loop().at(when, h);
+            }
+            void await_resume() const noexcept {}
+        };
+        return SleepAwaiter{std::chrono::steady_clock::now() + duration};
+    }
+
+    // co_await NTest::readable(fd) / writable(fd): resumes once the
+    // descriptor is ready (or has hung up or failed; the next read or
+    // write reports which).
+    inline detail::FdAwaiter readable(int fd) {
+        return detail::FdAwaiter{fd, false};
+    }
+    inline detail::FdAwaiter writable(int fd) {
+        return detail::FdAwaiter{fd, true};
+    }
+
+    // Runs one async test body to completion on a loop of its own,
+    // rethrowing whatever it threw. This is the TestCase::func of every
+    // ASYNC_TEST, used when it runs outside its batch (--isolate).
+    inline void run_async(Task<> (*body)()) {
+        detail::EventLoop loop;
+        detail::AsyncTest test;
+        test.ctx = detail::current_context();
+        test.output = detail::capture_target();
+        test.task = body();
+        loop.run({&test}, [](detail::AsyncTest&) {});
+        if (test.stalled)
+            detail::abort_current(detail::kStalledMessage);
+        if (test.task.handle().promise().error)
+            std::rethrow_exception(test.task.handle().promise().error);
+    }
+
+    namespace detail {
+        // Runs every selected ASYNC_TEST of the run on one event loop.
+        class AsyncBatch : public TestBatch {
+        public:
+            using Body = Task<> (*)();
+
+            void add(const TestCase& test, Body body) {
+                bodies_[&test] = body;
+            }
+
+            void run(const std::vector<const TestCase*>& tests,
+                     std::chrono::milliseconds default_timeout,
+                     const Started& started, const Done& done) override {
+                struct State {
+                    AsyncTest async;
+                    TestContext ctx;
+                    std::string output;
+                };
+                std::vector<std::unique_ptr<State>> states;
+                std::vector<AsyncTest*> running;
+                std::map<const AsyncTest*, std::size_t> index;
+                for (std::size_t k = 0; k < tests.size(); ++k) {
+                    started(k);
+                    auto state = std::make_unique<State>();
+                    AsyncTest& t = state->async;
+                    t.ctx = &state->ctx;
+                    t.output = &state->output;
+                    t.start = EventLoop::clock::now();
+                    const auto timeout =
+                        effective_timeout(*tests[k], default_timeout);
+                    if (timeout.count() > 0)
+                        t.deadline = t.start + timeout;
+                    t.task = bodies_.at(tests[k])();
+                    index[&t] = k;
+                    running.push_back(&t);
+                    states.push_back(std::move(state));
+                }
+
+                EventLoop loop;
+                loop.run(running, [&](AsyncTest& t) {
+                    const std::size_t k = index.at(&t);
+                    const TestCase& test = *tests[k];
+                    State& state = *states[k];
+                    TestResult result;
+                    result.test = &test;
+                    result.wall = EventLoop::clock::now() - t.start;
+                    result.cpu = t.cpu;
+                    result.allocs = t.allocs;
+                    bool completed = false;
+                    if (t.timed_out) {
+                        result.status = TestResult::Status::TimedOut;
+                        result.message =
+                            "exceeded " +
+                            format_ms(effective_timeout(test, default_timeout));
+                    } else if (t.stalled) {
+                        result.status = test.expect_fail
+                                            ? TestResult::Status::ExpectedFail
+                                            : TestResult::Status::Failed;
+                        result.message = kStalledMessage;
+                    } else {
+                        std::exception_ptr error =
+                            t.task.handle().promise().error;
+                        completed = invoke_guarded(state.ctx, [&] {
+                            if (error)
+                                std::rethrow_exception(error);
+                        });
+                        if (test.expect_fail)
+                            result.status =
+                                completed ? TestResult::Status::UnexpectedPass
+                                          : TestResult::Status::ExpectedFail;
+                        else
+                            result.status = completed
+                                                ? TestResult::Status::Passed
+                                                : TestResult::Status::Failed;
+                        result.message = std::move(state.ctx.error);
+                    }
+                    result.failures = std::move(state.ctx.failures);
+                    result.output = std::move(state.output);
+                    // Free the frames now rather than when the batch ends.
+                    t.task = Task<>();
+                    done(k, std::move(result));
+                });
+            }
+
+        private:
+            std::map<const TestCase*, Body> bodies_;
+        };
+
+        inline AsyncBatch async_batch;
+
+        struct AsyncRegistrar {
+            AsyncRegistrar(const TestCase& test, AsyncBatch::Body body) {
+                async_batch.add(test, body);
+            }
+        };
+    }  // namespace detail
+}  // namespace NTest
+
+// =========================
+// Macros
+// =========================
+
+// The body is a coroutine returning NTest::Task<>; it may co_await
+// sleep_for, readable, writable and other Tasks. Assertions work as in
+// TEST. Every ASYNC_TEST of a run shares one event loop on one thread:
+//   ASYNC_TEST(ServerEchoes, "[net]") { co_await NTest::readable(fd); ... }
+#define ASYNC_TEST(...) NTEST_EXPAND_(NTEST_ASYNC_TEST_(__VA_ARGS__, "", ~))
+#define NTEST_ASYNC_TEST_(name, tags, ...) \
+    NTEST_ASYNC_REGISTER_(name, tags, NTest::TestFlags::None, 0)
+
+// Fails (as a timeout) if the body has not finished after `ms`
+// milliseconds; its frames are destroyed at the next suspension point.
+#define ASYNC_TEST_TIMEOUT(name, ms) \
+    NTEST_ASYNC_REGISTER_(name, "", NTest::TestFlags::None, (ms))
+
+#define NTEST_ASYNC_REGISTER_(name, tags, flags, timeout_ms)               \
+    static NTest::Task<> name();                                           \
+    static void _ntest_alone_##name() { NTest::run_async(name); }          \
+    static NTest::TestCase _ntest_##name(                                  \
+        #name, _ntest_alone_##name, __FILE__, __LINE__, flags, timeout_ms, \
+        tags, nullptr, &NTest::detail::async_batch);                       \
+    static const NTest::detail::Registrar _ntest_registrar_##name(         \
+        _ntest_##name);                                                    \
+    static const NTest::detail::AsyncRegistrar _ntest_async_##name(        \
+        _ntest_##name, name);                                              \
+    static NTest::Task<> name()
+
+#endif  // NTEST_ASYNC_H
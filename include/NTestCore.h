@@ -0,0 +1,290 @@
+/**
+ * @file NTestCore.h
+ * @author NoahGWood
+ * @brief Test registration and the plain assertions, without the runner
+ * @version 0.2
+ * @date 2025-04-15
+ *
+ * Test files that only need TEST and REQUIRE / EXPECT can include this
+ * instead of NTest.h and skip parsing the runner, reporters and their
+ * standard headers. Their failures are reported out of line, so exactly
+ * one translation unit of the program must include NTest.h with
+ * NTEST_IMPLEMENTATION defined (or link the ntest_main library).
+ */
+#ifndef NTEST_CORE_H
+#define NTEST_CORE_H
+
+#define NTEST_VERSION "0.2"
+
+#include <chrono>
+#include <cstdint>
+
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS) || defined(_CPPUNWIND)
+#define NTEST_EXCEPTIONS 1
+#else
+#define NTEST_EXCEPTIONS 0
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define NTEST_UNLIKELY(x) __builtin_expect(!!(x), 0)
+#define NTEST_COLD __attribute__((noinline, cold))
+#else
+#define NTEST_UNLIKELY(x) (x)
+#define NTEST_COLD
+#endif
+
+namespace NTest {
+
+    // =========================
+    // Test registration
+    // =========================
+
+    class BenchmarkState;
+
+    namespace detail {
+        class SharedFixture;
+        class TestBatch;
+    }  // namespace detail
+
+    namespace TestFlags {
+        constexpr unsigned None = 0;
+        constexpr unsigned ExpectFail = 1u << 0;
+        constexpr unsigned Serial = 1u << 1;  // never run concurrently
+    }  // namespace TestFlags
+
+    // One registered test or benchmark. The constexpr constructor makes the
+    // static instances emitted by TEST and friends constant-initialized:
+    // their metadata is fixed at compile time and registering them costs
+    // two pointer stores, with no allocation before main. The instances are
+    // not const, so they live in writable data rather than a read-only
+    // table: `next` is written when they are linked, and REGISTRY() hands
+    // out TestCase*, which existing callers rely on.
+    struct TestCase {
+        const char* name;
+        void (*func)() = nullptr;
+        void (*benchmark)(BenchmarkState&) = nullptr;  // BENCHMARK entries
+        const char* file = "";
+        int line = 0;
+        const char* tags = "";  // e.g. "[fast][parser]"
+        bool expect_fail = false;
+        bool serial = false;  // never run concurrently with other tests
+        std::chrono::milliseconds timeout{0};  // 0 = use the run default
+        detail::SharedFixture* shared = nullptr;  // TEST_SHARED fixture
+        detail::TestBatch* batch = nullptr;  // e.g. ASYNC_TEST's event loop
+        std::int64_t range_lo = 0;  // BENCHMARK_RANGE input sizes
+        std::int64_t range_hi = 0;
+        TestCase* next = nullptr;  // intrusive registration list
+
+        constexpr TestCase(const char* nname, void (*fxn)(), const char* nfile,
+                           int nline, unsigned flags = TestFlags::None,
+                           long long timeout_ms = 0, const char* ntags = "",
+                           detail::SharedFixture* nshared = nullptr,
+                           detail::TestBatch* nbatch = nullptr)
+            : name(nname),
+              func(fxn),
+              file(nfile),
+              line(nline),
+              tags(ntags),
+              expect_fail((flags & TestFlags::ExpectFail) != 0),
+              serial((flags & TestFlags::Serial) != 0),
+              timeout(timeout_ms),
+              shared(nshared),
+              batch(nbatch) {}
+
+        constexpr TestCase(const char* nname, void (*bench)(BenchmarkState&),
+                           const char* nfile, int nline,
+                           const char* ntags = "", std::int64_t lo = 0,
+                           std::int64_t hi = 0)
+            : name(nname),
+              benchmark(bench),
+              file(nfile),
+              line(nline),
+              tags(ntags),
+              range_lo(lo),
+              range_hi(hi) {}
+
+        // Constructs and registers in one step.
+        TestCase(const char* /* name */, void (*/* func */)());
+
+        bool is_benchmark() const { return benchmark != nullptr; }
+        bool is_range() const { return range_hi > 0; }
+    };
+
+    namespace detail {
+        // Registration order list. Constant-initialized, so it is usable
+        // from any static initializer regardless of TU order.
+        struct RegistryList {
+            TestCase* head;
+            TestCase* tail;
+        };
+
+        inline RegistryList registry_list{nullptr, nullptr};
+
+        inline void link(TestCase& test) {
+            if (registry_list.tail != nullptr)
+                registry_list.tail->next = &test;
+            else
+                registry_list.head = &test;
+            registry_list.tail = &test;
+        }
+
+        struct Registrar {
+            explicit Registrar(TestCase& test) { link(test); }
+        };
+    }  // namespace detail
+
+    inline TestCase::TestCase(const char* nname, void (*fxn)())
+        : TestCase(nname, fxn, "", 0) {
+        detail::link(*this);
+    }
+
+    namespace detail {
+        // What the assertion macros call when NTest.h is not included;
+        // they forward to FAIL and expect_failed.
+        [[noreturn]] NTEST_COLD void fail_compiled(const char* expr,
+                                                   const char* file, int line,
+                                                   const char* msg = nullptr);
+        NTEST_COLD void expect_failed_compiled(const char* expr,
+                                               const char* file, int line,
+                                               const char* msg = nullptr);
+    }  // namespace detail
+}  // namespace NTest
+
+// =========================
+// Macros
+// =========================
+
+// How assertions report a failure; NTest.h switches these to its inline
+// FAIL and expect_failed.
+#define NTEST_FAIL_ NTest::detail::fail_compiled
+#define NTEST_EXPECT_FAILED_ NTest::detail::expect_failed_compiled
+
+#define NTEST_REGISTER_(name, tags, flags, timeout_ms)                     \
+    static NTest::TestCase _ntest_##name(#name, name, __FILE__, __LINE__,  \
+                                         flags, timeout_ms, tags);         \
+    static const NTest::detail::Registrar _ntest_registrar_##name(         \
+        _ntest_##name)
+
+// TEST and friends take an optional tag string: TEST(name, "[fast][io]").
+// The trailing "" supplies the default and `~` keeps the variadic part of
+// the helper non-empty, which C++17 requires.
+#define NTEST_EXPAND_(x) x
+
+#define TEST(...) NTEST_EXPAND_(NTEST_TEST_(__VA_ARGS__, "", ~))
+#define NTEST_TEST_(name, tags, ...)                         \
+    static void name();                                      \
+    NTEST_REGISTER_(name, tags, NTest::TestFlags::None, 0);  \
+    static void name()
+
+#define TEST_EXPECT_FAIL(...) \
+    NTEST_EXPAND_(NTEST_TEST_EXPECT_FAIL_(__VA_ARGS__, "", ~))
+#define NTEST_TEST_EXPECT_FAIL_(name, tags, ...)                   \
+    static void name();                                            \
+    NTEST_REGISTER_(name, tags, NTest::TestFlags::ExpectFail, 0);  \
+    static void name()
+
+// Fails (as a timeout) if the body runs longer than `ms` milliseconds.
+#define TEST_TIMEOUT(name, ms)                                \
+    static void name();                                       \
+    NTEST_REGISTER_(name, "", NTest::TestFlags::None, (ms));  \
+    static void name()
+
+// Excluded from the parallel pool; runs on the calling thread instead.
+#define TEST_SERIAL(...) NTEST_EXPAND_(NTEST_TEST_SERIAL_(__VA_ARGS__, "", ~))
+#define NTEST_TEST_SERIAL_(name, tags, ...)                      \
+    static void name();                                          \
+    NTEST_REGISTER_(name, tags, NTest::TestFlags::Serial, 0);    \
+    static void name()
+
+// ----- Fatal assertions -----
+// The passing path is a single predicted branch: no allocation, no
+// try/catch, no formatting.
+
+#define REQUIRE(cond)                               \
+    do {                                            \
+        if (NTEST_UNLIKELY(!(cond)))                \
+            NTEST_FAIL_(#cond, __FILE__, __LINE__); \
+    } while (0)
+
+#define REQUIRE_MSG(cond, msg)                           \
+    do {                                                 \
+        if (NTEST_UNLIKELY(!(cond)))                     \
+            NTEST_FAIL_(#cond, __FILE__, __LINE__, msg); \
+    } while (0)
+
+#define REQUIRE_EQ(a, b)                                   \
+    do {                                                   \
+        const auto& _a = (a);                              \
+        const auto& _b = (b);                              \
+        if (NTEST_UNLIKELY(!(_a == _b)))                   \
+            NTEST_FAIL_(#a " == " #b, __FILE__, __LINE__); \
+    } while (0)
+
+#define REQUIRE_NE(a, b)                                   \
+    do {                                                   \
+        if (NTEST_UNLIKELY(!((a) != (b))))                 \
+            NTEST_FAIL_(#a " != " #b, __FILE__, __LINE__); \
+    } while (0)
+
+// ----- Non-fatal assertions -----
+
+#define EXPECT(cond)                                         \
+    do {                                                     \
+        if (NTEST_UNLIKELY(!(cond)))                         \
+            NTEST_EXPECT_FAILED_(#cond, __FILE__, __LINE__); \
+    } while (0)
+
+#define EXPECT_EQ(a, b)                                             \
+    do {                                                            \
+        const auto& _a = (a);                                       \
+        const auto& _b = (b);                                       \
+        if (NTEST_UNLIKELY(!(_a == _b)))                            \
+            NTEST_EXPECT_FAILED_(#a " == " #b, __FILE__, __LINE__); \
+    } while (0)
+
+// ----- Exception assertions -----
+
+#if NTEST_EXCEPTIONS
+#define REQUIRE_THROW(expr)                                                \
+    do {                                                                   \
+        bool _threw = false;                                               \
+        try {                                                              \
+            expr;                                                          \
+        } catch (...) {                                                    \
+            _threw = true;                                                 \
+        }                                                                  \
+        if (!_threw)                                                       \
+            NTEST_FAIL_("expected exception: " #expr, __FILE__, __LINE__); \
+    } while (0)
+
+#define REQUIRE_NO_THROW(expr)                                               \
+    do {                                                                     \
+        try {                                                                \
+            expr;                                                            \
+        } catch (...) {                                                      \
+            NTEST_FAIL_("unexpected exception: " #expr, __FILE__, __LINE__); \
+        }                                                                    \
+    } while (0)
+#else
+#define REQUIRE_THROW(expr) \
+    static_assert(sizeof(#expr) == 0, "REQUIRE_THROW needs exceptions")
+#define REQUIRE_NO_THROW(expr) \
+    do {                       \
+        expr;                  \
+    } while (0)
+#endif
+
+// ----- Legacy ASSERT_* aliases (fatal) -----
+
+#define ASSERT_TRUE(cond) REQUIRE(cond)
+#define ASSERT_FALSE(cond) REQUIRE(!(cond))
+
+#define ASSERT_EQ(a, b) REQUIRE_EQ(a, b)
+#define ASSERT_NE(a, b) REQUIRE_NE(a, b)
+
+#define ASSERT_LT(a, b) REQUIRE((a) < (b))
+#define ASSERT_GT(a, b) REQUIRE((a) > (b))
+#define ASSERT_LE(a, b) REQUIRE((a) <= (b))
+#define ASSERT_GE(a, b) REQUIRE((a) >= (b))
+
+#endif  // NTEST_CORE_H
@@ -1,3 +1,4 @@
+#define NTEST_IMPLEMENTATION
 #include <NTest.h>
 
-int main() { return NTest::run_all(); }
\ No newline at end of file
+int main(int argc, char** argv) { return NTest::run_all(argc, argv); }
@@ -0,0 +1,184 @@
+#include <chrono>
+#include <coroutine>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+#include <NTestAsync.h>
+
+using namespace std::chrono_literals;
+
+// ======================================================
+// ASYNC_TEST bodies
+// ======================================================
+
+static NTest::Task<int> answer_later() {
+    co_await NTest::sleep_for(5ms);
+    co_return 42;
+}
+
+ASYNC_TEST(AwaitsNestedTasks) {
+    const int value = co_await answer_later();
+    REQUIRE_EQ(value, 42);
+}
+
+ASYNC_TEST(EchoesOverSocketPair, "[io]") {
+    int fds[2];
+    REQUIRE_EQ(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    co_await NTest::writable(fds[0]);
+    REQUIRE_EQ(::write(fds[0], "ping", 4), 4);
+    co_await NTest::readable(fds[1]);
+    char buf[8] = {};
+    REQUIRE_EQ(::read(fds[1], buf, sizeof buf), 4);
+    REQUIRE_EQ(std::string(buf), std::string("ping"));
+    ::close(fds[0]);
+    ::close(fds[1]);
+}
+
+// ======================================================
+// Batches
+// ======================================================
+
+namespace {
+    struct BatchRun {
+        std::vector<NTest::TestResult> results;
+        std::chrono::steady_clock::duration wall{};
+    };
+
+    BatchRun run_batch(const std::vector<const NTest::TestCase*>& tests,
+                       NTest::detail::AsyncBatch& batch) {
+        BatchRun run;
+        run.results.resize(tests.size());
+        const auto start = std::chrono::steady_clock::now();
+        batch.run(
+            tests, std::chrono::milliseconds(0), [](std::size_t) {},
+            [&](std::size_t k, NTest::TestResult result) {
+                run.results[k] = std::move(result);
+            });
+        run.wall = std::chrono::steady_clock::now() - start;
+        return run;
+    }
+
+    void unused() {}
+}  // namespace
+
+static NTest::Task<> naps() {
+    for (int i = 0; i < 4; ++i)
+        co_await NTest::sleep_for(25ms);
+}
+
+TEST(AsyncTestsOverlapTheirWaits) {
+    NTest::detail::AsyncBatch batch;
+    std::vector<NTest::TestCase> cases;
+    cases.reserve(16);
+    for (int i = 0; i < 16; ++i)
+        cases.emplace_back("Nap", unused, __FILE__, __LINE__);
+    std::vector<const NTest::TestCase*> tests;
+    for (const NTest::TestCase& c : cases) {
+        batch.add(c, naps);
+        tests.push_back(&c);
+    }
+
+    // 16 tests of 100 ms each, interleaved on one thread.
+    const BatchRun run = run_batch(tests, batch);
+    for (const NTest::TestResult& r : run.results) {
+        REQUIRE(r.ok());
+        REQUIRE(r.wall >= 100ms);
+    }
+    REQUIRE(run.wall < 800ms);
+}
+
+static NTest::Task<> prints_and_fails() {
+    co_await NTest::sleep_for(10ms);
+    std::cout << "failing side\n";
+    EXPECT_EQ(1, 2);
+    REQUIRE_MSG(false, "stopped");
+}
+
+static NTest::Task<> prints_and_passes() {
+    co_await NTest::sleep_for(5ms);
+    std::cout << "passing side\n";
+    co_await NTest::sleep_for(10ms);
+}
+
+TEST(AsyncFailuresAndOutputStayWithTheirTest) {
+    NTest::detail::AsyncBatch batch;
+    NTest::TestCase failing("Failing", unused, __FILE__, __LINE__);
+    NTest::TestCase passing("Passing", unused, __FILE__, __LINE__);
+    batch.add(failing, prints_and_fails);
+    batch.add(passing, prints_and_passes);
+
+    const BatchRun run = run_batch({&failing, &passing}, batch);
+    const NTest::TestResult& bad = run.results[0];
+    const NTest::TestResult& good = run.results[1];
+    REQUIRE(bad.status == NTest::TestResult::Status::Failed);
+    REQUIRE_EQ(bad.failures.size(), 2u);
+    REQUIRE(!bad.failures[0].fatal);
+    REQUIRE_EQ(bad.failures[1].msg, std::string("stopped"));
+    REQUIRE_EQ(bad.output, std::string("failing side\n"));
+    REQUIRE(good.ok());
+    REQUIRE(good.failures.empty());
+    REQUIRE_EQ(good.output, std::string("passing side\n"));
+}
+
+static bool hung_frame_destroyed = false;
+
+static NTest::Task<> hangs() {
+    struct Marker {
+        ~Marker() { hung_frame_destroyed = true; }
+    } marker;
+    co_await NTest::sleep_for(10s);
+}
+
+TEST(AsyncTimeoutCancelsOnlyThatTest) {
+    NTest::detail::AsyncBatch batch;
+    NTest::TestCase hung("Hung", unused, __FILE__, __LINE__,
+                         NTest::TestFlags::None, 30);
+    NTest::TestCase quick("Quick", unused, __FILE__, __LINE__);
+    batch.add(hung, hangs);
+    batch.add(quick, naps);
+
+    const BatchRun run = run_batch({&hung, &quick}, batch);
+    REQUIRE(run.results[0].status == NTest::TestResult::Status::TimedOut);
+    REQUIRE_EQ(run.results[0].message, std::string("exceeded 30 ms"));
+    REQUIRE(hung_frame_destroyed);
+    REQUIRE(run.results[1].ok());
+    REQUIRE(run.wall < 5s);
+}
+
+// Suspends without arranging to be resumed.
+struct Forever {
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<>) const noexcept {}
+    void await_resume() const noexcept {}
+};
+
+static NTest::Task<> stalls() { co_await Forever{}; }
+
+TEST(StalledAsyncTestFailsAlone) {
+    NTest::detail::AsyncBatch batch;
+    NTest::TestCase stalled("Stalled", unused, __FILE__, __LINE__);
+    NTest::TestCase quick("Quick", unused, __FILE__, __LINE__);
+    batch.add(stalled, stalls);
+    batch.add(quick, naps);
+
+    const BatchRun run = run_batch({&stalled, &quick}, batch);
+    REQUIRE(run.results[0].status == NTest::TestResult::Status::Failed);
+    REQUIRE_EQ(run.results[0].message,
+               std::string(NTest::detail::kStalledMessage));
+    REQUIRE(run.results[1].ok());
+    REQUIRE_THROW(NTest::run_async(stalls));
+}
+
+static NTest::Task<> stops() {
+    co_await NTest::sleep_for(1ms);
+    REQUIRE_MSG(false, "stopped");
+}
+
+TEST(RunAsyncRethrowsFailures) {
+    NTest::run_async(naps);
+    REQUIRE_THROW(NTest::run_async(stops));
+}
+
+int main(int argc, char** argv) { return NTest::run_all(argc, argv); }
@@ -0,0 +1,31 @@
+// Tests in a file that includes only NTestCore.h; their failures reach the
+// runner through the functions compiled into self_tests.cpp.
+#include <NTestCore.h>
+
+TEST(CoreOnlyAssertionsPass, "[core]") {
+    REQUIRE(1 + 1 == 2);
+    REQUIRE_EQ(6 * 7, 42);
+    REQUIRE_NE(1, 2);
+    EXPECT_EQ(2 * 2, 4);
+    ASSERT_LT(1, 2);
+}
+
+TEST_EXPECT_FAIL(CoreOnlyRequireFails, "[core]") {
+    REQUIRE_EQ(1 + 1, 3);
+}
+
+// Run through NTest::run_test by CoreOnlyExpectIsRecorded in
+// self_tests.cpp: one non-fatal failure, then the body carries on.
+int core_expect_reached_end = 0;
+
+void core_expect_body() {
+    EXPECT(false);
+    ++core_expect_reached_end;
+}
+
+#if NTEST_EXCEPTIONS
+TEST(CoreOnlyExceptionAssertions, "[core]") {
+    REQUIRE_THROW(throw 1);
+    REQUIRE_NO_THROW((void)0);
+}
+#endif
@@ -1,9 +1,33 @@
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
 #include <vector>
 
+#define NTEST_TRACK_ALLOCATIONS
+#define NTEST_IMPLEMENTATION
 #include <NTest.h>
 
+// Collects a run's report for the tests that inspect it.
+struct StringSink : NTest::OutputSink {
+    std::string text;
+    void write(std::string_view s) override { text.append(s); }
+    void flush() override {}
+};
+
 // ======================================================
 // Registration basics
 // ======================================================
@@ -13,6 +37,24 @@ TEST(TestRegistrationWorks) {
     ASSERT_TRUE(NTest::get_registered_tests().size() >= 1);
 }
 
+TEST(RegistrationRecordsSourceLocation) {
+    const NTest::TestCase& self = _ntest_RegistrationRecordsSourceLocation;
+    ASSERT_EQ(std::string(self.file), std::string(__FILE__));
+    REQUIRE(self.line > 0 && self.line < __LINE__);
+    REQUIRE(self.func == &RegistrationRecordsSourceLocation);
+}
+
+TEST(RegistryMatchesIntrusiveList) {
+    const auto& tests = NTest::REGISTRY();
+    std::size_t i = 0;
+    for (auto* node = NTest::detail::registry_list.head; node != nullptr;
+         node = node->next, ++i) {
+        REQUIRE(i < tests.size());
+        REQUIRE(tests[i] == node);
+    }
+    ASSERT_EQ(i, tests.size());
+}
+
 // ======================================================
 // REQUIRE / ASSERT behavior
 // ======================================================
@@ -60,6 +102,15 @@ TEST(ExpectDoesNotAbort) {
 // REQUIRE stops execution (verified indirectly)
 // ======================================================
 
+// The checks below run the expected failures again through the harness
+// instead of reading what their registered runs left behind, so that they
+// hold in any --isolate worker and on every --repeat round. They are
+// serial so that the registered runs do not bump the counters meanwhile.
+static bool expected_to_fail(const NTest::TestCase& test) {
+    return NTest::run_test(test).status ==
+           NTest::TestResult::Status::ExpectedFail;
+}
+
 static int require_hit_count = 0;
 
 TEST_EXPECT_FAIL(RequireStopsExecution) {
@@ -68,7 +119,11 @@ TEST_EXPECT_FAIL(RequireStopsExecution) {
     require_hit_count++;  // must NOT run
 }
 
-TEST(RequireDidStopExecution) { ASSERT_EQ(require_hit_count, 1); }
+TEST_SERIAL(RequireDidStopExecution) {
+    require_hit_count = 0;
+    REQUIRE(expected_to_fail(_ntest_RequireStopsExecution));
+    ASSERT_EQ(require_hit_count, 1);
+}
 
 // ======================================================
 // REQUIRE inside helper function
@@ -84,7 +139,11 @@ void helper_require_fail() {
 
 TEST_EXPECT_FAIL(RequireInsideHelper) { helper_require_fail(); }
 
-TEST(RequireInsideHelperDidAbort) { ASSERT_EQ(helper_hit_count, 1); }
+TEST_SERIAL(RequireInsideHelperDidAbort) {
+    helper_hit_count = 0;
+    REQUIRE(expected_to_fail(_ntest_RequireInsideHelper));
+    ASSERT_EQ(helper_hit_count, 1);
+}
 
 // ======================================================
 // Suite continuation after failures
@@ -97,8 +156,17 @@ TEST_EXPECT_FAIL(SuiteFailureOccurs) {
     ASSERT_TRUE(false);  // test must fail
 }
 
-TEST(SuiteContinuesAfterFailure) {
-    suite_progress++;
+static void suite_continues() { suite_progress++; }
+
+TEST_SERIAL(SuiteContinuesAfterFailure) {
+    suite_progress = 0;
+    NTest::TestCase after("AfterFailure", suite_continues, __FILE__,
+                          __LINE__);
+    StringSink sink;
+    NTest::RunOptions opts;
+    opts.sink = &sink;
+    REQUIRE_EQ(NTest::run_tests({&_ntest_SuiteFailureOccurs, &after}, opts),
+               0);
     ASSERT_EQ(suite_progress, 2);
 }
 
@@ -118,7 +186,12 @@ TEST_EXPECT_FAIL(NonStdExceptionIsCaught) {
     throw 42;
 }
 
-TEST(ExceptionTestsRan) { ASSERT_EQ(exception_hits, 2); }
+TEST_SERIAL(ExceptionTestsRan) {
+    exception_hits = 0;
+    REQUIRE(expected_to_fail(_ntest_UnhandledStdExceptionIsCaught));
+    REQUIRE(expected_to_fail(_ntest_NonStdExceptionIsCaught));
+    ASSERT_EQ(exception_hits, 2);
+}
 
 // ======================================================
 // Registration order
@@ -126,23 +199,1485 @@ TEST(ExceptionTestsRan) { ASSERT_EQ(exception_hits, 2); }
 
 static std::vector<int> order;
 
-TEST(Order1) { order.push_back(1); }
-TEST(Order2) { order.push_back(2); }
-TEST(Order3) { order.push_back(3); }
+TEST_SERIAL(Order1) { order.push_back(1); }
+TEST_SERIAL(Order2) { order.push_back(2); }
+TEST_SERIAL(Order3) { order.push_back(3); }
+
+TEST_SERIAL(RegistrationOrderPreserved) {
+    // Emptied so that the next --repeat round starts over.
+    const std::vector<int> seen = std::exchange(order, {});
+    ASSERT_EQ(seen.size(), 3);
+    ASSERT_EQ(seen[0], 1);
+    ASSERT_EQ(seen[1], 2);
+    ASSERT_EQ(seen[2], 3);
+}
+
+// ======================================================
+// Parallel runner
+// ======================================================
+
+TEST(WorkStealingRunsEveryItemOnce) {
+    std::vector<std::size_t> items(1000);
+    for (std::size_t i = 0; i < items.size(); ++i)
+        items[i] = i;
+
+    std::vector<std::atomic<int>> hits(items.size());
+    NTest::detail::run_work_stealing(items, 4,
+                                     [&](std::size_t i) { hits[i]++; });
+
+    for (const auto& h : hits)
+        ASSERT_EQ(h.load(), 1);
+}
+
+TEST(OrderedOutputHoldsBackOutOfOrderSlots) {
+    std::string released;
+    NTest::detail::OrderedOutput ordered(
+        3, [&](std::size_t i) { released += static_cast<char>('a' + i); });
+    ordered.publish(2);
+    ordered.publish(1);
+    ASSERT_EQ(released, "");
+    ordered.publish(0);
+    ASSERT_EQ(released, "abc");
+}
+
+TEST(ParseArgsReadsJobs) {
+    char prog[] = "selftest";
+    char flag[] = "--jobs=8";
+    char* argv[] = {prog, flag};
+    ASSERT_EQ(NTest::parse_args(2, argv).jobs, 8u);
+
+    char bad[] = "--jobs=lots";
+    char* bad_argv[] = {prog, bad};
+    REQUIRE_THROW(NTest::parse_args(2, bad_argv));
+
+    char pattern[] = "Parse*";
+    char list[] = "--list";
+    char* select_argv[] = {prog, pattern, list};
+    const NTest::RunOptions selected = NTest::parse_args(3, select_argv);
+    REQUIRE(selected.list);
+    REQUIRE(selected.filter.matches(_ntest_ParseArgsReadsJobs));
+    REQUIRE(!selected.filter.matches(_ntest_Order1));
+}
+
+// ======================================================
+// Output
+// ======================================================
+
+TEST(BufferedSinkBatchesWrites) {
+    std::stringbuf target;
+    {
+        NTest::BufferedSink sink(&target, 8, std::chrono::hours(1));
+        sink.write("abc");
+        sink.write("def");
+        REQUIRE_EQ(target.str(), "");
+        sink.write("gh");  // reaches capacity
+        REQUIRE_EQ(target.str(), "abcdefgh");
+        sink.write("i");
+    }  // flushed on destruction
+    REQUIRE_EQ(target.str(), "abcdefghi");
+}
+
+static void passing_body() {}
+static void failing_body() { REQUIRE(false); }
+
+TEST_SERIAL(FailuresOnlySkipsPassingTests) {
+    NTest::TestCase pass("QuietPass", passing_body, __FILE__, __LINE__);
+    NTest::TestCase fail("QuietFail", failing_body, __FILE__, __LINE__);
+    StringSink sink;
+    NTest::RunOptions opts;
+    opts.sink = &sink;
+    opts.verbosity = NTest::Verbosity::FailuresOnly;
+    REQUIRE_EQ(NTest::run_tests({&pass, &fail}, opts), 1);
+    REQUIRE(sink.text.find("QuietPass") == std::string::npos);
+    REQUIRE(sink.text.find("QuietFail") != std::string::npos);
+    REQUIRE(sink.text.find("1 passed, 1 failed.") != std::string::npos);
+}
+
+TEST_SERIAL(StructuredReportersStreamEveryTest) {
+    NTest::TestCase pass("Report<Pass>", passing_body, __FILE__, __LINE__);
+    NTest::TestCase fail("Report\"Fail", failing_body, __FILE__, __LINE__);
+    auto junit = std::make_shared<StringSink>();
+    auto jsonl = std::make_shared<StringSink>();
+    auto tap = std::make_shared<StringSink>();
+    StringSink console;
+    NTest::RunOptions opts;
+    opts.reporters = {std::make_shared<NTest::JUnitReporter>(junit),
+                      std::make_shared<NTest::JsonLinesReporter>(jsonl),
+                      std::make_shared<NTest::TapReporter>(tap),
+                      std::make_shared<NTest::ConsoleReporter>(console)};
+    REQUIRE_EQ(NTest::run_tests({&pass, &fail}, opts), 1);
+
+    REQUIRE(junit->text.find("name=\"Report&lt;Pass&gt;\"") !=
+            std::string::npos);
+    REQUIRE(junit->text.find("<failure type=\"assertion\"") !=
+            std::string::npos);
+    REQUIRE(junit->text.find("</testsuites>") != std::string::npos);
+
+    REQUIRE(jsonl->text.find("\"name\":\"Report\\\"Fail\"") !=
+            std::string::npos);
+    REQUIRE(jsonl->text.find("{\"event\":\"assertion_failure\"") !=
+            std::string::npos);
+    REQUIRE(jsonl->text.find("{\"event\":\"run_end\",\"passed\":1") !=
+            std::string::npos);
+
+    REQUIRE(tap->text.rfind("TAP version 13\n1..2\nok 1 - Report<Pass>\n",
+                            0) == 0);
+    REQUIRE(tap->text.find("not ok 2 - Report\"Fail") != std::string::npos);
+    REQUIRE(console.text.find("[FAIL] Report\"Fail") != std::string::npos);
+}
+
+TEST(ParseArgsBuildsReporters) {
+    char prog[] = "selftest";
+    char flag[] = "--reporter=tap";
+    char bad[] = "--reporter=html";
+    char* argv[] = {prog, flag};
+    char* bad_argv[] = {prog, bad};
+    REQUIRE_EQ(NTest::parse_args(2, argv).reporters.size(), 1u);
+    REQUIRE_THROW(NTest::parse_args(2, bad_argv));
+}
+
+// ======================================================
+// Test selection
+// ======================================================
+
+TEST(TaggedTestCarriesTags, "[self][tags]") {
+    REQUIRE_EQ(std::string(_ntest_TaggedTestCarriesTags.tags),
+               "[self][tags]");
+}
+
+TEST(GlobMatchesWildcards) {
+    using NTest::detail::glob_match;
+    REQUIRE(glob_match("Parse*", "ParseArgs"));
+    REQUIRE(glob_match("*Args", "ParseArgs"));
+    REQUIRE(glob_match("P?rse*s", "ParseArgs"));
+    REQUIRE(glob_match("*", ""));
+    REQUIRE(!glob_match("Parse", "ParseArgs"));
+    REQUIRE(!glob_match("*x*", "ParseArgs"));
+}
+
+TEST(FilterCombinesNamesTagsAndExclusions) {
+    NTest::TestCase fast("FastIo", passing_body, __FILE__, __LINE__,
+                         NTest::TestFlags::None, 0, "[io][fast]");
+    NTest::TestCase slow("SlowIo", passing_body, __FILE__, __LINE__,
+                         NTest::TestFlags::None, 0, "[io][slow]");
+    NTest::TestCase other("Other", passing_body, __FILE__, __LINE__);
+
+    NTest::TestFilter by_tag;
+    by_tag.add("[io]");
+    by_tag.add("~[slow]");
+    REQUIRE(by_tag.matches(fast));
+    REQUIRE(!by_tag.matches(slow));
+    REQUIRE(!by_tag.matches(other));
+
+    NTest::TestFilter by_name;
+    by_name.add("~*Io");
+    REQUIRE(by_name.matches(other));
+    REQUIRE(!by_name.matches(fast));
+
+    NTest::TestFilter by_regex;
+    by_regex.add_regex("^(Fast|Other)");
+    REQUIRE(by_regex.matches(fast));
+    REQUIRE(!by_regex.matches(slow));
+    REQUIRE_THROW(by_regex.add_regex("("));
+    REQUIRE_THROW(by_tag.add("[unterminated"));
+}
+
+TEST_SERIAL(ResultCacheRerunsFailures) {
+    NTest::TestCase pass("CachePass", passing_body, __FILE__, __LINE__);
+    NTest::TestCase fail("CacheFail", failing_body, __FILE__, __LINE__);
+    const std::vector<NTest::TestCase*> all = {&pass, &fail};
+    StringSink sink;
+    NTest::RunOptions opts;
+    opts.sink = &sink;
+    opts.cache_file = "ntest-selftest.cache";
+    std::remove(opts.cache_file.c_str());
+
+    std::string note;
+    opts.only_failed = true;
+    REQUIRE_EQ(NTest::detail::select_tests(all, opts, note).size(), 2u);
+    REQUIRE(!note.empty());
+
+    opts.only_failed = false;
+    REQUIRE_EQ(NTest::run_tests(all, opts), 1);
+
+    opts.failed_first = true;
+    auto ordered = NTest::detail::select_tests(all, opts, note);
+    REQUIRE_EQ(ordered.size(), 2u);
+    REQUIRE(ordered[0] == &fail);
+
+    opts.only_failed = true;
+    auto rerun = NTest::detail::select_tests(all, opts, note);
+    REQUIRE_EQ(rerun.size(), 1u);
+    REQUIRE(rerun[0] == &fail);
+    std::remove(opts.cache_file.c_str());
+    std::remove((opts.cache_file + ".lock").c_str());
+}
+
+#if NTEST_HAS_FORK
+TEST_SERIAL(ConcurrentShardsKeepEachOthersResults) {
+    const std::string path = "ntest-selftest-shards.cache";
+    std::remove(path.c_str());
+    const char* const names[] = {"Shard0", "Shard1", "Shard2", "Shard3"};
+    std::vector<pid_t> children;
+    for (const char* name : names) {
+        const pid_t pid = fork();
+        if (pid == 0) {
+            NTest::TestCase test(name, passing_body, __FILE__, __LINE__);
+            std::vector<NTest::TestResult> results(1);
+            results[0].test = &test;
+            for (int i = 0; i < 20; ++i)
+                NTest::detail::update_result_cache(path, results);
+            _exit(0);
+        }
+        children.push_back(pid);
+    }
+    for (const pid_t pid : children)
+        waitpid(pid, nullptr, 0);
+
+    std::ifstream in(path);
+    const NTest::ResultCache cache = NTest::read_result_cache(in);
+    in.close();
+    std::remove(path.c_str());
+    std::remove((path + ".lock").c_str());
+    REQUIRE_EQ(cache.size(), std::size(names));
+}
+#endif
+
+TEST_SERIAL(HistoryKeepsReportOrderUnderJobs) {
+    using std::chrono::milliseconds;
+    NTest::TestCase a("OrderA", passing_body, __FILE__, __LINE__);
+    NTest::TestCase b("OrderB", passing_body, __FILE__, __LINE__);
+    NTest::TestCase c("OrderC", passing_body, __FILE__, __LINE__);
+    const std::vector<NTest::TestCase*> all = {&a, &b, &c};
+    NTest::ResultCache history;
+    history["OrderA"] = {true, milliseconds(1)};
+    history["OrderB"] = {true, milliseconds(5)};
+    history["OrderC"] = {true, milliseconds(9)};
+
+    StringSink sink;
+    NTest::RunOptions opts;
+    opts.sink = &sink;
+    opts.jobs = 2;
+    opts.cache_file = "ntest-selftest-order.cache";
+    {
+        std::ofstream out(opts.cache_file);
+        NTest::write_result_cache(out, history);
+    }
+    const int failed = NTest::run_tests(all, opts);
+    std::remove(opts.cache_file.c_str());
+    std::remove((opts.cache_file + ".lock").c_str());
+    REQUIRE_EQ(failed, 0);
+
+    // OrderC starts first but is reported in registration order.
+    const std::size_t pos_a = sink.text.find("OrderA");
+    const std::size_t pos_b = sink.text.find("OrderB");
+    const std::size_t pos_c = sink.text.find("OrderC");
+    REQUIRE(pos_c != std::string::npos);
+    REQUIRE(pos_a < pos_b);
+    REQUIRE(pos_b < pos_c);
+}
+
+TEST(HistoryOrdersLongestFirstAndBalancesShards) {
+    using std::chrono::milliseconds;
+    NTest::TestCase a("HistA", passing_body, __FILE__, __LINE__);
+    NTest::TestCase b("HistB", passing_body, __FILE__, __LINE__);
+    NTest::TestCase c("HistC", passing_body, __FILE__, __LINE__);
+    NTest::TestCase d("HistD", passing_body, __FILE__, __LINE__);
+    NTest::ResultCache history;
+    history["HistA"] = {true, milliseconds(1)};
+    history["HistB"] = {true, milliseconds(9)};
+    history["HistC"] = {false, milliseconds(5)};
+
+    std::stringstream file;
+    NTest::write_result_cache(file, history);
+    const NTest::ResultCache cache = NTest::read_result_cache(file);
+    REQUIRE_EQ(cache.size(), 3u);
+    REQUIRE(!cache.at("HistC").passed);
+    REQUIRE(cache.at("HistB").wall == milliseconds(9));
+
+    // Unknown tests first, then by decreasing duration.
+    const std::vector<NTest::TestCase*> tests = {&a, &b, &c, &d};
+    std::vector<std::size_t> slots = {0, 1, 2, 3};
+    NTest::detail::order_by_cost(slots, tests, cache);
+    REQUIRE((slots == std::vector<std::size_t>{3, 1, 2, 0}));
+
+    // HistD counts as the mean, 5 ms: {B, A} and {C, D} weigh 10 ms each.
+    NTest::RunOptions opts;
+    opts.shard_count = 2;
+    const std::vector<NTest::TestCase*> all = {&a, &b, &c, &d};
+    REQUIRE((NTest::detail::select_balanced_shard(all, opts, cache) ==
+             std::vector<NTest::TestCase*>{&a, &b}));
+    opts.shard_index = 1;
+    REQUIRE((NTest::detail::select_balanced_shard(all, opts, cache) ==
+             std::vector<NTest::TestCase*>{&c, &d}));
+}
+
+// ======================================================
+// Fixtures
+// ======================================================
+
+struct CounterFixture {
+    int value = 41;
+    std::vector<int> items{1, 2, 3};
+};
+
+TEST_F(CounterFixture, FixtureStartsFresh, "[fixture]") {
+    REQUIRE_EQ(value, 41);
+    ++value;
+    items.clear();
+}
+
+TEST_F(CounterFixture, FixtureStartsFreshAgain, "[fixture]") {
+    REQUIRE_EQ(value, 41);
+    REQUIRE_EQ(items.size(), 3u);
+}
+
+struct TornDownFixture {
+    static inline int destroyed = 0;
+    ~TornDownFixture() { ++destroyed; }
+};
+
+struct FailsInFixture : TornDownFixture {
+    void body() { REQUIRE(false); }
+};
+
+static void fails_in_fixture() {
+    NTest::detail::run_fixture<FailsInFixture>();
+}
+
+TEST(FixtureIsDestroyedAfterFatalFailure, "[fixture]") {
+    NTest::TestCase test("FailsInFixture", fails_in_fixture, __FILE__,
+                         __LINE__);
+    TornDownFixture::destroyed = 0;
+    REQUIRE(!NTest::run_test(test).ok());
+    REQUIRE_EQ(TornDownFixture::destroyed, 1);
+}
+
+// Every run builds the fixture afresh, so the tests check that theirs is
+// the only and the latest instance rather than count builds overall.
+struct SharedCorpus {
+    static inline std::atomic<int> builds{0};
+    static inline std::atomic<int> live{0};
+    std::vector<std::string> words{"alpha", "beta", "gamma"};
+    const int build = ++builds;
+    SharedCorpus() { ++live; }
+    ~SharedCorpus() { --live; }
+};
+
+TEST_SHARED(SharedCorpus, SharedFixtureIsBuiltOnce, "[fixture]") {
+    REQUIRE_EQ(shared.words.size(), 3u);
+    REQUIRE_EQ(SharedCorpus::live.load(), 1);
+    REQUIRE_EQ(shared.build, SharedCorpus::builds.load());
+}
+
+TEST_SHARED(SharedCorpus, SharedFixtureIsReused, "[fixture]") {
+    REQUIRE(&shared == &NTest::shared<SharedCorpus>());
+    REQUIRE_EQ(SharedCorpus::live.load(), 1);
+    REQUIRE_EQ(shared.build, SharedCorpus::builds.load());
+}
+
+struct CountedResource {
+    static inline std::atomic<int> live{0};
+    static inline std::atomic<int> built{0};
+    CountedResource() {
+        ++live;
+        ++built;
+    }
+    ~CountedResource() { --live; }
+};
+
+static void uses_counted_resource() {
+    (void)NTest::shared<CountedResource>();
+    REQUIRE_EQ(CountedResource::live.load(), 1);
+}
+
+TEST_SERIAL(SharedFixtureLivesUntilLastUserEnds) {
+    NTest::detail::SharedFixture* slot =
+        &NTest::detail::shared_slot<CountedResource>;
+    std::vector<NTest::TestCase> cases;
+    for (const char* name : {"UserA", "UserB", "UserC", "UserD"})
+        cases.emplace_back(name, uses_counted_resource, __FILE__, __LINE__,
+                           NTest::TestFlags::None, 0, "", slot);
+    std::vector<NTest::TestCase*> tests;
+    for (auto& test : cases)
+        tests.push_back(&test);
+
+    StringSink sink;
+    NTest::RunOptions opts;
+    opts.sink = &sink;
+    opts.jobs = 4;
+    const int built = CountedResource::built.load();
+    REQUIRE_EQ(NTest::run_tests(tests, opts), 0);
+    REQUIRE_EQ(CountedResource::built.load(), built + 1);
+    REQUIRE_EQ(CountedResource::live.load(), 0);
+
+    // Outside a run nothing else is waiting for it.
+    REQUIRE(NTest::run_test(cases[0]).ok());
+    REQUIRE_EQ(CountedResource::built.load(), built + 2);
+    REQUIRE_EQ(CountedResource::live.load(), 0);
+}
+
+// ======================================================
+// Sharding / isolation
+// ======================================================
+
+TEST(ShardsPartitionRegistry) {
+    const auto& all = NTest::REGISTRY();
+    std::size_t total = 0;
+    for (unsigned shard = 0; shard < 3; ++shard) {
+        NTest::RunOptions opts;
+        opts.shard_index = shard;
+        opts.shard_count = 3;
+        const auto selected = NTest::detail::select_shard(all, opts);
+        for (std::size_t i = 0; i < selected.size(); ++i)
+            ASSERT_EQ(selected[i], all[i * 3 + shard]);
+        total += selected.size();
+    }
+    ASSERT_EQ(total, all.size());
+}
+
+TEST(ShardIndexMustBeInRange) {
+    NTest::RunOptions opts;
+    opts.shard_index = 2;
+    opts.shard_count = 2;
+    REQUIRE_THROW(NTest::detail::select_shard(NTest::REGISTRY(), opts));
+}
+
+#if NTEST_HAS_FORK
+TEST(DescribesWorkerDeath) {
+    const std::string crashed = NTest::detail::describe_exit(SIGSEGV);
+    REQUIRE(crashed.find("signal " + std::to_string(SIGSEGV)) !=
+            std::string::npos);
+    ASSERT_EQ(NTest::detail::describe_exit(3 << 8), "exited with code 3");
+}
+#endif
+
+// ======================================================
+// Timing / timeouts
+// ======================================================
+
+TEST_TIMEOUT(TimeoutIsRecordedOnTestCase, 60000) {
+    ASSERT_EQ(_ntest_TimeoutIsRecordedOnTestCase.timeout.count(), 60000);
+}
+
+TEST(RunTestRecordsWallAndCpuTime) {
+    const auto result = NTest::run_test(_ntest_TestRegistrationWorks);
+    REQUIRE(result.ok());
+    REQUIRE(result.wall.count() > 0);
+    REQUIRE(result.cpu.count() >= 0);
+}
+
+TEST(SlowestReportIsSortedAndTruncated) {
+    NTest::TestResult a;
+    NTest::TestResult b;
+    NTest::TestResult c;
+    a.test = &_ntest_Order1;
+    b.test = &_ntest_Order2;
+    c.test = &_ntest_Order3;
+    a.wall = std::chrono::milliseconds(1);
+    b.wall = std::chrono::milliseconds(30);
+    c.wall = std::chrono::milliseconds(2);
+
+    const std::string report = NTest::format_slowest({&a, &b, &c}, 2);
+    const auto pos2 = report.find("Order2");
+    const auto pos3 = report.find("Order3");
+    REQUIRE(pos2 != std::string::npos && pos3 != std::string::npos);
+    REQUIRE(pos2 < pos3);
+    ASSERT_EQ(report.find("Order1"), std::string::npos);
+}
+
+// ======================================================
+// Allocation tracking
+// ======================================================
+
+TEST(AllocationScopeCountsThisThread) {
+    REQUIRE(NTest::allocation_tracking_enabled());
+
+    NTest::AllocationScope scope;
+    auto a = std::make_unique<char[]>(100);
+    {
+        auto b = std::make_unique<char[]>(50);
+        NTest::DoNotOptimize(b);
+    }
+    const auto stats = scope.stats();
+    ASSERT_EQ(stats.count, 2u);
+    ASSERT_EQ(stats.bytes, 150u);
+    ASSERT_EQ(stats.peak, 150);
+    ASSERT_EQ(stats.leaked, 100);
+}
+
+TEST(RequireNoAllocPassesOnHotPath) {
+    int sum = 0;
+    REQUIRE_NO_ALLOC(sum += 1);
+    REQUIRE_MAX_ALLOCS(1, std::make_unique<int>(sum));
+}
+
+TEST(RequireNoAllocFailsWhenAllocating) {
+    bool threw = false;
+    try {
+        REQUIRE_NO_ALLOC(std::vector<int>(16));
+    } catch (...) {
+        threw = true;
+    }
+    REQUIRE(threw);
+}
+
+TEST(AlignedAllocationsAreTracked) {
+    struct alignas(64) Wide {
+        char bytes[64];
+    };
+    NTest::AllocationScope scope;
+    auto w = std::make_unique<Wide>();
+    REQUIRE(reinterpret_cast<std::uintptr_t>(w.get()) % 64 == 0);
+    w.reset();
+    ASSERT_EQ(scope.stats().count, 1u);
+    ASSERT_EQ(scope.stats().leaked, 0);
+}
+
+TEST(SpawnedThreadsLeaveNoLeak) {
+    std::atomic<int> ran{0};
+    NTest::Thread first([&] { ran++; });  // sets up the test's thread state
+    first.join();
+
+    NTest::AllocationScope scope;
+    NTest::detail::run_on_threads(4, [&](unsigned) { ran++; });
+    NTest::Thread second([&] { ran++; });
+    second.join();
+    ASSERT_EQ(ran.load(), 6);
+    const auto stats = scope.stats();
+    REQUIRE(stats.count > 0);
+    ASSERT_EQ(stats.leaked, 0);
+}
+
+// ======================================================
+// Property-based testing
+// ======================================================
+
+PROPERTY(AdditionCommutes, NTest::gen::ints(-1000, 1000),
+         NTest::gen::ints(-1000, 1000))
+(int a, int b) {
+    REQUIRE_EQ(a + b, b + a);
+}
+
+PROPERTY(ReverseTwiceIsIdentity,
+         NTest::gen::vectors(NTest::gen::strings(8), 20))
+(std::vector<std::string> v) {
+    std::vector<std::string> w(v.rbegin(), v.rend());
+    std::reverse(w.begin(), w.end());
+    REQUIRE(w == v);
+}
+
+// Runs a property that is expected to fail and returns the report.
+template <typename Property, typename... Gens>
+static std::string falsify(const NTest::PropertyOptions& opts,
+                           Property property, const Gens&... gens) {
+    NTest::detail::TestContext ctx;
+    NTest::detail::invoke_guarded(
+        ctx, [&] { NTest::check_property(opts, property, gens...); });
+    return ctx.error;
+}
+
+TEST(PropertyShrinksToMinimalCounterexample) {
+    NTest::PropertyOptions opts;
+    opts.cases = 1000;
+    opts.seed = 42;
+    const std::string ints = falsify(
+        opts, [](int x) { REQUIRE(x < 100); }, NTest::gen::ints(0, 1000));
+    REQUIRE(ints.find("(100)") != std::string::npos);
+    REQUIRE(ints.find("seed 42") != std::string::npos);
+
+    const std::string vectors = falsify(
+        opts,
+        [](const std::vector<int>& v) {
+            REQUIRE(std::find(v.begin(), v.end(), 7) == v.end());
+        },
+        NTest::gen::vectors(NTest::gen::ints(0, 10)));
+    REQUIRE(vectors.find("([7])") != std::string::npos);
+
+    const std::string strings = falsify(
+        opts, [](const std::string& s) { REQUIRE(s.size() < 3); },
+        NTest::gen::strings());
+    REQUIRE(strings.find("(\"aaa\")") != std::string::npos);
+}
+
+TEST(PropertySearchIsDeterministicAcrossThreads) {
+    NTest::PropertyOptions opts;
+    opts.cases = 100000;
+    opts.batch = 64;
+    auto fails = [](std::size_t i) { return i == 70000 || i == 1234; };
+    for (unsigned threads : {1u, 4u}) {
+        opts.threads = threads;
+        const auto found = NTest::detail::find_counterexample(opts, fails);
+        REQUIRE(found.has_value());
+        REQUIRE_EQ(*found, 1234u);
+    }
+    opts.threads = 4;
+    REQUIRE(!NTest::detail::find_counterexample(
+                 opts, [](std::size_t) { return false; })
+                 .has_value());
+
+    // The same seed replays the same inputs.
+    NTest::Rng a(NTest::detail::case_seed(7, 3));
+    NTest::Rng b(NTest::detail::case_seed(7, 3));
+    REQUIRE_EQ(a.next(), b.next());
+}
+
+// ======================================================
+// Data-driven tests
+// ======================================================
+
+TEST_DATA(SelfTestSourceHasNoTabs, __FILE__, std::string_view, "[data]") {
+    REQUIRE(record.find('\t') == std::string_view::npos);
+}
+
+// Runs `check` under its own context and returns the reported failures.
+template <typename Check>
+static std::vector<std::string> data_failures(Check check) {
+    NTest::detail::TestContext ctx;
+    NTest::detail::invoke_guarded(ctx, check);
+    std::vector<std::string> text;
+    for (const auto& f : ctx.failures)
+        text.push_back(NTest::format_failure(f));
+    if (!ctx.error.empty())
+        text.push_back(ctx.error);
+    return text;
+}
+
+TEST(DelimitedRecordsAreSplitOnBoundaries) {
+    std::vector<std::string> seen;
+    NTest::check_records<NTest::Lines>(
+        "a\nbb\n\nccc", [&](std::string_view r) { seen.emplace_back(r); });
+    REQUIRE((seen == std::vector<std::string>{"a", "bb", "", "ccc"}));
+
+    std::string text;
+    for (int i = 0; i < 1000; ++i)
+        text += std::to_string(i) + "\n";
+    NTest::DataOptions opts;
+    opts.threads = 4;
+    opts.min_chunk = 16;
+    std::atomic<std::size_t> count{0};
+    NTest::check_records<std::string_view>(
+        text, [&](std::string_view) { ++count; }, opts);
+    REQUIRE_EQ(count.load(), 1000u);
+
+    // Failures come back in file order with their record and offset.
+    const auto failures = data_failures([&] {
+        NTest::check_records<NTest::Lines>(
+            text,
+            [](std::string_view r) {
+                EXPECT(r != "900");
+                EXPECT(r != "500");
+            },
+            opts, "numbers.txt");
+    });
+    REQUIRE_EQ(failures.size(), 2u);
+    REQUIRE(failures[0].find("record 500 at offset 1890 of numbers.txt") !=
+            std::string::npos);
+    REQUIRE(failures[1].find("record 900 at offset 3490") != std::string::npos);
+}
+
+TEST(MappedRecordsReportLowestFailure) {
+    const std::string path = "ntest-selftest.data";
+    {
+        std::ofstream out(path, std::ios::binary);
+        for (std::uint32_t i = 0; i < 100000; ++i)
+            out.write(reinterpret_cast<const char*>(&i), sizeof i);
+    }
+    NTest::DataOptions opts;
+    opts.min_chunk = 4096;
+    for (unsigned threads : {1u, 4u}) {
+        opts.threads = threads;
+        std::atomic<std::uint64_t> sum{0};
+        NTest::check_data<std::uint32_t>(
+            path, [&](std::uint32_t x) { sum += x; }, opts);
+        REQUIRE_EQ(sum.load(), 4999950000ull);
+
+        const auto failures = data_failures([&] {
+            NTest::check_data<std::uint32_t>(
+                path, [](std::uint32_t x) { REQUIRE(x % 25000 != 24999); },
+                opts);
+        });
+        REQUIRE_EQ(failures.size(), 1u);
+        REQUIRE(failures[0].find("record 24999 at offset 99996 of " + path) !=
+                std::string::npos);
+    }
+    std::remove(path.c_str());
+
+    const auto missing = data_failures([] {
+        NTest::check_data<std::uint32_t>("no-such-file.bin",
+                                         [](std::uint32_t) {});
+    });
+    REQUIRE_EQ(missing.size(), 1u);
+}
+
+// ======================================================
+// Stress / repeat
+// ======================================================
+
+// Each thread owns a slot and clears it on its first iteration, so the
+// test holds up under --repeat.
+TEST_STRESS(AtomicCounterUnderContention, 4, 2000, "[stress]") {
+    static std::atomic<std::uint64_t> counters[4];
+    REQUIRE(stress.thread < stress.threads);
+    std::atomic<std::uint64_t>& counter = counters[stress.thread];
+    if (stress.iteration == 0)
+        counter = 0;
+    REQUIRE_EQ(counter.fetch_add(1), stress.iteration);
+}
+
+TEST(StressReportsFirstFailureAndTiming) {
+    std::atomic<int> calls{0};
+    NTest::detail::TestContext ok;
+    REQUIRE(NTest::detail::invoke_guarded(ok, [&] {
+        NTest::check_stress(3, 100, [&](const NTest::StressState&) {
+            ++calls;
+        });
+    }));
+    REQUIRE_EQ(calls.load(), 300);
+    REQUIRE(ok.stress.has_value());
+    REQUIRE_EQ(ok.stress->threads, 3u);
+    REQUIRE_EQ(ok.stress->iterations, 300u);
+    REQUIRE(ok.stress->min <= ok.stress->p50);
+    REQUIRE(ok.stress->p50 <= ok.stress->p99);
+    REQUIRE(ok.stress->p99 <= ok.stress->max);
+
+    NTest::detail::TestContext failed;
+    REQUIRE(!NTest::detail::invoke_guarded(failed, [] {
+        NTest::check_stress(4, 1000, [](const NTest::StressState& s) {
+            REQUIRE(!(s.thread == 2 && s.iteration == 500));
+        });
+    }));
+    REQUIRE(!failed.failures.empty());
+    REQUIRE(NTest::format_failure(failed.failures.back())
+                .find("thread 2, iteration 500 of 1000") != std::string::npos);
+    REQUIRE(failed.stress->iterations < 4000u);
+}
+
+TEST(LatencyHistogramQuantilesAreClose) {
+    NTest::detail::LatencyHistogram h;
+    for (std::int64_t ns = 1; ns <= 10000; ++ns)
+        h.add(ns);
+    const NTest::StressStats s = h.stats();
+    REQUIRE_EQ(s.min.count(), 1);
+    REQUIRE_EQ(s.max.count(), 10000);
+    // Buckets are within 1/8 of a power of two.
+    REQUIRE(s.p50.count() > 4400 && s.p50.count() < 5600);
+    REQUIRE(s.p99.count() > 8700 && s.p99.count() <= 10000);
+}
+
+static int flaky_calls = 0;
+static void fails_on_third_call() { REQUIRE(++flaky_calls != 3); }
+
+TEST_SERIAL(RepeatUntilFailStopsAtFirstFailingRound) {
+    flaky_calls = 0;  // the suite itself may run under --repeat
+    NTest::TestCase flaky("Flaky", fails_on_third_call, __FILE__, __LINE__);
+    StringSink sink;
+    NTest::RunOptions opts;
+    opts.sink = &sink;
+    opts.repeat = 0;
+    opts.until_fail = true;
+    REQUIRE_EQ(NTest::run_tests({&flaky}, opts), 1);
+    REQUIRE_EQ(flaky_calls, 3);
+    REQUIRE(sink.text.find("[ROUND] 3\n") != std::string::npos);
+    REQUIRE(sink.text.find("2 passed, 1 failed.") != std::string::npos);
+
+    flaky_calls = 10;
+    opts.repeat = 4;
+    REQUIRE_EQ(NTest::run_tests({&flaky}, opts), 0);
+    REQUIRE_EQ(flaky_calls, 14);
+
+    char prog[] = "selftest";
+    char repeat[] = "--repeat=5";
+    char until[] = "--until-fail";
+    char* both[] = {prog, repeat, until};
+    REQUIRE_EQ(NTest::parse_args(3, both).repeat, 5u);
+    char* alone[] = {prog, until};
+    REQUIRE_EQ(NTest::parse_args(2, alone).repeat, 0u);
+}
+
+// ======================================================
+// Performance counters
+// ======================================================
+
+// Maps its own pages so that every call faults them in afresh; a heap
+// block may reuse pages that an earlier allocation already touched.
+static void touches_fresh_pages() {
+#if NTEST_HAS_MMAP
+    constexpr std::size_t kBytes = std::size_t{1} << 20;
+    void* const map = mmap(nullptr, kBytes, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    REQUIRE(map != MAP_FAILED);
+    char* pages = static_cast<char*>(map);
+    for (std::size_t i = 0; i < kBytes; i += 4096)
+        pages[i] = 1;
+    NTest::DoNotOptimize(pages);
+    munmap(map, kBytes);
+#else
+    std::vector<char> pages(1 << 20);
+    for (std::size_t i = 0; i < pages.size(); i += 4096)
+        pages[i] = 1;
+    NTest::DoNotOptimize(pages.data());
+#endif
+}
+
+TEST_SERIAL(PerfCountsAroundTestBody) {
+    const NTest::detail::PerfSupport& support = NTest::detail::perf_support();
+    if (support.events == 0)
+        return;  // no perf_event_open here (seccomp, paranoid 3, ...)
+    NTest::TestCase counted("Counted", touches_fresh_pages, __FILE__,
+                            __LINE__);
+    NTest::TestResult result;
+    {
+        const NTest::detail::PerfScope perf(true);
+        result = NTest::run_test(counted);
+    }
+    REQUIRE(result.ok());
+    REQUIRE(result.perf.has_value());
+    REQUIRE_EQ(result.perf->valid, support.events);
+    if (result.perf->has(NTest::PerfStats::TaskClock))
+        REQUIRE(result.perf->value[NTest::PerfStats::TaskClock] > 0);
+    if (result.perf->has(NTest::PerfStats::PageFaults))
+        REQUIRE(result.perf->value[NTest::PerfStats::PageFaults] > 0);
+
+    REQUIRE(!NTest::run_test(counted).perf.has_value());
+}
+
+static void sleeps_repeatedly() {
+    for (int i = 0; i < 20; ++i)
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+}
+
+TEST_SERIAL(PerfCountsContextSwitchesWhileBlocked) {
+    if (!NTest::detail::perf_support().has(NTest::PerfStats::ContextSwitches))
+        return;
+    NTest::TestCase sleeper("Sleeper", sleeps_repeatedly, __FILE__, __LINE__);
+    NTest::TestResult result;
+    {
+        const NTest::detail::PerfScope perf(true);
+        result = NTest::run_test(sleeper);
+    }
+    REQUIRE(result.perf.has_value());
+    REQUIRE(result.perf->has(NTest::PerfStats::ContextSwitches));
+    REQUIRE(result.perf->value[NTest::PerfStats::ContextSwitches] >= 20);
+}
+
+TEST(PerfStatsFormatting) {
+    NTest::PerfStats perf;
+    perf.value[NTest::PerfStats::Cycles] = 2000000;
+    perf.value[NTest::PerfStats::Instructions] = 3000000;
+    perf.value[NTest::PerfStats::TaskClock] = 1500;
+    perf.valid = 1u << NTest::PerfStats::Cycles |
+                 1u << NTest::PerfStats::Instructions |
+                 1u << NTest::PerfStats::TaskClock;
+    std::string out;
+    NTest::detail::append_perf(out, perf);
+    REQUIRE_EQ(out, std::string("cycles 2.00M, instructions 3.00M, IPC 1.50, "
+                                "task-clock 1.50 us"));
+    out.clear();
+    NTest::detail::append_perf(out, perf, 1000);
+    REQUIRE(out.find("cycles 2.00k") == 0);
+
+    char prog[] = "selftest";
+    char flag[] = "--perf";
+    char* argv[] = {prog, flag};
+    REQUIRE(NTest::parse_args(2, argv).perf);
+}
+
+// ======================================================
+// Worker threads
+// ======================================================
+
+static void expects_on_workers() {
+    std::vector<NTest::Thread> workers;
+    for (int i = 0; i < 3; ++i) {
+        workers.emplace_back([](int n) {
+            std::cout << "worker " << n << " done\n";
+            EXPECT(n < 0);
+        }, i);
+    }
+    for (auto& w : workers)
+        w.join();
+}
+
+TEST(ThreadExpectationsBelongToTheTest) {
+    NTest::TestCase test("Workers", expects_on_workers, __FILE__, __LINE__);
+    std::string captured;
+    NTest::detail::capture_target() = &captured;
+    const NTest::TestResult result = NTest::run_test(test);
+    NTest::detail::capture_target() = nullptr;
+    REQUIRE(result.ok());
+    REQUIRE_EQ(result.failures.size(), 3u);
+    for (const NTest::Failure& f : result.failures) {
+        REQUIRE(!f.fatal);
+        REQUIRE(f.msg.rfind("thread ", 0) == 0);
+    }
+    for (const char* line : {"worker 0 done\n", "worker 1 done\n",
+                             "worker 2 done\n"})
+        REQUIRE(captured.find(line) != std::string::npos);
+}
+
+static std::atomic<bool> spinner_saw_cancel{false};
+
+static void fatal_on_worker() {
+    NTest::Thread spinner([] {
+        while (!NTest::cancelled())
+            std::this_thread::yield();
+        spinner_saw_cancel = true;
+    });
+    NTest::Thread failing([] { REQUIRE_EQ(1 + 1, 3); });
+    failing.join();
+    REQUIRE_MSG(false, "not reached: join() fails the test");
+}
+
+static void throws_on_worker() {
+    NTest::Thread t([] { throw std::runtime_error("boom"); });
+}
+
+TEST(ThreadFatalFailureCancelsAndFailsTheTest) {
+    NTest::TestCase fatal("Fatal", fatal_on_worker, __FILE__, __LINE__);
+    const NTest::TestResult result = NTest::run_test(fatal);
+    REQUIRE(result.status == NTest::TestResult::Status::Failed);
+    REQUIRE(result.reason().find("1 + 1 == 3") != std::string::npos);
+    REQUIRE(result.reason().find("thread 2") != std::string::npos);
+    REQUIRE(spinner_saw_cancel.load());
+
+    // Not joined explicitly: reported when the test body returns.
+    NTest::TestCase thrown("Throws", throws_on_worker, __FILE__, __LINE__);
+    const NTest::TestResult threw = NTest::run_test(thrown);
+    REQUIRE(threw.status == NTest::TestResult::Status::Failed);
+    REQUIRE_EQ(threw.reason(), std::string("thread 1: boom"));
+}
+
+// ======================================================
+// Sampling profiler
+// ======================================================
+
+#if NTEST_HAS_PROFILER
+// Burns 50 ms of CPU time, the clock ITIMER_PROF counts, so a loaded
+// machine delays the samples instead of losing them. Gives up after 5 s.
+static void burns_cpu() {
+    const auto cpu_until = NTest::detail::thread_cpu_time() +
+                           std::chrono::milliseconds(50);
+    const auto wall_until = std::chrono::steady_clock::now() +
+                            std::chrono::seconds(5);
+    std::uint64_t x = 1;
+    while (NTest::detail::thread_cpu_time() < cpu_until &&
+           std::chrono::steady_clock::now() < wall_until) {
+        for (int i = 0; i < 1000; ++i)
+            x = x * 6364136223846793005ull + 1442695040888963407ull;
+        NTest::DoNotOptimize(x);
+    }
+}
+
+namespace {
+    // A fresh directory under /tmp, removed with the profiles the test
+    // names however the test ends.
+    struct ProfileDir {
+        std::string path;
+        std::vector<std::string> files;
+
+        ProfileDir() {
+            char name[] = "/tmp/ntest-profiles-XXXXXX";
+            if (const char* made = mkdtemp(name))
+                path = made;
+        }
+        ~ProfileDir() {
+            if (path.empty())
+                return;
+            for (const std::string& file : files)
+                std::remove((path + "/" + file).c_str());
+            std::remove(path.c_str());
+        }
+    };
+}  // namespace
+
+TEST_SERIAL(ProfileWritesFoldedStacks) {
+    ProfileDir dir;
+    REQUIRE(!dir.path.empty());
+    dir.files = {"Burner.folded", "Quick.folded"};
+    NTest::TestCase burner("Burner", burns_cpu, __FILE__, __LINE__);
+    NTest::TestCase quick("Quick", passing_body, __FILE__, __LINE__);
+    NTest::ProfileOptions opts;
+    opts.dir = dir.path;
+    opts.threshold = std::chrono::milliseconds(20);
+    NTest::TestResult burned;
+    NTest::TestResult skipped;
+    {
+        const NTest::detail::ProfileScope profiler(opts);
+        burned = NTest::run_test(burner);
+        skipped = NTest::run_test(quick);
+    }
+    REQUIRE(skipped.profile.empty());  // under the threshold
+    REQUIRE_EQ(burned.profile, opts.dir + "/Burner.folded");
+
+    std::ifstream in(burned.profile);
+    std::string line;
+    std::size_t samples = 0;
+    while (std::getline(in, line)) {
+        REQUIRE(line.rfind("Burner;", 0) == 0);
+        samples += std::stoul(line.substr(line.rfind(' ') + 1));
+    }
+    REQUIRE(samples > 0);  // about 50 at 1000 Hz
+
+    // An unusable directory turns profiling off rather than dropping
+    // each profile silently, and the run says why.
+    opts.dir = dir.path + "/missing/profiles";
+    {
+        const NTest::detail::ProfileScope profiler(opts);
+        REQUIRE(profiler.problem().find("cannot create profile directory") !=
+                std::string::npos);
+        REQUIRE(NTest::detail::profile_settings().dir.empty());
+        REQUIRE(NTest::run_test(burner).profile.empty());
+    }
+    StringSink sink;
+    NTest::RunOptions run;
+    run.sink = &sink;
+    run.profile = opts;
+    REQUIRE_EQ(NTest::run_tests({&quick}, run), 0);
+    REQUIRE(sink.text.find("[WARN] profiling disabled (cannot create") !=
+            std::string::npos);
+
+    char prog[] = "selftest";
+    char flag[] = "--profile=out";
+    char hz[] = "--profile-hz=250";
+    char* argv[] = {prog, flag, hz};
+    const NTest::RunOptions parsed = NTest::parse_args(3, argv);
+    REQUIRE_EQ(parsed.profile.dir, std::string("out"));
+    REQUIRE_EQ(parsed.profile.hz, 250u);
+}
+#endif
+
+// ======================================================
+// Performance budgets
+// ======================================================
+
+static std::uint64_t sum_bytes(const std::vector<unsigned char>& bytes) {
+    std::uint64_t sum = 0;
+    for (unsigned char b : bytes)
+        sum += b;
+    NTest::DoNotOptimize(sum);
+    return bytes.size();
+}
+
+TEST(BudgetsPassWithinLimits) {
+    const std::vector<unsigned char> bytes(4096, 1);
+    REQUIRE_FASTER_THAN(std::chrono::seconds(1), sum_bytes(bytes));
+    REQUIRE_FASTER_THAN(std::chrono::seconds(1), std::string(64, 'x'));
+    REQUIRE_FASTER_THAN(std::chrono::seconds(1), NTest::ClobberMemory());
+    REQUIRE_THROUGHPUT_AT_LEAST(1e3, sum_bytes(bytes));
+}
+
+TEST(BudgetsReportMedianAndLimit) {
+    using namespace std::chrono_literals;
+    NTest::detail::TestContext slow;
+    REQUIRE(!NTest::detail::invoke_guarded(slow, [] {
+        REQUIRE_FASTER_THAN(1us, std::this_thread::sleep_for(2ms));
+    }));
+    // Far over budget: one sample is enough.
+    REQUIRE(NTest::format_failure(slow.failures.back())
+                .find("per call over 1 sample of 1 call, limit 1.00 us") !=
+            std::string::npos);
+
+    NTest::detail::TestContext starved;
+    REQUIRE(!NTest::detail::invoke_guarded(starved, [] {
+        REQUIRE_THROUGHPUT_AT_LEAST(
+            1e12, (std::this_thread::sleep_for(100us), 1));
+    }));
+    const std::string msg = NTest::format_failure(starved.failures.back());
+    REQUIRE(msg.find("over 9 samples") != std::string::npos);
+    REQUIRE(msg.find("need at least 1000.00G/s") != std::string::npos);
+}
+
+TEST(RssGrowthCombinesCurrentAndPeak) {
+    NTest::detail::RssSample before;
+    before.current = 100;
+    before.peak = 500;
+    NTest::detail::RssSample after = before;
+    after.current = 150;
+    REQUIRE_EQ(NTest::detail::rss_growth(before, after), 50);
+    after.peak = 900;  // touched and released 800 bytes
+    REQUIRE_EQ(NTest::detail::rss_growth(before, after), 800);
+}
+
+TEST_SERIAL(RssGrowthCatchesResidentMemory) {
+    if (NTest::detail::rss_now().current < 0)
+        return;  // no /proc/self/statm
+    std::vector<char> kept;
+    REQUIRE_MAX_RSS_GROWTH(64 << 20, kept.assign(1 << 20, 1));
+
+    NTest::detail::TestContext grown;
+    REQUIRE(!NTest::detail::invoke_guarded(grown, [&] {
+        REQUIRE_MAX_RSS_GROWTH(1 << 20, kept.assign(32 << 20, 1));
+    }));
+    REQUIRE(NTest::format_failure(grown.failures.back())
+                .find(", limit 1.0 MiB") != std::string::npos);
+}
+
+// ======================================================
+// Bulk assertions
+// ======================================================
+
+static std::string fatal_message(NTest::detail::TestContext& ctx) {
+    return ctx.failures.empty() ? std::string()
+                                : ctx.failures.back().msg;
+}
+
+TEST(BulkEqualityFindsFirstMismatchAndCount) {
+    std::vector<std::uint32_t> a(1000);
+    for (std::size_t i = 0; i < a.size(); ++i)
+        a[i] = static_cast<std::uint32_t>(i * 2654435761u);
+    std::vector<std::uint32_t> b = a;
+    REQUIRE_ARRAY_EQ(a, b);
+    REQUIRE_BYTES_EQ(NTest::bytes(a.data(), 4000), b);
+
+    b[517] ^= 1u << 24;  // a high byte, past several vector blocks
+    b[998] = 7;
+    NTest::detail::TestContext arrays;
+    REQUIRE(!NTest::detail::invoke_guarded(arrays,
+                                           [&] { REQUIRE_ARRAY_EQ(a, b); }));
+    REQUIRE(fatal_message(arrays).rfind(
+                "2 of 1000 elements differ, first at [517]: ", 0) == 0);
+
+    NTest::detail::TestContext raw;
+    REQUIRE(!NTest::detail::invoke_guarded(raw, [&] {
+        REQUIRE_BYTES_EQ(NTest::bytes(a.data(), 4000), b);
+    }));
+    REQUIRE(fatal_message(raw).find("differ, first at [2071]") !=
+            std::string::npos);
+
+    NTest::detail::TestContext sizes;
+    REQUIRE(!NTest::detail::invoke_guarded(sizes, [&] {
+        REQUIRE_ARRAY_EQ(a, std::vector<std::uint32_t>(3));
+    }));
+    REQUIRE_EQ(fatal_message(sizes), std::string("sizes differ: 1000 vs 3"));
+}
+
+TEST(AllNearReportsWorstElement) {
+    std::vector<float> ref(999);
+    for (std::size_t i = 0; i < ref.size(); ++i)
+        ref[i] = std::sin(static_cast<float>(i)) * 100.0f;
+    std::vector<float> out = ref;
+    out[3] = std::nextafter(out[3], 1e9f);
+    out[500] = std::nextafter(std::nextafter(out[500], 1e9f), 1e9f);
+    out[10] = std::numeric_limits<float>::quiet_NaN();
+    ref[10] = out[10];
+    REQUIRE_ALL_NEAR(out, ref, NTest::Tolerance::ulp(2));
+    REQUIRE_ALL_NEAR(out, ref, NTest::Tolerance::within(1e-3, 1e-6));
+
+    NTest::detail::TestContext ulps;
+    REQUIRE(!NTest::detail::invoke_guarded(ulps, [&] {
+        REQUIRE_ALL_NEAR(out, ref, NTest::Tolerance::ulp(1));
+    }));
+    const std::string msg = fatal_message(ulps);
+    REQUIRE(msg.rfind("1 of 999 elements differ, first at [500]", 0) == 0);
+    REQUIRE(msg.find("max error 2 ulps at [500], tolerance 1 ulps") !=
+            std::string::npos);
+
+    std::vector<double> x(64, 1.0);
+    std::vector<double> y = x;
+    y[40] = 1.5;
+    y[41] = -0.0;
+    x[41] = 0.0;
+    NTest::detail::TestContext abs;
+    REQUIRE(!NTest::detail::invoke_guarded(abs, [&] {
+        REQUIRE_ALL_NEAR(x, y, NTest::Tolerance::within(0.1));
+    }));
+    REQUIRE(fatal_message(abs).find("max error 0.5 at [40]") !=
+            std::string::npos);
+    REQUIRE_ALL_NEAR(x, y, NTest::Tolerance::within(0.5));
+    REQUIRE_ALL_NEAR(x, y, NTest::Tolerance::ulp(1ull << 52));
+}
+
+TEST(BulkKernelsAgreeWithScalarLoops) {
+    // A mismatch at every position of the vector blocks and the tail.
+    for (std::size_t at = 0; at < 100; ++at) {
+        std::vector<unsigned char> a(100, 9);
+        std::vector<unsigned char> b = a;
+        b[at] = 8;
+        REQUIRE_EQ(NTest::detail::first_byte_mismatch(a.data(), b.data(),
+                                                      a.size()),
+                   at);
+        std::vector<float> f(37, 2.0f);
+        std::vector<float> g = f;
+        if (at < f.size()) {
+            g[at] = 2.5f;
+            const auto tol = NTest::Tolerance::within(0.25);
+            REQUIRE_EQ(NTest::detail::first_far(f.data(), g.data(), f.size(),
+                                                tol),
+                       at);
+            REQUIRE_EQ(NTest::detail::first_far(f.data(), g.data(), f.size(),
+                                                NTest::Tolerance::ulp(4)),
+                       at);
+        }
+    }
+}
+
+// ======================================================
+// Benchmarks
+// ======================================================
+
+static int bench_body_runs = 0;
+
+BENCHMARK(SelfBenchAccumulate) {
+    ++bench_body_runs;
+    int sum = 0;
+    for (auto _ : state) {
+        sum += 1;
+        NTest::DoNotOptimize(sum);
+    }
+}
+
+TEST(DoNotOptimizeAcceptsAnyType) {
+    // Instantiated for register-sized scalars, odd-sized aggregates and
+    // class types; GCC used to reject some of these once inlined.
+    struct Odd {
+        char c[3];
+    };
+    unsigned long word = 1;
+    double real = 2;
+    Odd odd{};
+    std::vector<int> v(3);
+    const Odd fixed{};
+    NTest::DoNotOptimize(word);
+    NTest::DoNotOptimize(real);
+    NTest::DoNotOptimize(odd);
+    NTest::DoNotOptimize(v);
+    NTest::DoNotOptimize(fixed);
+    NTest::DoNotOptimize(word + 1);
+    REQUIRE_EQ(word, 1ul);
+    REQUIRE_EQ(v.size(), 3u);
+}
+
+TEST(SummarizeComputesRobustStats) {
+    const auto st = NTest::summarize({5, 1, 3, 2, 4, 100});
+    ASSERT_EQ(st.min, 1.0);
+    ASSERT_EQ(st.median, 3.5);
+    ASSERT_EQ(st.mean, 115.0 / 6);
+    ASSERT_EQ(st.mad, 1.5);  // |x - 3.5| -> 1.5 2.5 0.5 1.5 0.5 96.5
+    REQUIRE(st.stddev > 30 && st.stddev < 50);
+}
+
+TEST_SERIAL(RunBenchmarkCalibratesIterations) {
+    NTest::BenchmarkOptions opts;
+    opts.warmup = std::chrono::milliseconds(1);
+    opts.sample_time = std::chrono::milliseconds(1);
+    opts.samples = 5;
+
+    const auto result =
+        NTest::run_benchmark(_ntest_SelfBenchAccumulate, opts);
+    REQUIRE_MSG(result.ok(), result.error.c_str());
+    REQUIRE(result.iterations > 1);
+    ASSERT_EQ(result.samples.size(), 5u);
+    REQUIRE(result.stats.min <= result.stats.median);
+    REQUIRE(bench_body_runs > 5);
+}
+
+TEST(BaselineFlagsImplyBenchmarks) {
+    char prog[] = "selftest";
+    char save[] = "--benchmark-save";
+    char compare[] = "--benchmark-compare";
+    char file[] = "baseline.txt";
+    char* save_argv[] = {prog, save, file};
+    char* compare_argv[] = {prog, compare, file};
+    const NTest::RunOptions saving = NTest::parse_args(3, save_argv);
+    REQUIRE(saving.benchmarks);
+    REQUIRE_EQ(saving.benchmark.save_baseline, std::string("baseline.txt"));
+    REQUIRE(NTest::parse_args(3, compare_argv).benchmarks);
+}
+
+#if NTEST_EXCEPTIONS
+// Nothing stops an exception type from returning "" from what().
+struct Wordless : std::exception {
+    const char* what() const noexcept override { return ""; }
+};
+
+static void throws_wordless(NTest::BenchmarkState&) { throw Wordless(); }
+
+TEST(BenchmarkReportsWordlessException) {
+    const NTest::TestCase bench("Wordless", throws_wordless, __FILE__,
+                                __LINE__);
+    const auto result = NTest::run_benchmark(bench, NTest::BenchmarkOptions{});
+    REQUIRE(!result.ok());
+    REQUIRE_EQ(result.error, std::string("unknown exception"));
+}
+#endif
+
+// ======================================================
+// Complexity
+// ======================================================
+
+BENCHMARK_RANGE(SelfBenchSortRange, 1 << 8, 1 << 14) {
+    REQUIRE_COMPLEXITY_AT_MOST(O_N_SQUARED);
+    std::vector<int> input(static_cast<std::size_t>(state.range()));
+    for (std::size_t i = 0; i < input.size(); ++i)
+        input[i] = static_cast<int>((i * 2654435761u) % 1000003u);
+    std::vector<int> v;
+    for (auto _ : state) {
+        state.pause_timing();
+        v = input;
+        state.resume_timing();
+        std::sort(v.begin(), v.end());
+        NTest::DoNotOptimize(v.data());
+    }
+}
+
+TEST(FitComplexityPicksGeneratingModel) {
+    const std::vector<std::int64_t> sizes = {16, 64, 256, 1024, 4096};
+    std::vector<double> ns;
+    for (std::int64_t n : sizes)
+        ns.push_back(3.0 * n * std::log2(static_cast<double>(n)));
+    const auto fits = NTest::fit_complexity(sizes, ns);
+    REQUIRE_EQ(fits.size(), 5u);
+    const auto& nlogn = fits[static_cast<int>(NTest::Complexity::O_N_LOG_N)];
+    REQUIRE(nlogn.rms < 1e-9);
+    REQUIRE(std::fabs(nlogn.coefficient - 3.0) < 1e-9);
+    for (const auto& fit : fits)
+        REQUIRE(fit.model == NTest::Complexity::O_N_LOG_N || fit.rms > 0.05);
+
+    REQUIRE_EQ(NTest::detail::range_sizes(8, 100),
+               (std::vector<std::int64_t>{8, 16, 32, 64, 100}));
+}
+
+static void quadratic_but_bounded_linear(NTest::BenchmarkState& state) {
+    REQUIRE_COMPLEXITY_AT_MOST(O_N);
+    const auto n = static_cast<std::size_t>(state.range());
+    for (auto _ : state) {
+        std::size_t pairs = 0;
+        for (std::size_t i = 0; i < n; ++i)
+            for (std::size_t j = 0; j < n; ++j)
+                pairs += (i ^ j) & 1;
+        NTest::DoNotOptimize(pairs);
+    }
+}
+
+TEST_SERIAL(ComplexityBoundFailsQuadraticBody) {
+    NTest::TestCase bench("Quadratic", quadratic_but_bounded_linear,
+                          __FILE__, __LINE__, "", 64, 1024);
+    NTest::BenchmarkOptions opts;
+    opts.warmup = std::chrono::milliseconds(1);
+    opts.sample_time = std::chrono::milliseconds(1);
+    opts.samples = 3;
+    const NTest::ComplexityResult result =
+        NTest::run_benchmark_range(bench, opts);
+    REQUIRE_EQ(result.points.size(), 5u);
+    REQUIRE_EQ(NTest::detail::benchmark_name(result.points[1]),
+               std::string("Quadratic/128"));
+    REQUIRE(result.best.model > NTest::Complexity::O_N);
+    REQUIRE(!result.ok());
+    REQUIRE(result.error.find("complexity <= O_N") != std::string::npos);
+    REQUIRE(result.error.find(", limit O(n)") != std::string::npos);
+}
+
+// Per-assertion cost of the recording fast path next to the legacy
+// ostringstream + std::runtime_error path it replaced.
+
+BENCHMARK(AssertionExpectEqPassing) {
+    int i = 0;
+    for (auto _ : state) {
+        EXPECT_EQ(i, i);
+        NTest::DoNotOptimize(++i);
+    }
+}
+
+BENCHMARK(AssertionExpectEqFailing) {
+    NTest::detail::TestContext ctx;
+    NTest::detail::ContextScope scope(ctx);
+    int i = 0;
+    for (auto _ : state) {
+        EXPECT_EQ(i, i + 1);
+        ctx.failures.clear();
+        NTest::DoNotOptimize(++i);
+    }
+}
+
+BENCHMARK(AssertionRequireEqFailing) {
+    int i = 0;
+    for (auto _ : state) {
+        try {
+            REQUIRE_EQ(i, i + 1);
+        } catch (const NTest::AssertionFailure&) {
+        }
+        NTest::DoNotOptimize(++i);
+    }
+}
+
+static void legacy_fail(const char* expr, const char* file, int line) {
+    std::ostringstream oss;
+    oss << "Assertion failed: " << expr << " (" << file << ":" << line << ")";
+    throw std::runtime_error(oss.str());
+}
+
+BENCHMARK(AssertionLegacyExpectEqFailing) {
+    int i = 0;
+    std::ostringstream sink;
+    for (auto _ : state) {
+        try {
+            if (!(i == i + 1))
+                legacy_fail("i == i + 1", __FILE__, __LINE__);
+        } catch (const std::exception& e) {
+            sink.str("");
+            sink << "[EXPECT FAIL] " << e.what() << "\n";
+        }
+        NTest::DoNotOptimize(++i);
+    }
+}
+
+TEST(MannWhitneySeparatesShiftedSamples) {
+    const std::vector<double> fast = {10, 11, 10.5, 9.8, 10.2, 10.1, 9.9, 10.4};
+    const std::vector<double> slow = {12,   12.5, 11.8, 12.2,
+                                      12.9, 12.1, 13,   12.4};
+    REQUIRE(NTest::mann_whitney(slow, fast).p < 0.001);
+    REQUIRE(NTest::mann_whitney(fast, slow).p > 0.999);
+
+    const auto same = NTest::mann_whitney(fast, fast);
+    REQUIRE(same.p > 0.4 && same.p < 0.6);
+}
+
+TEST(BaselineRoundTripsAndFlagsRegression) {
+    NTest::BenchmarkResult before;
+    before.bench = &_ntest_SelfBenchAccumulate;
+    before.samples = {10, 11, 10.5, 9.8, 10.2, 10.1, 9.9, 10.4};
+
+    std::stringstream file;
+    NTest::write_baseline(file, {before});
+    const NTest::Baseline baseline = NTest::read_baseline(file);
+    ASSERT_EQ(baseline.at("SelfBenchAccumulate"), before.samples);
+
+    NTest::BenchmarkResult after = before;
+    after.samples = {12, 12.5, 11.8, 12.2, 12.9, 12.1, 13, 12.4};
+    after.stats = NTest::summarize(after.samples);
+    const auto cmp =
+        NTest::compare_to_baseline(after, baseline, NTest::BenchmarkOptions{});
+    REQUIRE(cmp.verdict == NTest::BenchmarkComparison::Verdict::Regression);
+    REQUIRE(cmp.delta > 0.15 && cmp.delta < 0.25);
+
+    std::stringstream garbage("not a baseline");
+    REQUIRE_THROW(NTest::read_baseline(garbage));
+}
+
+// ======================================================
+// Light header
+// ======================================================
+
+// Defined in core_tests.cpp, which includes only NTestCore.h.
+extern int core_expect_reached_end;
+void core_expect_body();
 
-TEST(RegistrationOrderPreserved) {
-    ASSERT_EQ(order.size(), 3);
-    ASSERT_EQ(order[0], 1);
-    ASSERT_EQ(order[1], 2);
-    ASSERT_EQ(order[2], 3);
+TEST(CoreOnlyExpectIsRecorded, "[core]") {
+    NTest::TestCase body("CoreExpect", core_expect_body, __FILE__, __LINE__);
+    core_expect_reached_end = 0;
+    const NTest::TestResult result = NTest::run_test(body);
+    REQUIRE_EQ(result.failures.size(), 1u);
+    REQUIRE(!result.failures[0].fatal);
+    REQUIRE_EQ(core_expect_reached_end, 1);
 }
 
 // ======================================================
 // Entry point
 // ======================================================
 
-int main() {
-    return NTest::run_all();
+int main(int argc, char** argv) {
+    return NTest::run_all(argc, argv);
     // int failed = NTest::run_all();
     // std::cout << "Num Failed: " << failed
     //           << "; Expected: " << NTest::EXPECTED_FAILURES() << "\n";